@@ -0,0 +1,131 @@
+//
+//  BeamModel.h
+//  Mapping
+//
+//  The geometry of a scanning range sensor: beams at a fixed angular step
+//  from a first angle, and the range beyond which nothing was seen. The
+//  direction of every beam in the sensor frame is worked out once, so a
+//  sweep needs no trigonometry; converting a sweep of ranges into grid
+//  cells is then, for each beam,
+//      rotate its direction from the sensor frame into the universe by the
+//      heading (unitX, unitY), as the sensor loop in Mapping.cpp did,
+//      scale by the range and move to the sensor's position,
+//      round to the nearest cell (halves away from zero, like round(),
+//      counting from the sensor's cell),
+//      drop the beam if its range is not in (0, maximum].
+//  All of it is one pass over the ranges, four beams at a time with SSE2
+//  where there is SSE2. The offsets from the sensor are single precision;
+//  the sensor's position is split into its nearest cell, added as an
+//  integer, and the fraction left over, so the error depends on the range
+//  and not on how far the sensor is from the origin. A return that falls
+//  within a few thousandths of a cell of a half may round the other way
+//  than it would in double (about one in six thousand at a few hundred
+//  inches), but never by more than a cell. Dropped beams are squeezed out
+//  without branches.
+//
+
+#ifndef _BEAM_MODEL_H
+#define _BEAM_MODEL_H
+
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define BEAM_MODEL_SSE2 1
+#endif
+
+class BeamModel
+{
+public:
+    BeamModel(double aFirstDeg, double aStepDeg, int aCount, double aMaxRange)
+        : count(aCount)
+        , maxRange((float)aMaxRange)
+        , cosines(aCount)
+        , sines(aCount)
+    {
+        const double DTR = 3.141592653589793 / 180.0;
+        for (int k = 0; k < aCount; ++k)
+        {
+            double angle = (aFirstDeg + k * aStepDeg) * DTR;
+            cosines[k] = (float)cos(angle);
+            sines[k] = (float)sin(angle);
+        }
+    }
+
+    int beams() const { return count; }
+
+    // Convert a sweep of ranges (aRange[beams()]) taken at (aX, aY) facing
+    // (aUnitX, aUnitY) into the cells (aI[n], aJ[n]) of its returns, in beam
+    // order; returns n, the returns in range
+    int toGrid(const int *aRange, double aX, double aY, double aUnitX, double aUnitY, int *aI, int *aJ) const
+    {
+        const double cellX = floor(aX + 0.5);
+        const double cellY = floor(aY + 0.5);
+        const int baseJ = (int)cellX;
+        const int baseI = -(int)cellY;
+        const float x = (float)(aX - cellX);
+        const float y = (float)(aY - cellY);
+        const float ux = (float)aUnitX;
+        const float uy = (float)aUnitY;
+        int n = 0;
+        int k = 0;
+
+#if defined(BEAM_MODEL_SSE2)
+        const __m128 vx = _mm_set1_ps(x);
+        const __m128 vy = _mm_set1_ps(y);
+        const __m128 vux = _mm_set1_ps(ux);
+        const __m128 vuy = _mm_set1_ps(uy);
+        const __m128 half = _mm_set1_ps(0.5f);
+        const __m128 sign = _mm_set1_ps(-0.0f);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 most = _mm_set1_ps(maxRange);
+        const __m128i vi = _mm_set1_epi32(baseI);
+        const __m128i vj = _mm_set1_epi32(baseJ);
+        for (; k + 4 <= count; k += 4)
+        {
+            __m128 c = _mm_loadu_ps(&cosines[k]);
+            __m128 s = _mm_loadu_ps(&sines[k]);
+            __m128 r = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(aRange + k)));
+
+            // x + r (c uy + s ux), y + r (s uy - c ux)
+            __m128 px = _mm_add_ps(vx, _mm_mul_ps(r, _mm_add_ps(_mm_mul_ps(c, vuy), _mm_mul_ps(s, vux))));
+            __m128 py = _mm_add_ps(vy, _mm_mul_ps(r, _mm_sub_ps(_mm_mul_ps(s, vuy), _mm_mul_ps(c, vux))));
+
+            // Halves away from zero: truncate after adding a half of the same sign
+            __m128i j = _mm_add_epi32(vj, _mm_cvttps_epi32(_mm_add_ps(px, _mm_or_ps(half, _mm_and_ps(px, sign)))));
+            __m128i i = _mm_add_epi32(vi, _mm_cvttps_epi32(_mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(py, _mm_or_ps(half, _mm_and_ps(py, sign))))));
+            int keep = _mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(r, zero), _mm_cmple_ps(r, most)));
+
+            int ii[4], jj[4];
+            _mm_storeu_si128((__m128i *)ii, i);
+            _mm_storeu_si128((__m128i *)jj, j);
+            for (int b = 0; b < 4; ++b)
+            {
+                aI[n] = ii[b];
+                aJ[n] = jj[b];
+                n += (keep >> b) & 1;
+            }
+        }
+#endif
+
+        for (; k < count; ++k)
+        {
+            float r = (float)aRange[k];
+            float px = x + r * (cosines[k] * uy + sines[k] * ux);
+            float py = y + r * (sines[k] * uy - cosines[k] * ux);
+            aI[n] = baseI - (int)(py + (py < 0.0f ? -0.5f : 0.5f));
+            aJ[n] = baseJ + (int)(px + (px < 0.0f ? -0.5f : 0.5f));
+            n += (r > 0.0f) && (r <= maxRange);
+        }
+        return n;
+    }
+
+private:
+    int count;
+    float maxRange;
+    std::vector<float> cosines;     // Beam directions in the sensor frame
+    std::vector<float> sines;
+};
+
+#endif	/* _BEAM_MODEL_H */
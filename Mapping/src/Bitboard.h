@@ -0,0 +1,291 @@
+//
+//  Bitboard.h
+//  Mapping
+//
+//  A presence map of bit tiles with whole-word operations. Each row of a
+//  tile is one 64-bit word, so
+//      merging, masking or clearing a map is a loop over words that the
+//      compiler can vectorize, running at memory bandwidth,
+//      counting occupied cells is a popcount per word,
+//      growing or shrinking obstacles by a cell (dilation and erosion over
+//      the 3x3 neighbourhood) is shifts within a row, with the edge bits
+//      of the tiles either side shifted in, and then ORs or ANDs of each
+//      row with the rows above and below,
+//      listing the occupied cells skips straight from one set bit to the
+//      next.
+//  Cells outside the tiles written so far are clear.
+//
+
+#ifndef _BITBOARD_H
+#define _BITBOARD_H
+
+#include <cstdint>
+#include <cstring>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include "TiledMap.h"
+
+inline uint64_t bitCount(uint64_t aBits)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    return __popcnt64(aBits);
+#elif defined(_MSC_VER)
+    return __popcnt((uint32_t)aBits) + __popcnt((uint32_t)(aBits >> 32));
+#else
+    return __builtin_popcountll(aBits);
+#endif
+}
+
+// Index of the lowest set bit; aBits must not be zero
+inline int lowestBit(uint64_t aBits)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, aBits);
+    return (int)index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if (_BitScanForward(&index, (uint32_t)aBits))
+    {
+        return (int)index;
+    }
+    _BitScanForward(&index, (uint32_t)(aBits >> 32));
+    return (int)index + 32;
+#else
+    return __builtin_ctzll(aBits);
+#endif
+}
+
+class Bitboard : public TiledMap<BitTile>
+{
+public:
+    // Set every cell set in aOther
+    void merge(const Bitboard &aOther)
+    {
+        for (tile_iter it = aOther.begin(); it != aOther.end(); ++it)
+        {
+            const uint64_t *from = it->second->rows;
+            uint64_t *to = tileAt(tileRow(it->first), tileCol(it->first)).rows;
+            for (int r = 0; r < TILE_SIZE; ++r)
+            {
+                to[r] |= from[r];
+            }
+        }
+    }
+
+    // Keep only the cells also set in aOther
+    void intersect(const Bitboard &aOther)
+    {
+        for (tiles_t::iterator it = begin(); it != end(); ++it)
+        {
+            const BitTile *mask = aOther.findAt(tileRow(it->first), tileCol(it->first));
+            uint64_t *to = it->second->rows;
+            if (!mask)
+            {
+                memset(to, 0, sizeof(it->second->rows));
+                continue;
+            }
+            for (int r = 0; r < TILE_SIZE; ++r)
+            {
+                to[r] &= mask->rows[r];
+            }
+        }
+    }
+
+    // Clear every cell set in aOther
+    void subtract(const Bitboard &aOther)
+    {
+        for (tiles_t::iterator it = begin(); it != end(); ++it)
+        {
+            const BitTile *mask = aOther.findAt(tileRow(it->first), tileCol(it->first));
+            if (mask)
+            {
+                uint64_t *to = it->second->rows;
+                for (int r = 0; r < TILE_SIZE; ++r)
+                {
+                    to[r] &= ~mask->rows[r];
+                }
+            }
+        }
+    }
+
+    // Clear every cell but keep the tiles for reuse
+    void zero()
+    {
+        for (tiles_t::iterator it = begin(); it != end(); ++it)
+        {
+            memset(it->second->rows, 0, sizeof(it->second->rows));
+        }
+    }
+
+    // Set the cells of aMap above aLevel and clear the rest
+    void threshold(const TiledMap<ByteTile> &aMap, signed char aLevel)
+    {
+        clear();
+        for (TiledMap<ByteTile>::tile_iter it = aMap.begin(); it != aMap.end(); ++it)
+        {
+            BitTile &to = tileAt(tileRow(it->first), tileCol(it->first));
+            for (int r = 0; r < TILE_SIZE; ++r)
+            {
+                const signed char *cells = it->second->cells[r];
+                uint64_t bits = 0;
+                for (int c = 0; c < TILE_SIZE; ++c)
+                {
+                    bits |= (uint64_t)(cells[c] > aLevel) << c;
+                }
+                to.rows[r] = bits;
+            }
+        }
+    }
+
+    // Cells set, in the whole map or in rows aFirstI..aLastI and columns
+    // aFirstJ..aLastJ
+    uint64_t count() const
+    {
+        uint64_t total = 0;
+        for (tile_iter it = begin(); it != end(); ++it)
+        {
+            for (int r = 0; r < TILE_SIZE; ++r)
+            {
+                total += bitCount(it->second->rows[r]);
+            }
+        }
+        return total;
+    }
+
+    uint64_t count(int aFirstI, int aFirstJ, int aLastI, int aLastJ) const
+    {
+        uint64_t total = 0;
+        for (int ti = aFirstI >> TILE_SHIFT; ti <= (aLastI >> TILE_SHIFT); ++ti)
+        {
+            for (int tj = aFirstJ >> TILE_SHIFT; tj <= (aLastJ >> TILE_SHIFT); ++tj)
+            {
+                const BitTile *tile = findAt(ti, tj);
+                if (!tile)
+                {
+                    continue;
+                }
+                int r0 = (ti * TILE_SIZE) < aFirstI ? aFirstI & TILE_MASK : 0;
+                int r1 = ((ti * TILE_SIZE) | TILE_MASK) > aLastI ? aLastI & TILE_MASK : TILE_MASK;
+                int c0 = (tj * TILE_SIZE) < aFirstJ ? aFirstJ & TILE_MASK : 0;
+                int c1 = ((tj * TILE_SIZE) | TILE_MASK) > aLastJ ? aLastJ & TILE_MASK : TILE_MASK;
+                uint64_t columns = (~(uint64_t)0 << c0) & (~(uint64_t)0 >> (TILE_MASK - c1));
+                for (int r = r0; r <= r1; ++r)
+                {
+                    total += bitCount(tile->rows[r] & columns);
+                }
+            }
+        }
+        return total;
+    }
+
+    // Call aVisit(i, j) for every cell set, a tile at a time
+    template <class Visit>
+    void forEachSet(Visit aVisit) const
+    {
+        for (tile_iter it = begin(); it != end(); ++it)
+        {
+            int i0 = tileRow(it->first) * TILE_SIZE;
+            int j0 = tileCol(it->first) * TILE_SIZE;
+            for (int r = 0; r < TILE_SIZE; ++r)
+            {
+                uint64_t bits = it->second->rows[r];
+                while (bits)
+                {
+                    aVisit(i0 + r, j0 + lowestBit(bits));
+                    bits &= bits - 1;
+                }
+            }
+        }
+    }
+
+    // Into aOut (not this map): every cell within one cell of a set cell
+    void dilate(Bitboard &aOut) const
+    {
+        aOut.clear();
+        for (tile_iter it = begin(); it != end(); ++it)
+        {
+            // The tile and its neighbours, unless done already
+            for (int di = -1; di <= 1; ++di)
+            {
+                for (int dj = -1; dj <= 1; ++dj)
+                {
+                    int ti = tileRow(it->first) + di;
+                    int tj = tileCol(it->first) + dj;
+                    if (!aOut.findAt(ti, tj))
+                    {
+                        BitTile result;
+                        if (morph(ti, tj, true, result) || findAt(ti, tj))
+                        {
+                            aOut.tileAt(ti, tj) = result;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Into aOut (not this map): every cell whose 3x3 neighbourhood is all set
+    void erode(Bitboard &aOut) const
+    {
+        aOut.clear();
+        for (tile_iter it = begin(); it != end(); ++it)
+        {
+            morph(tileRow(it->first), tileCol(it->first), false, aOut.tileAt(tileRow(it->first), tileCol(it->first)));
+        }
+    }
+
+private:
+    const BitTile *findAt(int aTileI, int aTileJ) const
+    {
+        return find(aTileI * TILE_SIZE, aTileJ * TILE_SIZE);
+    }
+
+    BitTile &tileAt(int aTileI, int aTileJ)
+    {
+        return tile(aTileI * TILE_SIZE, aTileJ * TILE_SIZE);
+    }
+
+    static uint64_t row(const BitTile *aTile, int aRow)
+    {
+        return aTile ? aTile->rows[aRow] : 0;
+    }
+
+    // Dilate (aGrow) or erode tile (aTileI, aTileJ) into aResult; returns
+    // true if any cell of the result is set
+    bool morph(int aTileI, int aTileJ, bool aGrow, BitTile &aResult) const
+    {
+        const BitTile *around[3][3];
+        for (int di = 0; di < 3; ++di)
+        {
+            for (int dj = 0; dj < 3; ++dj)
+            {
+                around[di][dj] = findAt(aTileI + di - 1, aTileJ + dj - 1);
+            }
+        }
+
+        // Each row with its neighbours either side, from the last row of
+        // the tile above to the first of the tile below
+        uint64_t across[TILE_SIZE + 2];
+        for (int r = 0; r < TILE_SIZE + 2; ++r)
+        {
+            int source = r == 0 ? 0 : r == TILE_SIZE + 1 ? 2 : 1;
+            int sourceRow = (r - 1) & TILE_MASK;
+            uint64_t centre = row(around[source][1], sourceRow);
+            uint64_t left = (centre << 1) | (row(around[source][0], sourceRow) >> TILE_MASK);
+            uint64_t right = (centre >> 1) | (row(around[source][2], sourceRow) << TILE_MASK);
+            across[r] = aGrow ? (centre | left | right) : (centre & left & right);
+        }
+
+        uint64_t any = 0;
+        for (int r = 0; r < TILE_SIZE; ++r)
+        {
+            aResult.rows[r] = aGrow ? (across[r] | across[r + 1] | across[r + 2]) : (across[r] & across[r + 1] & across[r + 2]);
+            any |= aResult.rows[r];
+        }
+        return any != 0;
+    }
+};
+
+#endif	/* _BITBOARD_H */
@@ -52,7 +52,16 @@
 #include <fstream>
 #include <cmath>
 #include <time.h>
+#include <chrono>
+#include <thread>
+#include <algorithm>
 #include "Matrix.h"
+#include "SparseMatrix.h"
+#include "ParallelSpmv.h"
+#include "TiledMap.h"
+#include "RayCast.h"
+#include "Bitboard.h"
+#include "BeamModel.h"
 
 using namespace std;
 
@@ -72,35 +81,39 @@ const int STOP_LIMIT_DEG = 20;
 const int LOW_LIMIT_DEG = STOP_LIMIT_DEG;
 const int UPPER_LIMIT_DEG = 180 - STOP_LIMIT_DEG;
 const int ANGULAR_RANGE_DEG = UPPER_LIMIT_DEG - LOW_LIMIT_DEG;
+const int MAX_RANGE_INCH = 400;
 int radius_inch[ANGULAR_RANGE_DEG];
+const BeamModel sensor(LOW_LIMIT_DEG, 1.0, ANGULAR_RANGE_DEG, MAX_RANGE_INCH);     // Its beams, one per degree
+int hit_i[ANGULAR_RANGE_DEG];           // Cell of each return
+int hit_j[ANGULAR_RANGE_DEG];
 
-// Creat an array to hold the Cartesian coordinates
-// In this case we are storing as inches and want enough for
-// building a map in front us.
+// Create a map to hold the Cartesian coordinates
+// In this case we are storing as inches.
 // The map is really just a Boolean indication of detection
 // at some point.
 // We want efficient storage balanced with execution speed.
-// We can either store the data that will be used for display
-// in a literal grid or we can get fancier so we only store the
-// data sparsely (i.e., only the points we can about)
+// Rather than a literal grid sized for the whole area we might
+// visit, the map is made of small tiles that only exist once
+// something has been seen in them (see TiledMap.h), so the
+// memory grows with the area explored.
 // On a byte-oriented processor, execution efficiency is a single byte.
-const int UPPER_RANGE_INCH = 64;                       // Make this an even number so we have an easy concept of center
-                                                       // Make divisible by 8 to use less memory for simple presence detection
+const int UPPER_RANGE_INCH = 64;                       // Extent of the display (and of the artificial walls around it)
+                                                       // Make this an even number so we have an easy concept of center
 const int UPPER_INDEX = UPPER_RANGE_INCH + 1;
 const int MIDDLE_INCH = UPPER_RANGE_INCH / 2;
 const int MIDDLE_INDEX = MIDDLE_INCH;
 
 typedef signed char byte;
 typedef unsigned char unsignedByte;
-byte universe[UPPER_INDEX][UPPER_INDEX];  // An (x,y) pair maps into this
-                                                        // (0,0) is in the center of the universe
-                                                        // but we want to keep track in an efficient
-                                                        // manner.
-                                                        // C/C++ is row-major meaning that the [i][j] decoding
-                                                        // is most efficient if the [j] is incremented in any
-                                                        // inner loop (this will be imporant when displaying)
+TiledMap<ByteTile> universe;            // An (x,y) pair maps into this at
+                                        // i = -round(y), j = round(x)
+                                        // (0,0) is in the center of the universe
+                                        // and the universe goes on as far as we do.
+                                        // Rows are stored contiguously, so [j] is
+                                        // the index to increment in any inner loop
+                                        // (this will be imporant when displaying)
 
-byte simplerUniverse[UPPER_INDEX][UPPER_INDEX/8];   // A bit-oriented mapping
+Bitboard simplerUniverse;               // A bit-oriented mapping
 
 template <typename T>
 T setBit(const T& aValue, unsigned int aBitNumLsb0, bool aBitValue = true)
@@ -295,36 +308,30 @@ int init(Matrix<long double> &A)
 int main(int argc, const char * argv[])
 {
 
-    // Clear the grid and set a line at some radius for a test (i.e., a semi-circle)
+    // The maps start out empty (every cell clear); set a line at some radius
+    // for a test (i.e., a semi-circle)
 
-    for (int i = 0; i < UPPER_INDEX; ++i)
+    // Create an artificial obstacle around the displayed part of the universe
+    for (int i = -MIDDLE_INDEX; i <= MIDDLE_INDEX; ++i)
     {
-        for (int j = 0; j < UPPER_INDEX; ++j)
+        for (int j = -MIDDLE_INDEX; j <= MIDDLE_INDEX; ++j)
         {
-            // Create an artificial obstacle at the edge of the universe
-            if ((i == 0) || (i == UPPER_RANGE_INCH) || (j == 0) || (j == UPPER_RANGE_INCH))
+            if ((i == -MIDDLE_INDEX) || (i == MIDDLE_INDEX) || (j == -MIDDLE_INDEX) || (j == MIDDLE_INDEX))
             {
-                universe[i][j] = 127;
-
-                simplerUniverse[i][j>>3] = setBit(simplerUniverse[i][j>>3],7-(j%8),true);
-            }
-            else
-            {
-                universe[i][j] = 0;
-
-                simplerUniverse[i][j>>3] = setBit(simplerUniverse[i][j>>3],7-(j%8),false);
+                universe.set(i, j, 127);
 
+                simplerUniverse.set(i, j, true);
             }
         }
     }
 
 
     // Mark our current location
-    // Round the indicies and offset to match our concept of "center"
-    // i.e. in index form, 0 will be more negative and
-    int currentJ = MIDDLE_INDEX + static_cast<int>(round(currentX_inch));
-    int currentI = MIDDLE_INDEX - static_cast<int>(round(currentY_inch));
-    universe[currentI][currentJ] = -1;
+    // Round the indicies to match our concept of "center"
+    // i.e. in index form, negative i is positive y
+    int currentJ = static_cast<int>(round(currentX_inch));
+    int currentI = -static_cast<int>(round(currentY_inch));
+    universe.set(currentI, currentJ, -1);
 
     // Assuming we are at (currentX, currentY) scan the region
     // around us
@@ -335,86 +342,164 @@ int main(int argc, const char * argv[])
         radius_inch[i] = 10;
     }
 
-    // Now convert each radius into an (x,y) pair and tag that point in the grid
-    for (unsigned int i = 0; i < DIM(radius_inch); ++i)
+    // Now convert each radius into an (x,y) pair in the universe reference
+    // frame and then into a cell of the grid (see BeamModel.h), and tag
+    // that point in the grid
+    int returns = sensor.toGrid(radius_inch, currentX_inch, currentY_inch, unitX, unitY, hit_i, hit_j);
+    for (int k = 0; k < returns; ++k)
     {
+        // No need to limit the values: the map grows to take them
+        simplerUniverse.set(hit_i[k], hit_j[k], true);
+    }
 
-        // First compute the Cartesian coordinates of the data in the sensor reference frame
-        double this_angle_deg = static_cast<double>(LOW_LIMIT_DEG + i);
-        double this_angle_radian = this_angle_deg * DTR;
-        double this_radius_in = static_cast<double>(radius_inch[i]);
-        double xs_inch = this_radius_in * cos(this_angle_radian);
-        double ys_inch = this_radius_in * sin(this_angle_radian);
+    // Cast a ray from our position to each object we found, clearing the
+    // cells in between and confirming the cells of the objects, so cells
+    // tagged before but seen through from a different angle lose their
+    // detection. The universe holds how confident we are that there is
+    // something in each cell (see RayCast.h).
+    SweepUpdate sweep;
+    sweep.apply(universe, currentI, currentJ, hit_i, hit_j, returns);
 
-        // Rotate the coordinates from sensor reference to universe reference
-        // This is done by multiplying the position vector of the sensed object
-        // by the body to
-        double xu_inch =  xs_inch * unitY + ys_inch * unitX;
-        double yu_inch = -xs_inch * unitX + ys_inch * unitY;
+    // Now "display" the middle of the universe on the console
+    for (int i = -MIDDLE_INDEX; i <= MIDDLE_INDEX; ++i)
+    {
+        for (int j = -MIDDLE_INDEX; j <= MIDDLE_INDEX; ++j)
+        {
+            //printf("%c ",universe.get(i,j)==-1?'X':universe.get(i,j)==127?'!':universe.get(i,j)>0?'*':'.');
 
-        // Transverse the detected position relative to the body center
-        // into the universe reference frame
-        xu_inch += currentX_inch;
-        yu_inch += currentY_inch;
+            printf("%c ",simplerUniverse.get(i,j)?'*':'.');
+        }
+        printf("\n");
+    }
+    printf("%u byte tiles (%u bytes), %u bit tiles (%u bytes)\n",
+           (unsigned int)universe.tileCount(), (unsigned int)universe.bytes(),
+           (unsigned int)simplerUniverse.tileCount(), (unsigned int)simplerUniverse.bytes());
 
-        //printf("a = %f : r = %f : x = %f : y = %f\n", this_angle_deg, this_radius_in, xu_inch, yu_inch);
+    //printf("ux = %f : uy = %f\n",unitX, unitY);
 
-        // Round the indicies and offset to match our concept of "center"
-        // i.e. in index form, 0 will be more negative and
-        int j_index = MIDDLE_INDEX + static_cast<int>(round(xu_inch));
-        int i_index = MIDDLE_INDEX - static_cast<int>(round(yu_inch));
+    // Time converting sweeps into cells: a lidar-like sensor all round at
+    // a quarter of a degree, against working each beam out on its own
+    {
+        const int BEAMS = 1440;
+        const int SWEEPS = 20000;
+        const int RANGES = 16;
+        BeamModel lidar(0.0, 0.25, BEAMS, 1.0e4);
+        vector<int> ranges(RANGES * BEAMS), cell_i(BEAMS), cell_j(BEAMS);
+        srand(2);
+        for (size_t k = 0; k < ranges.size(); ++k)
+        {
+            ranges[k] = rand() % 1200;
+        }
 
-        //printf("i = %d : j = %d\n", i_index, j_index);
+        clock_t t0 = clock();
+        for (int s = 0; s < SWEEPS; ++s)
+        {
+            double heading_radian = s * 0.001;
+            lidar.toGrid(&ranges[(s % RANGES) * BEAMS], 0.5 * s, 100.0, cos(heading_radian), sin(heading_radian), &cell_i[0], &cell_j[0]);
+        }
+        double model_s = (double)(clock() - t0) / CLOCKS_PER_SEC;
 
-        // Limit the values to fit within the display grid
-        if (i_index < 0)
+        t0 = clock();
+        for (int s = 0; s < SWEEPS; ++s)
         {
-            i_index = 0;
+            double heading_radian = s * 0.001;
+            double ux = cos(heading_radian), uy = sin(heading_radian);
+            const int *r = &ranges[(s % RANGES) * BEAMS];
+            int n = 0;
+            for (int k = 0; k < BEAMS; ++k)
+            {
+                double angle_radian = 0.25 * k * DTR;
+                double xs_inch = r[k] * cos(angle_radian);
+                double ys_inch = r[k] * sin(angle_radian);
+                double xu_inch = xs_inch * uy + ys_inch * ux + 0.5 * s;
+                double yu_inch = -xs_inch * ux + ys_inch * uy + 100.0;
+                if ((r[k] > 0) && (r[k] <= 1.0e4))
+                {
+                    cell_j[n] = static_cast<int>(round(xu_inch));
+                    cell_i[n] = -static_cast<int>(round(yu_inch));
+                    ++n;
+                }
+            }
         }
-        else if (i_index >= UPPER_INDEX)
+        double scalar_s = (double)(clock() - t0) / CLOCKS_PER_SEC;
+        printf("Beam model: %.1f million points/s (%.1f with cos and sin per beam)\n",
+               (double)BEAMS * SWEEPS / model_s / 1.0e6, (double)BEAMS * SWEEPS / scalar_s / 1.0e6);
+    }
+
+    // Time the ray casting on a large map: sweeps of returns between 50 and
+    // 400 inches away, taken while moving, all worked out beforehand
+    {
+        const int SWEEPS = 2000;
+        vector<int> bench_i(SWEEPS * ANGULAR_RANGE_DEG), bench_j(SWEEPS * ANGULAR_RANGE_DEG);
+        vector<int> from_i(SWEEPS), from_j(SWEEPS);
+        srand(1);
+        for (int s = 0; s < SWEEPS; ++s)
         {
-            i_index = UPPER_INDEX;
+            double x_inch = 2.0 * s;
+            double y_inch = 300.0 * sin(s * 0.005);
+            double heading_radian = s * 0.01;
+            from_j[s] = static_cast<int>(round(x_inch));
+            from_i[s] = -static_cast<int>(round(y_inch));
+            for (int k = 0; k < ANGULAR_RANGE_DEG; ++k)
+            {
+                double angle_radian = (LOW_LIMIT_DEG + k) * DTR + heading_radian;
+                double r_inch = 50.0 + 350.0 * rand() / RAND_MAX;
+                bench_j[s * ANGULAR_RANGE_DEG + k] = static_cast<int>(round(x_inch + r_inch * cos(angle_radian)));
+                bench_i[s * ANGULAR_RANGE_DEG + k] = -static_cast<int>(round(y_inch + r_inch * sin(angle_radian)));
+            }
         }
-        if (j_index < 0)
+
+        TiledMap<ByteTile> big;
+        SweepUpdate update;
+        clock_t t0 = clock();
+        for (int s = 0; s < SWEEPS; ++s)
         {
-            j_index = 0;
+            update.apply(big, from_i[s], from_j[s], &bench_i[s * ANGULAR_RANGE_DEG], &bench_j[s * ANGULAR_RANGE_DEG], ANGULAR_RANGE_DEG);
         }
-        else if (j_index >= UPPER_INDEX)
+        double seconds = (double)(clock() - t0) / CLOCKS_PER_SEC;
+        printf("Ray casting: %d beams in %.3f s (%.0f beams/s, %.1f million cells/s), map of %u tiles (%u bytes)\n",
+               SWEEPS * ANGULAR_RANGE_DEG, seconds, SWEEPS * ANGULAR_RANGE_DEG / seconds, update.cellsUpdated() / seconds / 1.0e6,
+               (unsigned int)big.tileCount(), (unsigned int)big.bytes());
+
+        // And the whole-map operations on what it found occupied
+        const int PASSES = 200;
+        Bitboard occupied, grown, shrunk, merged;
+        occupied.threshold(big, 0);
+        t0 = clock();
+        for (int p = 0; p < PASSES; ++p)
         {
-            j_index = UPPER_INDEX;
+            occupied.dilate(grown);
         }
-        simplerUniverse[i_index][j_index>>3] = setBit(simplerUniverse[i_index][j_index>>3],7-(j_index%8),true);
-
-        if (universe[i_index][j_index] < ((unsignedByte)-1)/2)
+        double dilate_s = (double)(clock() - t0) / CLOCKS_PER_SEC / PASSES;
+        t0 = clock();
+        for (int p = 0; p < PASSES; ++p)
         {
-            ++universe[i_index][j_index];
+            grown.erode(shrunk);
         }
-
-        /// TODO: Still need to cast a ray from current position to the
-        /// object we just found so we can clear any cells that may have
-        /// been previously tagged as having an object. I.e., it is possible
-        /// we filled in some cells that were later seen from a different
-        /// angle and result in a lost detection.
-        /// Conceptually, we can use the value as a weighting factor to
-        /// let us know how confident we are that there is something in
-        /// the specific cell... i.e., + for each detect and - for each loss
-        /// but no lower than zero
-    }
-
-    // Now "display" the universe on the console
-    for (int i = 0; i < UPPER_INDEX; ++i)
-    {
-        for (int j = 0; j < UPPER_INDEX; ++j)
+        double erode_s = (double)(clock() - t0) / CLOCKS_PER_SEC / PASSES;
+        merged.merge(grown);
+        t0 = clock();
+        for (int p = 0; p < PASSES; ++p)
         {
-            //printf("%c ",universe[i][j]==-1?'X':universe[i][j]==127?'!':universe[i][j]>0?'*':'.');
-
-            printf("%c ",getBit(simplerUniverse[i][j>>3],7-(j%8))?'*':'.');
+            merged.zero();
+            merged.merge(occupied);
         }
-        printf("\n");
+        double merge_s = (double)(clock() - t0) / CLOCKS_PER_SEC / PASSES;
+        uint64_t listed = 0;
+        t0 = clock();
+        for (int p = 0; p < PASSES; ++p)
+        {
+            occupied.forEachSet([&listed](int, int) { ++listed; });
+        }
+        double list_s = (double)(clock() - t0) / CLOCKS_PER_SEC / PASSES;
+        printf("Bitboard: %u of %u cells occupied, %u after dilating, %u after eroding again\n",
+               (unsigned int)occupied.count(), (unsigned int)(occupied.tileCount() * TILE_SIZE * TILE_SIZE),
+               (unsigned int)grown.count(), (unsigned int)shrunk.count());
+        printf("Bitboard: dilate %.3f ms, erode %.3f ms, clear and merge %.1f MB/s, list %.1f million cells/s\n",
+               dilate_s * 1.0e3, erode_s * 1.0e3, 2.0 * merged.tileCount() * sizeof(BitTile) / merge_s / 1.0e6,
+               listed / PASSES / list_s / 1.0e6);
     }
 
-    //printf("ux = %f : uy = %f\n",unitX, unitY);
-
     // Example ray casting
     	vec vsq[] = {	{0,0}, {10,0}, {10,10}, {0,10},
             {2.5,2.5}, {7.5,0.1}, {7.5,7.5}, {2.5,7.5}};
@@ -432,30 +517,79 @@ int main(int argc, const char * argv[])
     	printf("%d\n", inside(d, &sq_hole, 1e-10));  /* out (in the hole) */
 
 
-//    // matrix tests
-//    Matrix<long double> A(1806);
-//    vector<long double> x(1806,1), y;
-//    long double sum;
-//    int n,k=0;
-//    clock_t t0,tf;
-//    cout.precision(17);
-//
-//    n=init(A);
-//
-//    //timed multiplication
-//    t0=clock();
-//    for(int i=0;i<1000;i++){ y=A*x; }
-//    tf=clock()-t0;
-//
-//    //output last element
-//    cout << y[1805];
-//    //output time to multiply
-//    cout << "\n\n" << (double)tf/((double)(CLOCKS_PER_SEC)*(1000.0));
-//
-//    //do naive multiply for last row to check last element of y
-//    long double tmp=0;
-//    for(int i=0;i<1806;i++) tmp+=A(1805,i);
-//    cout << "\n" << tmp <<"\n";
+    // matrix tests: multiply the 1806 x 1806 matrix in matin.txt (or, if
+    // there is none, a symmetric banded one about as full) by a vector of
+    // ones a thousand times, first as a tree of entries and then compressed
+    // by row (see SparseMatrix.h)
+    {
+        const int N = 1806;
+        const int TIMES = 1000;
+        Matrix<long double> A(N);
+        vector<long double> x(N,1), y;
+        clock_t t0,tf;
+        cout.precision(17);
+
+        if (init(A) == 0)
+        {
+            srand(4);
+            for (int i = 0; i < N; ++i)
+            {
+                for (int j = (i > 40 ? i - 40 : 0); j <= i; ++j)
+                {
+                    if ((i == j) || (rand() % 5 == 0))
+                    {
+                        long double value = 1.0L + rand() % 1000 / 100.0L;
+                        A(i,j) = value;
+                        A(j,i) = value;
+                    }
+                }
+            }
+        }
+
+        //timed multiplication
+        t0=clock();
+        for(int i=0;i<TIMES;i++){ y=A*x; }
+        tf=clock()-t0;
+        double tree_s = (double)tf/((double)(CLOCKS_PER_SEC)*TIMES);
+
+        CsrMatrix<long double> C(A);
+        vector<long double> z(N);
+        t0=clock();
+        for(int i=0;i<TIMES;i++){ C.multiply(&x[0], &z[0]); }
+        tf=clock()-t0;
+        double csr_s = (double)tf/((double)(CLOCKS_PER_SEC)*TIMES);
+
+        //sum the last row to check the last element of each product
+        long double tmp=0;
+        Matrix<long double>::mat_t::const_iterator last = A.entries().find(N-1);
+        if (last != A.entries().end())
+        {
+            for(Matrix<long double>::col_t::const_iterator jj=last->second.begin(); jj!=last->second.end(); ++jj) tmp+=jj->second;
+        }
+
+        //output last element, then the time to multiply each way
+        cout << "Matrix: " << C.nonzeros() << " nonzeros, last element " << y[N-1] << " (tree) " << z[N-1] << " (CSR) " << tmp << " (sum)\n";
+        printf("Matrix: %.3f us per multiply as a tree, %.3f us compressed by row (%.1f times faster)\n",
+               tree_s * 1.0e6, csr_s * 1.0e6, tree_s / csr_s);
+
+        //the same on more threads, rows split by nonzeros (see ParallelSpmv.h),
+        //timed by the wall clock; each product is 2 flops per nonzero
+        unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned int threads = 1; ; threads = min(threads * 2, cores))
+        {
+            ParallelSpmv<long double> P(C, threads);
+            chrono::steady_clock::time_point w0 = chrono::steady_clock::now();
+            for(int i=0;i<TIMES;i++){ P.multiply(&x[0]); }
+            double wall_s = chrono::duration<double>(chrono::steady_clock::now() - w0).count() / TIMES;
+            bool same = equal(z.begin(), z.end(), P.multiply(&x[0]).begin());
+            printf("Matrix: %2u thread(s) %.3f us per multiply, %.3f GFLOP/s%s\n",
+                   threads, wall_s * 1.0e6, 2.0 * C.nonzeros() / wall_s / 1.0e9, same ? "" : " (results differ)");
+            if (threads == cores)
+            {
+                break;
+            }
+        }
+    }
 
     return 0;
 }
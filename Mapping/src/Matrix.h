@@ -10,6 +10,7 @@
 
 #include <cstdlib>
 #include <map>
+#include <iostream>
 #include <vector>
 
 template <class T>
@@ -58,6 +59,10 @@ public:
         return y;
     }
     
+    size_t rows() const { return m; }
+    size_t cols() const { return n; }
+    const mat_t& entries() const { return mat; }
+    
     void printMat()
     {
         row_iter ii;
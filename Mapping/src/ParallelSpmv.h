@@ -0,0 +1,162 @@
+//
+//  ParallelSpmv.h
+//  Mapping
+//
+//  y = A x for a CsrMatrix on several threads. The rows are split into one
+//  contiguous block per thread holding about the same number of entries,
+//  not the same number of rows, so a matrix with a few dense rows does not
+//  leave one thread doing most of the work. The split is worked out once,
+//  when the matrix is given.
+//
+//  The threads are started once and kept for every product, and the result
+//  goes into a vector allocated once, so a product allocates nothing and
+//  costs two hand-offs: waking the threads, and waiting for the last. The
+//  threads spin for a short while before sleeping, so that back to back
+//  products (as in a timing loop or an iterative solver) do not pay to wake
+//  them each time. The calling thread does the first block itself.
+//
+//  Each row is summed in the same order as CsrMatrix::multiply, so the
+//  result is the same whatever the number of threads.
+//
+
+#ifndef _PARALLEL_SPMV_H
+#define _PARALLEL_SPMV_H
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include "SparseMatrix.h"
+
+template <class T>
+class ParallelSpmv
+{
+public:
+    // aThreads 0 means one per core
+    ParallelSpmv(const CsrMatrix<T> &aMatrix, unsigned int aThreads = 0)
+        : matrix(aMatrix)
+        , result(aMatrix.rows())
+        , x(nullptr)
+        , y(nullptr)
+        , generation(0)
+        , pending(0)
+        , stopping(false)
+    {
+        unsigned int threads = aThreads ? aThreads : std::max(1u, std::thread::hardware_concurrency());
+
+        // Block t starts at the first row at or after entry t nnz / threads
+        const std::vector<size_t> &start = matrix.starts();
+        const uint64_t nnz = matrix.nonzeros();
+        first.push_back(0);
+        for (unsigned int t = 1; t < threads; ++t)
+        {
+            size_t entry = (size_t)(nnz * t / threads);
+            first.push_back(std::lower_bound(start.begin(), start.end() - 1, entry) - start.begin());
+        }
+        first.push_back(matrix.rows());
+
+        for (unsigned int t = 1; t < threads; ++t)
+        {
+            workers.push_back(std::thread(&ParallelSpmv::worker, this, t));
+        }
+    }
+
+    ~ParallelSpmv()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            generation.fetch_add(1, std::memory_order_release);
+        }
+        wake.notify_all();
+        for (size_t t = 0; t < workers.size(); ++t)
+        {
+            workers[t].join();
+        }
+    }
+
+    ParallelSpmv(const ParallelSpmv &) = delete;
+    ParallelSpmv &operator=(const ParallelSpmv &) = delete;
+
+    unsigned int threads() const { return (unsigned int)workers.size() + 1; }
+
+    // First row of each thread's block, and the end
+    const std::vector<size_t> &blocks() const { return first; }
+
+    // y = A x, from aX[cols()], into aY[rows()] or into the vector kept here
+    const std::vector<T> &multiply(const T *aX)
+    {
+        multiply(aX, result.data());
+        return result;
+    }
+
+    void multiply(const T *aX, T *aY)
+    {
+        x = aX;
+        y = aY;
+        if (!workers.empty())
+        {
+            pending.store((unsigned int)workers.size(), std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                generation.fetch_add(1, std::memory_order_release);
+            }
+            wake.notify_all();
+        }
+
+        matrix.multiply(x, y, first[0], first[1]);
+
+        while (pending.load(std::memory_order_acquire) != 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    // Rounds of yielding for a new product before sleeping
+    static const int SPIN = 2000;
+
+    void worker(unsigned int aThread)
+    {
+        uint64_t seen = 0;
+        for (;;)
+        {
+            int spin = 0;
+            while ((generation.load(std::memory_order_acquire) == seen) && (spin++ < SPIN))
+            {
+                std::this_thread::yield();
+            }
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return generation.load(std::memory_order_acquire) != seen; });
+                if (stopping)
+                {
+                    return;
+                }
+                seen = generation.load(std::memory_order_relaxed);
+            }
+
+            matrix.multiply(x, y, first[aThread], first[aThread + 1]);
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    const CsrMatrix<T> &matrix;
+    std::vector<size_t> first;      // Row blocks, one per thread, and the end
+    std::vector<T> result;
+    std::vector<std::thread> workers;
+
+    const T *x;                     // The product under way
+    T *y;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<uint64_t> generation;
+    std::atomic<unsigned int> pending;
+    bool stopping;
+};
+
+#endif	/* _PARALLEL_SPMV_H */
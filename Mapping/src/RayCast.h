@@ -0,0 +1,158 @@
+//
+//  RayCast.h
+//  Mapping
+//
+//  Occupancy updates from a sweep of range returns. Each beam is traced
+//  from the sensor cell to the cell of its return with Bresenham's line:
+//  the cells it crosses are evidence of free space and the cell it ends in
+//  is evidence of an obstacle. Evidence is kept as log-odds in the signed
+//  byte cells of the map: 0 is unknown, positive is occupied, negative is
+//  free, and every update adds a fixed amount, saturating at the limits of
+//  a byte so a cell can always be argued back the other way.
+//
+//  A sweep is applied as a batch. Neighbouring beams cross the same cells
+//  near the sensor, and a beam at a grazing angle crosses the returns of
+//  its neighbours, so the batch updates every cell at most once: first the
+//  returns are marked occupied, then the beams are traced and each cell
+//  not already updated this sweep is marked free. Which cells have been
+//  updated is kept in a bit map of the same tiles; the tiles a sweep
+//  touched are zeroed before the next rather than freed, so the cost does
+//  not grow with the map. The traces walk tile by tile, looking a tile up
+//  only when the line crosses into it.
+//
+
+#ifndef _RAY_CAST_H
+#define _RAY_CAST_H
+
+#include <cstdlib>
+#include <climits>
+#include <cstring>
+#include <vector>
+#include "TiledMap.h"
+
+// Log-odds steps in tenths of a nat: a return makes a cell about 77%
+// likely to be occupied, a beam through it about 40%
+const int LOG_ODDS_HIT = 12;
+const int LOG_ODDS_MISS = -4;
+const int LOG_ODDS_LIMIT = 127;
+
+inline signed char addLogOdds(signed char aCell, int aStep)
+{
+    int value = aCell + aStep;
+    value = value > LOG_ODDS_LIMIT ? LOG_ODDS_LIMIT : value;
+    value = value < -LOG_ODDS_LIMIT ? -LOG_ODDS_LIMIT : value;
+    return (signed char)value;
+}
+
+class SweepUpdate
+{
+public:
+    SweepUpdate() : cells(0) {}
+
+    // Update aMap with a sweep of aCount beams from the sensor in cell
+    // (aI, aJ) to returns in cells (aHitI[k], aHitJ[k]). The sensor's own
+    // cell is left as it is.
+    void apply(TiledMap<ByteTile> &aMap, int aI, int aJ, const int *aHitI, const int *aHitJ, int aCount)
+    {
+        for (size_t t = 0; t < touched.size(); ++t)
+        {
+            memset(touched[t]->rows, 0, sizeof(touched[t]->rows));
+        }
+        touched.clear();
+
+        for (int k = 0; k < aCount; ++k)
+        {
+            int i = aHitI[k];
+            int j = aHitJ[k];
+            if ((i == aI) && (j == aJ))
+            {
+                continue;
+            }
+            BitTile &marks = updated.tile(i, j);
+            int r = i & TILE_MASK;
+            int c = j & TILE_MASK;
+            uint64_t bit = (uint64_t)1 << c;
+            if (!(marks.rows[r] & bit))
+            {
+                marks.rows[r] |= bit;
+                touched.push_back(&marks);
+                ByteTile &tile = aMap.tile(i, j);
+                tile.cells[r][c] = addLogOdds(tile.cells[r][c], LOG_ODDS_HIT);
+                ++cells;
+            }
+        }
+
+        for (int k = 0; k < aCount; ++k)
+        {
+            trace(aMap, aI, aJ, aHitI[k], aHitJ[k]);
+        }
+    }
+
+    // Cells updated since construction
+    size_t cellsUpdated() const { return cells; }
+
+private:
+    // Mark the cells strictly between (aI0, aJ0) and (aI1, aJ1) free
+    void trace(TiledMap<ByteTile> &aMap, int aI0, int aJ0, int aI1, int aJ1)
+    {
+        int di = abs(aI1 - aI0);
+        int dj = abs(aJ1 - aJ0);
+        int si = aI0 < aI1 ? 1 : -1;
+        int sj = aJ0 < aJ1 ? 1 : -1;
+        int err = dj - di;
+        int i = aI0;
+        int j = aJ0;
+
+        if ((i == aI1) && (j == aJ1))
+        {
+            return;
+        }
+
+        int tileI = INT_MIN;
+        int tileJ = INT_MIN;
+        ByteTile *tile = nullptr;
+        BitTile *marks = nullptr;
+        for (;;)
+        {
+            int e2 = 2 * err;
+            if (e2 >= -di)
+            {
+                err -= di;
+                j += sj;
+            }
+            if (e2 <= dj)
+            {
+                err += dj;
+                i += si;
+            }
+            if ((i == aI1) && (j == aJ1))
+            {
+                break;
+            }
+
+            if (((i >> TILE_SHIFT) != tileI) || ((j >> TILE_SHIFT) != tileJ))
+            {
+                tileI = i >> TILE_SHIFT;
+                tileJ = j >> TILE_SHIFT;
+                tile = &aMap.tile(i, j);
+                marks = &updated.tile(i, j);
+                touched.push_back(marks);
+            }
+            int r = i & TILE_MASK;
+            int c = j & TILE_MASK;
+            uint64_t bit = (uint64_t)1 << c;
+            if (!(marks->rows[r] & bit))
+            {
+                marks->rows[r] |= bit;
+                tile->cells[r][c] = addLogOdds(tile->cells[r][c], LOG_ODDS_MISS);
+                ++cells;
+            }
+        }
+    }
+
+    TiledMap<BitTile> updated;      // Cells updated this sweep
+    std::vector<BitTile *> touched; // Its tiles written this sweep, perhaps more than once
+    size_t cells;
+};
+
+#endif	/* _RAY_CAST_H */
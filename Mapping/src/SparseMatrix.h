@@ -0,0 +1,245 @@
+//
+//  SparseMatrix.h
+//  Mapping
+//
+//  Compressed sparse matrices for fast products. Matrix<T> keeps a tree of
+//  rows, each a tree of entries, which is easy to fill in any order but
+//  slow to multiply: every entry is a node somewhere on the heap. These
+//  keep the same entries in three flat arrays, which are built once and
+//  then read straight through:
+//      CsrMatrix   compressed rows: the entries row by row, the column of
+//                  each, and where each row starts. y = A x is a dot
+//                  product per row.
+//      CscMatrix   compressed columns, the same by column. y = A x adds
+//                  each column into y scaled by its x; y = A' x is a dot
+//                  product per column.
+//  Either is built from a Matrix<T> or from (row, column, value) triplets
+//  in any order, duplicates summed. Column (or row) numbers are 32 bits to
+//  keep the index array half the size; more than 2^32 columns is refused.
+//
+
+#ifndef _SPARSE_MATRIX_H
+#define _SPARSE_MATRIX_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include "Matrix.h"
+
+template <class T>
+struct Triplet
+{
+    size_t row;
+    size_t col;
+    T value;
+};
+
+// The storage shared by both layouts: "outer" is the row of a CSR matrix
+// and the column of a CSC one, "inner" the other
+template <class T>
+class CompressedMatrix
+{
+public:
+    size_t rows() const { return m; }
+    size_t cols() const { return n; }
+    size_t nonzeros() const { return value.size(); }
+
+    const std::vector<size_t> &starts() const { return start; }
+    const std::vector<uint32_t> &indices() const { return index; }
+    const std::vector<T> &values() const { return value; }
+
+protected:
+    CompressedMatrix(size_t aRows, size_t aCols) : m(aRows), n(aCols) {}
+
+    // Fill from triplets, aByRow choosing which of row and column is outer
+    void build(std::vector<Triplet<T> > aTriplets, bool aByRow)
+    {
+        const size_t outer = aByRow ? m : n;
+        const size_t inner = aByRow ? n : m;
+        if ((uint64_t)inner > ((uint64_t)1 << 32))
+        {
+            throw std::length_error("sparse matrix too wide for 32-bit indices");
+        }
+
+        // Count the entries of each outer line, then deal them out (a
+        // counting sort), then sort each line and merge duplicates
+        std::vector<size_t> count(outer + 1, 0);
+        for (size_t k = 0; k < aTriplets.size(); ++k)
+        {
+            const Triplet<T> &t = aTriplets[k];
+            if ((t.row >= m) || (t.col >= n))
+            {
+                throw std::out_of_range("sparse matrix entry outside the matrix");
+            }
+            ++count[(aByRow ? t.row : t.col) + 1];
+        }
+        for (size_t o = 0; o < outer; ++o)
+        {
+            count[o + 1] += count[o];
+        }
+        std::vector<std::pair<uint32_t, T> > dealt(aTriplets.size());
+        std::vector<size_t> next(count.begin(), count.end() - 1);
+        for (size_t k = 0; k < aTriplets.size(); ++k)
+        {
+            const Triplet<T> &t = aTriplets[k];
+            dealt[next[aByRow ? t.row : t.col]++] = std::make_pair((uint32_t)(aByRow ? t.col : t.row), t.value);
+        }
+
+        start.assign(outer + 1, 0);
+        index.clear();
+        value.clear();
+        index.reserve(dealt.size());
+        value.reserve(dealt.size());
+        for (size_t o = 0; o < outer; ++o)
+        {
+            typename std::vector<std::pair<uint32_t, T> >::iterator first = dealt.begin() + count[o];
+            typename std::vector<std::pair<uint32_t, T> >::iterator last = dealt.begin() + count[o + 1];
+            std::stable_sort(first, last, [](const std::pair<uint32_t, T> &a, const std::pair<uint32_t, T> &b) { return a.first < b.first; });
+            for (; first != last; ++first)
+            {
+                if ((index.size() > start[o]) && (index.back() == first->first))
+                {
+                    value.back() += first->second;
+                }
+                else
+                {
+                    index.push_back(first->first);
+                    value.push_back(first->second);
+                }
+            }
+            start[o + 1] = index.size();
+        }
+    }
+
+    static std::vector<Triplet<T> > triplets(const Matrix<T> &aMatrix)
+    {
+        std::vector<Triplet<T> > all;
+        typename Matrix<T>::mat_t::const_iterator ii;
+        typename Matrix<T>::col_t::const_iterator jj;
+        for (ii = aMatrix.entries().begin(); ii != aMatrix.entries().end(); ++ii)
+        {
+            for (jj = ii->second.begin(); jj != ii->second.end(); ++jj)
+            {
+                Triplet<T> t = { ii->first, jj->first, jj->second };
+                all.push_back(t);
+            }
+        }
+        return all;
+    }
+
+    size_t m;
+    size_t n;
+    std::vector<size_t> start;      // Where each outer line starts in index and value, and the end
+    std::vector<uint32_t> index;    // Inner position of each entry
+    std::vector<T> value;
+};
+
+template <class T>
+class CsrMatrix : public CompressedMatrix<T>
+{
+public:
+    CsrMatrix(const Matrix<T> &aMatrix) : CompressedMatrix<T>(aMatrix.rows(), aMatrix.cols())
+    {
+        this->build(this->triplets(aMatrix), true);
+    }
+    CsrMatrix(size_t aRows, size_t aCols, const std::vector<Triplet<T> > &aTriplets) : CompressedMatrix<T>(aRows, aCols)
+    {
+        this->build(aTriplets, true);
+    }
+
+    // y = A x into aY[rows()], from aX[cols()]; rows aFirst..aLast-1 only
+    // if given
+    void multiply(const T *aX, T *aY) const
+    {
+        multiply(aX, aY, 0, this->m);
+    }
+    void multiply(const T *aX, T *aY, size_t aFirst, size_t aLast) const
+    {
+        const size_t *start = this->start.data();
+        const uint32_t *index = this->index.data();
+        const T *value = this->value.data();
+        for (size_t i = aFirst; i < aLast; ++i)
+        {
+            T sum = 0;
+            for (size_t k = start[i]; k < start[i + 1]; ++k)
+            {
+                sum += value[k] * aX[index[k]];
+            }
+            aY[i] = sum;
+        }
+    }
+
+    std::vector<T> operator*(const std::vector<T> &x) const
+    {
+        if (x.size() != this->n)
+        {
+            throw std::invalid_argument("vector does not match the matrix");
+        }
+        std::vector<T> y(this->m);
+        multiply(x.data(), y.data());
+        return y;
+    }
+};
+
+template <class T>
+class CscMatrix : public CompressedMatrix<T>
+{
+public:
+    CscMatrix(const Matrix<T> &aMatrix) : CompressedMatrix<T>(aMatrix.rows(), aMatrix.cols())
+    {
+        this->build(this->triplets(aMatrix), false);
+    }
+    CscMatrix(size_t aRows, size_t aCols, const std::vector<Triplet<T> > &aTriplets) : CompressedMatrix<T>(aRows, aCols)
+    {
+        this->build(aTriplets, false);
+    }
+
+    // y = A x into aY[rows()], from aX[cols()]
+    void multiply(const T *aX, T *aY) const
+    {
+        const size_t *start = this->start.data();
+        const uint32_t *index = this->index.data();
+        const T *value = this->value.data();
+        std::fill(aY, aY + this->m, T(0));
+        for (size_t j = 0; j < this->n; ++j)
+        {
+            const T xj = aX[j];
+            for (size_t k = start[j]; k < start[j + 1]; ++k)
+            {
+                aY[index[k]] += value[k] * xj;
+            }
+        }
+    }
+
+    // y = A' x into aY[cols()], from aX[rows()]
+    void multiplyTransposed(const T *aX, T *aY) const
+    {
+        const size_t *start = this->start.data();
+        const uint32_t *index = this->index.data();
+        const T *value = this->value.data();
+        for (size_t j = 0; j < this->n; ++j)
+        {
+            T sum = 0;
+            for (size_t k = start[j]; k < start[j + 1]; ++k)
+            {
+                sum += value[k] * aX[index[k]];
+            }
+            aY[j] = sum;
+        }
+    }
+
+    std::vector<T> operator*(const std::vector<T> &x) const
+    {
+        if (x.size() != this->n)
+        {
+            throw std::invalid_argument("vector does not match the matrix");
+        }
+        std::vector<T> y(this->m);
+        multiply(x.data(), y.data());
+        return y;
+    }
+};
+
+#endif	/* _SPARSE_MATRIX_H */
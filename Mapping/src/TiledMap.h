@@ -0,0 +1,189 @@
+//
+//  TiledMap.h
+//  Mapping
+//
+//  A map of unbounded extent made of fixed size square tiles that are only
+//  allocated once something is written into them, so the memory used grows
+//  with the area explored rather than with its bounding box.
+//
+//  Cells are addressed by signed (i, j) grid indices with (0,0) at the
+//  origin of the universe; i increases downward (-y) and j to the right
+//  (+x), as in the fixed grid. A cell belongs to tile (i >> TILE_SHIFT,
+//  j >> TILE_SHIFT) at (i & TILE_MASK, j & TILE_MASK) within it; the shifts
+//  floor, so negative indices need no special handling.
+//
+//  The tile format is a template parameter:
+//      ByteTile    a signed byte per cell (counts or confidence)
+//      BitTile     a bit per cell (presence), a 64-bit word per row
+//  Cells of tiles never written read as zero.
+//
+//  Tiles are found through a hash of their packed coordinates. Scans touch
+//  one tile many times in a row, so the last tile found is remembered and
+//  most accesses never reach the hash.
+//
+
+#ifndef _TILED_MAP_H
+#define _TILED_MAP_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+
+const int TILE_SHIFT = 6;
+const int TILE_SIZE = 1 << TILE_SHIFT;     // Cells along each side of a tile
+const int TILE_MASK = TILE_SIZE - 1;
+
+// A signed byte per cell
+struct ByteTile
+{
+    typedef signed char Cell;
+
+    ByteTile() { memset(cells, 0, sizeof(cells)); }
+
+    Cell get(int aRow, int aCol) const { return cells[aRow][aCol]; }
+    void set(int aRow, int aCol, Cell aValue) { cells[aRow][aCol] = aValue; }
+
+    Cell cells[TILE_SIZE][TILE_SIZE];
+};
+
+// A bit per cell; column c of a row is bit c of its word
+struct BitTile
+{
+    typedef bool Cell;
+
+    BitTile() { memset(rows, 0, sizeof(rows)); }
+
+    Cell get(int aRow, int aCol) const { return 0 != ((rows[aRow] >> aCol) & 1); }
+    void set(int aRow, int aCol, Cell aValue)
+    {
+        uint64_t mask = (uint64_t)1 << aCol;
+        rows[aRow] = (rows[aRow] & ~mask) | (aValue ? mask : 0);
+    }
+
+    uint64_t rows[TILE_SIZE];
+};
+
+template <class Tile>
+class TiledMap
+{
+public:
+    typedef typename Tile::Cell Cell;
+    typedef std::unordered_map<uint64_t, std::unique_ptr<Tile> > tiles_t;
+    typedef typename tiles_t::const_iterator tile_iter;
+
+    TiledMap() : lastKey(0), lastTile(nullptr) {}
+
+    TiledMap(const TiledMap &) = delete;
+    TiledMap &operator=(const TiledMap &) = delete;
+
+    // Read a cell; zero where nothing was ever written
+    Cell get(int i, int j) const
+    {
+        const Tile *tile = find(i, j);
+        return tile ? tile->get(i & TILE_MASK, j & TILE_MASK) : Cell();
+    }
+
+    // Write a cell, allocating its tile if need be
+    void set(int i, int j, Cell aValue)
+    {
+        tile(i, j).set(i & TILE_MASK, j & TILE_MASK, aValue);
+    }
+
+    // The tile holding cell (i, j), or null if it was never written
+    const Tile *find(int i, int j) const
+    {
+        uint64_t k = key(i >> TILE_SHIFT, j >> TILE_SHIFT);
+        if (lastTile && (k == lastKey))
+        {
+            return lastTile;
+        }
+        typename tiles_t::const_iterator it = tiles.find(k);
+        if (it == tiles.end())
+        {
+            return nullptr;
+        }
+        lastKey = k;
+        lastTile = it->second.get();
+        return lastTile;
+    }
+
+    // The tile holding cell (i, j), allocated on first use
+    Tile &tile(int i, int j)
+    {
+        uint64_t k = key(i >> TILE_SHIFT, j >> TILE_SHIFT);
+        if (!lastTile || (k != lastKey))
+        {
+            std::unique_ptr<Tile> &slot = tiles[k];
+            if (!slot)
+            {
+                slot.reset(new Tile());
+            }
+            lastKey = k;
+            lastTile = slot.get();
+        }
+        return *lastTile;
+    }
+
+    // Forget every tile
+    void clear()
+    {
+        tiles.clear();
+        lastTile = nullptr;
+    }
+
+    size_t tileCount() const { return tiles.size(); }
+
+    // Memory held: the tiles, a node for each in the hash and the buckets
+    size_t bytes() const
+    {
+        return tiles.size() * (sizeof(Tile) + sizeof(typename tiles_t::value_type) + 2 * sizeof(void *))
+            + tiles.bucket_count() * sizeof(void *);
+    }
+
+    // Every tile with its tile coordinates, in no particular order
+    tile_iter begin() const { return tiles.begin(); }
+    tile_iter end() const { return tiles.end(); }
+    typename tiles_t::iterator begin() { return tiles.begin(); }
+    typename tiles_t::iterator end() { return tiles.end(); }
+    static int tileRow(uint64_t aKey) { return (int)(int32_t)(uint32_t)(aKey >> 32); }
+    static int tileCol(uint64_t aKey) { return (int)(int32_t)(uint32_t)aKey; }
+
+    // Grid indices of the first and last cells of the tiles written so far;
+    // false if there are none
+    bool bounds(int &aFirstI, int &aFirstJ, int &aLastI, int &aLastJ) const
+    {
+        if (tiles.empty())
+        {
+            return false;
+        }
+        int ti0 = tileRow(tiles.begin()->first), ti1 = ti0;
+        int tj0 = tileCol(tiles.begin()->first), tj1 = tj0;
+        for (tile_iter it = tiles.begin(); it != tiles.end(); ++it)
+        {
+            int ti = tileRow(it->first);
+            int tj = tileCol(it->first);
+            ti0 = ti < ti0 ? ti : ti0;
+            ti1 = ti > ti1 ? ti : ti1;
+            tj0 = tj < tj0 ? tj : tj0;
+            tj1 = tj > tj1 ? tj : tj1;
+        }
+        aFirstI = ti0 * TILE_SIZE;
+        aFirstJ = tj0 * TILE_SIZE;
+        aLastI = ti1 * TILE_SIZE + TILE_MASK;
+        aLastJ = tj1 * TILE_SIZE + TILE_MASK;
+        return true;
+    }
+
+private:
+    static uint64_t key(int aTileI, int aTileJ)
+    {
+        return ((uint64_t)(uint32_t)aTileI << 32) | (uint32_t)aTileJ;
+    }
+
+    tiles_t tiles;
+    mutable uint64_t lastKey;       // The tile found last, which the next
+    mutable Tile *lastTile;         // access is most likely to want
+};
+
+#endif	/* _TILED_MAP_H */
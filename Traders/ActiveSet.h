@@ -0,0 +1,115 @@
+// ActiveSet.h : Dense set of the traders that are still solvent.
+//
+// Members are kept packed at the front of an array with a position index
+// alongside, so removal is O(1) (swap the member with the last one and pop)
+// and a uniformly random member is a single draw. Selecting traders from the
+// set instead of rejecting disenfranchised ones keeps the cost of a draw
+// constant however many traders have gone broke.
+//
+// Several sets may share one position index as long as their members are
+// disjoint; the sharded engine uses this to give each shard its own set
+// without allocating an index per shard.
+//
+// Trader numbers and positions are stored in 32 bits to keep both arrays
+// dense for large populations.
+
+#ifndef _ACTIVE_SET_H
+#define _ACTIVE_SET_H
+
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+class ActiveSet
+{
+public:
+	ActiveSet() : position(nullptr) {}
+
+	// Own a position index for trader numbers 0..aCapacity-1
+	explicit ActiveSet(uint64_t aCapacity)
+		: index(aCapacity)
+		, position(index.data())
+	{
+		members.reserve(aCapacity);
+	}
+
+	// Use a position index owned elsewhere
+	void share(uint32_t *aPosition)
+	{
+		index.clear();
+		position = aPosition;
+	}
+
+	void clear() { members.clear(); }
+
+	// Members in draw order, and restoring exactly that order (checkpoints)
+	const uint32_t *data() const { return members.data(); }
+	void assign(const uint32_t *aMembers, uint64_t aCount)
+	{
+		members.assign(aMembers, aMembers + aCount);
+		for (uint32_t p = 0; p < members.size(); ++p)
+		{
+			position[members[p]] = p;
+		}
+	}
+
+	uint64_t size() const { return members.size(); }
+	uint64_t operator[](uint64_t aSlot) const { return members[aSlot]; }
+
+	bool contains(uint64_t aTrader) const
+	{
+		uint64_t p = position[aTrader];
+		return (p < members.size()) && (members[p] == aTrader);
+	}
+
+	void insert(uint64_t aTrader)
+	{
+		position[aTrader] = static_cast<uint32_t>(members.size());
+		members.push_back(static_cast<uint32_t>(aTrader));
+	}
+
+	void remove(uint64_t aTrader)
+	{
+		uint32_t p = position[aTrader];
+		uint32_t last = members.back();
+		members[p] = last;
+		position[last] = p;
+		members.pop_back();
+	}
+
+	// Draw two distinct members uniformly at random; needs size() >= 2.
+	// The generator only has to provide below(n), uniform in [0, n).
+	template <typename Generator>
+	void drawPair(Generator &aGenerator, uint64_t &a, uint64_t &b) const
+	{
+		uint32_t n = static_cast<uint32_t>(members.size());
+		uint32_t i = aGenerator.below(n);
+		uint32_t j = aGenerator.below(n - 1);
+		if (j >= i)
+		{
+			++j;
+		}
+		a = members[i];
+		b = members[j];
+	}
+
+	// Put the members in a uniformly random order (Fisher-Yates)
+	template <typename Generator>
+	void shuffle(Generator &aGenerator)
+	{
+		for (uint32_t k = static_cast<uint32_t>(members.size()); k > 1; --k)
+		{
+			uint32_t j = aGenerator.below(k);
+			std::swap(members[k - 1], members[j]);
+			position[members[k - 1]] = k - 1;
+			position[members[j]] = j;
+		}
+	}
+
+private:
+	std::vector<uint32_t> members;
+	std::vector<uint32_t> index;
+	uint32_t *position;
+};
+
+#endif	/* _ACTIVE_SET_H */
@@ -0,0 +1,217 @@
+// Benchmark.h : Fixed workloads for timing the trade engines.
+//
+// A benchmark is the grid of population sizes, disenfranchisement levels
+// (the percentage of traders who start broke, spread evenly through the
+// population) and tax (off, or collected every tax year), each run on every
+// engine: the scalar and batch kernels on one thread and the sharded engine
+// on several. Every case starts from the same balances and draws from the
+// same random stream of the benchmark seed, so a case does the same work on
+// every run and on every build; the final counts are written alongside the
+// times to show that it did.
+//
+// Cases run one at a time so they do not compete for the memory system. Each
+// is set up afresh and timed several times, only the trading and taxing
+// counted, and the median is reported. The results go to a CSV file, one row
+// per case, with the memory the engine works in: the balance and stats
+// columns, the active sets and their position index.
+
+#ifndef _BENCHMARK_H
+#define _BENCHMARK_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+
+#include "Traders.h"
+#include "ActiveSet.h"
+#include "WealthHistogram.h"
+#include "RandomStream.h"
+#include "TradeKernel.h"
+#include "ShardedEngine.h"
+#include "TaxModel.h"
+
+enum class BenchEngine
+{
+	SCALAR,
+	BATCH,
+	PARALLEL
+};
+
+inline const char *benchEngineName(BenchEngine aEngine)
+{
+	return (aEngine == BenchEngine::SCALAR) ? "scalar" : (aEngine == BenchEngine::BATCH) ? "batch" : "parallel";
+}
+
+struct BenchSpec
+{
+	std::vector<uint64_t> traders;
+	std::vector<uint64_t> broke;		// Percentage of traders starting with nothing
+	uint64_t trades;					// Trades per case
+	uint64_t repeats;					// Timed runs per case, the median reported
+	uint64_t seedMoney;
+	uint64_t taxYear;					// Trades per trader between collections when taxed
+	uint64_t epoch;						// Trades between exchanges of the sharded engine
+	uint64_t bins;
+	unsigned int threads;				// For the sharded engine
+	bool stats;
+	RandomKind random;
+	uint64_t seed;
+};
+
+struct BenchCase
+{
+	uint64_t traders;
+	uint64_t broke;
+	bool tax;
+	BenchEngine engine;
+
+	unsigned int threads;
+	uint64_t bytes;
+	uint64_t trades;
+	uint64_t winners;
+	uint64_t losers;
+	uint64_t disenfranchised;
+	double seconds;						// Median of the repeats
+	double fastest;
+};
+
+// Set up one case and time it once, filling in what it did
+template <typename Balance>
+double runBenchOnce(const BenchSpec &aSpec, BenchCase &aCase)
+{
+	typedef TraderStore<Balance> Store;
+
+	Store store(aCase.traders, static_cast<Balance>(aSpec.seedMoney), aSpec.stats);
+	WealthHistogram wealth(aSpec.seedMoney, aSpec.bins, 2 * aSpec.seedMoney);
+	ActiveSet active(aCase.engine == BenchEngine::PARALLEL ? 0 : store.size());
+	for (uint64_t t = 0; t < store.size(); ++t)
+	{
+		// Bresenham's spread of the broke through the population
+		if ((t + 1) * aCase.broke / 100 != t * aCase.broke / 100)
+		{
+			store[t] = 0;
+		}
+		wealth.add(store[t]);
+		if ((aCase.engine != BenchEngine::PARALLEL) && (store[t] != 0))
+		{
+			active.insert(t);
+		}
+	}
+
+	// Either way every trader has a place in an active set and in the
+	// position index; the sharded engine also deals out its blocks
+	RandomStream rng(aSpec.random, aSpec.seed, 0);
+	std::unique_ptr<ShardedEngine<Store>> engine;
+	aCase.threads = 1;
+	aCase.bytes = store.bytes() + 2 * store.size() * sizeof(uint32_t);
+	if (aCase.engine == BenchEngine::PARALLEL)
+	{
+		engine.reset(new ShardedEngine<Store>(store, &wealth, aSpec.threads, KernelKind::BATCH, aSpec.random, aSpec.seed));
+		aCase.threads = engine->threads();
+		aCase.bytes += engine->stateBlocks() * sizeof(uint64_t);
+	}
+	const KernelKind kernel = (aCase.engine == BenchEngine::SCALAR) ? KernelKind::SCALAR : KernelKind::BATCH;
+	TaxModel<Store> taxman(store, wealth, aCase.threads);
+
+	const uint64_t taxYear = aCase.tax ? aSpec.taxYear * store.size() : 0;
+	auto t0 = std::chrono::steady_clock::now();
+	uint64_t i = 0;
+	while (i < aSpec.trades)
+	{
+		uint64_t chunk = engine ? std::min(aSpec.epoch, aSpec.trades - i) : aSpec.trades - i;
+		if (taxYear)
+		{
+			if ((i % taxYear) == 0)
+			{
+				// The sharded engine finds the revived itself
+				taxman.collectTax(wealth);
+				if (!engine)
+				{
+					for (uint32_t t : taxman.revived())
+					{
+						active.insert(t);
+					}
+				}
+			}
+			chunk = std::min(chunk, taxYear - (i % taxYear));
+		}
+
+		uint64_t done = engine ? engine->run(chunk) : trade(kernel, store, active, rng, wealth, chunk);
+		i += done;
+		if (engine ? ((done == 0) && (engine->solvent() < 2)) : (done < chunk))
+		{
+			break;
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+
+	aCase.trades = i;
+	aCase.winners = wealth.winners();
+	aCase.losers = wealth.losers();
+	aCase.disenfranchised = wealth.disenfranchised();
+	return elapsed.count();
+}
+
+// Run every case of the grid and write the results to aPath
+template <typename Balance>
+bool runBenchmarks(const BenchSpec &aSpec, const char *aPath)
+{
+	FILE *out = fopen(aPath, "w");
+	if (!out)
+	{
+		fprintf(stderr, "Cannot write %s\n", aPath);
+		return false;
+	}
+
+	std::vector<BenchCase> cases;
+	for (uint64_t traders : aSpec.traders)
+	{
+		for (uint64_t broke : aSpec.broke)
+		{
+			for (bool tax : { false, true })
+			{
+				for (BenchEngine engine : { BenchEngine::SCALAR, BenchEngine::BATCH, BenchEngine::PARALLEL })
+				{
+					BenchCase c = {};
+					c.traders = traders;
+					c.broke = broke;
+					c.tax = tax;
+					c.engine = engine;
+					cases.push_back(c);
+				}
+			}
+		}
+	}
+
+	printf("Benchmark: %llu cases of %llu trades, %u-bit balances, %s, median of %llu\n", static_cast<uint64_t>(cases.size()),
+		aSpec.trades, static_cast<unsigned int>(8 * sizeof(Balance)), aSpec.stats ? "with stats" : "no stats", aSpec.repeats);
+	printf("%12s %6s %4s %-8s %8s %12s %12s %10s\n", "traders", "broke", "tax", "engine", "threads", "MB", "Mtrades/s", "ns/trade");
+	fprintf(out, "traders,broke_percent,tax,engine,threads,width,bytes,trades,winners,even,losers,disenfranchised,seconds,fastest_seconds,trades_per_second,ns_per_trade\n");
+	for (BenchCase &c : cases)
+	{
+		std::vector<double> times;
+		for (uint64_t r = 0; r < aSpec.repeats; ++r)
+		{
+			times.push_back(runBenchOnce<Balance>(aSpec, c));
+		}
+		std::sort(times.begin(), times.end());
+		c.seconds = times[times.size() / 2];
+		c.fastest = times.front();
+
+		double rate = static_cast<double>(std::max<uint64_t>(c.trades, 1)) / c.seconds;
+		printf("%12llu %5llu%% %4s %-8s %8u %12.1f %12.2f %10.2f\n", c.traders, c.broke, c.tax ? "yes" : "no", benchEngineName(c.engine),
+			c.threads, static_cast<double>(c.bytes) / 1.0e6, rate / 1.0e6, 1.0e9 / rate);
+		fprintf(out, "%llu,%llu,%d,%s,%u,%u,%llu,%llu,%llu,%llu,%llu,%llu,%.6f,%.6f,%.0f,%.3f\n",
+			c.traders, c.broke, c.tax ? 1 : 0, benchEngineName(c.engine), c.threads, static_cast<unsigned int>(8 * sizeof(Balance)), c.bytes,
+			c.trades, c.winners, c.traders - c.winners - c.losers, c.losers, c.disenfranchised, c.seconds, c.fastest, rate, 1.0e9 / rate);
+		fflush(out);
+	}
+	bool ok = (fclose(out) == 0);
+	printf("Results in %s\n", aPath);
+	return ok;
+}
+
+#endif	/* _BENCHMARK_H */
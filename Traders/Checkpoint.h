@@ -0,0 +1,258 @@
+// Checkpoint.h : Binary checkpoints of a Traders run.
+//
+// A checkpoint is one file holding everything needed to carry on exactly where
+// a run left off: the trade count and options, the balance/wins/losses columns,
+// the histogram counts, the draw order (the serial active set, or the block
+// order of the parallel engine) and the state of every random stream.
+//
+// Sections are 64-byte aligned so that a resumed run can map the file
+// copy-on-write and use the columns where they lie; nothing is read until it
+// is touched, so restarting a large population is close to instant.
+//
+// Writing is split between the trading thread and a CheckpointWriter thread.
+// The writer creates and maps the next temporary file ahead of time. The
+// trading thread only copies state into that mapping (memory speed), and the
+// writer then flushes it to disk and renames it over the checkpoint, so an
+// interrupted write never damages the previous checkpoint.
+
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "MappedFile.h"
+#include "RandomStream.h"
+
+struct CheckpointHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t width;				// Bits per balance
+	uint64_t trades;			// Trades completed when the checkpoint was taken
+	uint64_t traders;
+	uint64_t seed;
+	uint64_t epoch;
+	uint32_t threads;
+	uint32_t kernel;
+	uint32_t random;
+	uint32_t stats;				// Non-zero if the wins and losses columns are present
+	uint32_t tax;				// Non-zero if the income and tax models run
+	uint32_t reserved;
+	uint64_t income;
+	uint64_t bins;
+	uint64_t orderCapacity;
+	uint64_t orderCount;		// Entries of the order section in use
+	uint64_t streams;
+
+	// Filled in by layOut()
+	uint64_t balanceOffset;
+	uint64_t winsOffset;
+	uint64_t lossesOffset;
+	uint64_t wealthOffset;
+	uint64_t orderOffset;
+	uint64_t streamOffset;
+	uint64_t fileSize;
+};
+
+class Checkpoint
+{
+public:
+	static const uint32_t VERSION = 2;
+
+	// Stamp the header and place the sections for the sizes it describes
+	static void layOut(CheckpointHeader &aHeader)
+	{
+		memcpy(aHeader.magic, "TRADERS", 8);
+		aHeader.version = VERSION;
+
+		uint64_t offset = align(sizeof(CheckpointHeader));
+		aHeader.balanceOffset = offset;
+		offset = align(offset + aHeader.traders * (aHeader.width / 8));
+		aHeader.winsOffset = offset;
+		aHeader.lossesOffset = offset;
+		if (aHeader.stats)
+		{
+			offset = align(offset + aHeader.traders * sizeof(uint64_t));
+			aHeader.lossesOffset = offset;
+			offset = align(offset + aHeader.traders * sizeof(uint64_t));
+		}
+		aHeader.wealthOffset = offset;
+		offset = align(offset + (aHeader.bins + 3) * sizeof(int64_t));
+		aHeader.orderOffset = offset;
+		offset = align(offset + aHeader.orderCapacity * sizeof(uint32_t));
+		aHeader.streamOffset = offset;
+		offset = align(offset + aHeader.streams * RandomStream::STATE_BYTES);
+		aHeader.fileSize = offset;
+	}
+
+	// New checkpoint file laid out as aLayout
+	bool create(const char *aPath, const CheckpointHeader &aLayout)
+	{
+		map = std::make_shared<MappedFile>();
+		if (!map->create(aPath, aLayout.fileSize))
+		{
+			return false;
+		}
+		memcpy(map->data(), &aLayout, sizeof(aLayout));
+		return true;
+	}
+
+	// Existing checkpoint, mapped copy-on-write
+	bool open(const char *aPath)
+	{
+		map = std::make_shared<MappedFile>();
+		if (!map->openPrivate(aPath) || (map->size() < sizeof(CheckpointHeader)))
+		{
+			return false;
+		}
+		const CheckpointHeader &h = header();
+		return (memcmp(h.magic, "TRADERS", 8) == 0) && (h.version == VERSION) && (h.fileSize == map->size());
+	}
+
+	void close() { map.reset(); }
+
+	CheckpointHeader &header() const { return *static_cast<CheckpointHeader *>(map->data()); }
+
+	template <typename T>
+	T *section(uint64_t aOffset) const
+	{
+		return reinterpret_cast<T *>(static_cast<uint8_t *>(map->data()) + aOffset);
+	}
+
+	bool flush() { return map->flush(); }
+
+	// Shared so that columns used in place keep the mapping alive
+	std::shared_ptr<MappedFile> mapping() const { return map; }
+
+private:
+	static uint64_t align(uint64_t aOffset) { return (aOffset + 63) & ~63ull; }
+
+	std::shared_ptr<MappedFile> map;
+};
+
+class CheckpointWriter
+{
+public:
+	CheckpointWriter(const std::string &aPath, const CheckpointHeader &aLayout)
+		: path(aPath)
+		, temporary(aPath + ".tmp")
+		, layout(aLayout)
+		, state(PREPARING)
+		, stopping(false)
+		, errors(0)
+		, thread(&CheckpointWriter::run, this)
+	{
+	}
+
+	// Finishes any write in flight
+	~CheckpointWriter()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [this] { return state != COMMITTED; });
+			stopping = true;
+		}
+		changed.notify_all();
+		thread.join();
+	}
+
+	CheckpointWriter(const CheckpointWriter &) = delete;
+	CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+	// The mapped file for the next checkpoint, once the writer has it ready.
+	// Returns null if it could not be created.
+	Checkpoint *begin()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this] { return (state == READY) || (state == FAILED); });
+		return (state == READY) ? &next : nullptr;
+	}
+
+	// Hand the filled checkpoint to the writer
+	void commit()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			state = COMMITTED;
+		}
+		changed.notify_all();
+	}
+
+	// Checkpoints that could not be written, once any write in flight is done
+	uint64_t failures()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this] { return state != COMMITTED; });
+		return errors;
+	}
+
+private:
+	enum State
+	{
+		PREPARING,
+		READY,
+		COMMITTED,
+		FAILED
+	};
+
+	void run()
+	{
+		for (;;)
+		{
+			bool ok = next.create(temporary.c_str(), layout);
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				state = ok ? READY : FAILED;
+				changed.notify_all();
+				changed.wait(lock, [this] { return stopping || (state == COMMITTED); });
+				if (state != COMMITTED)
+				{
+					break;
+				}
+			}
+
+			ok = next.flush();
+			next.close();
+			ok = ok && MappedFile::replace(temporary.c_str(), path.c_str());
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!ok && (errors == 0))
+			{
+				// Said once, as it happens; the total is reported at the end
+				fprintf(stderr, "Cannot write checkpoint %s\n", path.c_str());
+			}
+			errors += ok ? 0 : 1;
+			state = PREPARING;
+			changed.notify_all();
+			if (stopping)
+			{
+				return;
+			}
+		}
+
+		// Stopped with a prepared file nobody used
+		next.close();
+		remove(temporary.c_str());
+	}
+
+	std::string path;
+	std::string temporary;
+	CheckpointHeader layout;
+	Checkpoint next;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	State state;
+	bool stopping;
+	uint64_t errors;
+	std::thread thread;				// Last so everything above is ready when it starts
+};
+
+#endif	/* _CHECKPOINT_H */
@@ -0,0 +1,324 @@
+// FairnessTest.h : Statistical battery for the coins behind the trades.
+//
+// Every trade is decided by random bits, so a generator is only fit for the
+// simulation if its bits look like fair, independent coin flips. The battery
+// draws a large number of bits from a generator on several threads (one
+// stream per thread) and applies
+//   frequency    ones against zeros
+//   runs         the number of runs of equal bits (NIST SP 800-22 2.3)
+//   serial       lag-1 correlation of successive outputs (top 16 bits of
+//                each 32-bit word)
+//   pairs        chi-square over non-overlapping 2-bit patterns (3 d.f.)
+//   triples      chi-square over non-overlapping 3-bit patterns (7 d.f.)
+// and reports a p-value for each. A p-value below FAIRNESS_ALPHA fails.
+//
+// Bits are tallied 64 at a time with popcounts, so the tests keep up with
+// the faster generators. "coin" is the original std::default_random_engine
+// behind a uniform_int_distribution(0, 1), one call per bit; the others are
+// the RandomStream engines used for trading.
+
+#ifndef _FAIRNESS_TEST_H
+#define _FAIRNESS_TEST_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "RandomStream.h"
+#include "LeapKernel.h"
+
+const double FAIRNESS_ALPHA = 0.001;
+
+// Everything the tests need from a stream of bits; tallies of separate
+// streams add up
+struct FairnessTally
+{
+	uint64_t bits;
+	uint64_t ones;
+	uint64_t transitions;		// Neighbouring bits that differ
+	uint64_t pairs[4];
+	uint64_t triples[8];
+
+	uint64_t values;			// 16-bit values for the serial test
+	double sum;
+	double sumSquares;
+	double sumProducts;			// Of each value with the one before
+
+	void merge(const FairnessTally &aOther)
+	{
+		bits += aOther.bits;
+		ones += aOther.ones;
+		transitions += aOther.transitions;
+		for (int k = 0; k < 4; ++k)
+		{
+			pairs[k] += aOther.pairs[k];
+		}
+		for (int k = 0; k < 8; ++k)
+		{
+			triples[k] += aOther.triples[k];
+		}
+		values += aOther.values;
+		sum += aOther.sum;
+		sumSquares += aOther.sumSquares;
+		sumProducts += aOther.sumProducts;
+	}
+};
+
+// Tallies a stream 64 bits at a time, least significant bit first
+class FairnessCounter
+{
+public:
+	FairnessCounter() : tally(), started(false), lastBit(0), lastValue(0), pending(0), sum(0), sumSquares(0), sumProducts(0) {}
+
+	void add(const uint64_t *aWords, size_t aCount)
+	{
+		const uint64_t EVEN = 0x5555555555555555ull;
+		const uint64_t THIRD = 0x1249249249249249ull;		// Bits 0, 3, ... 60
+		for (size_t i = 0; i < aCount; ++i)
+		{
+			uint64_t w = aWords[i];
+			tally.ones += popCount(w);
+			tally.transitions += popCount((w ^ (w >> 1)) & 0x7FFFFFFFFFFFFFFFull);
+			if (started)
+			{
+				tally.transitions += (lastBit ^ w) & 1;
+			}
+			lastBit = w >> 63;
+
+			uint64_t lo = w & EVEN;
+			uint64_t hi = (w >> 1) & EVEN;
+			tally.pairs[3] += popCount(hi & lo);
+			tally.pairs[2] += popCount(hi & ~lo);
+			tally.pairs[1] += popCount(~hi & lo);
+			tally.pairs[0] += popCount(~(hi | lo) & EVEN);
+
+			uint64_t b0 = w & THIRD;
+			uint64_t b1 = (w >> 1) & THIRD;
+			uint64_t b2 = (w >> 2) & THIRD;
+			for (int k = 0; k < 8; ++k)
+			{
+				uint64_t m = ((k & 1) ? b0 : ~b0) & ((k & 2) ? b1 : ~b1) & ((k & 4) ? b2 : ~b2) & THIRD;
+				tally.triples[k] += popCount(m);
+			}
+
+			// The two 32-bit outputs in the word, low first
+			serial(static_cast<uint32_t>(w) >> 16);
+			serial(static_cast<uint32_t>(w >> 32) >> 16);
+			started = true;
+		}
+		tally.bits += 64 * aCount;
+	}
+
+	const FairnessTally &result()
+	{
+		flush();
+		return tally;
+	}
+
+private:
+	// Exact in 64 bits for this many values, then moved to the doubles
+	static const uint64_t FLUSH_VALUES = 1 << 20;
+
+	void serial(uint64_t aValue)
+	{
+		sum += aValue;
+		sumSquares += aValue * aValue;
+		if (tally.values + pending != 0)
+		{
+			sumProducts += aValue * lastValue;
+		}
+		lastValue = aValue;
+		if (++pending == FLUSH_VALUES)
+		{
+			flush();
+		}
+	}
+
+	void flush()
+	{
+		tally.values += pending;
+		tally.sum += static_cast<double>(sum);
+		tally.sumSquares += static_cast<double>(sumSquares);
+		tally.sumProducts += static_cast<double>(sumProducts);
+		pending = 0;
+		sum = 0;
+		sumSquares = 0;
+		sumProducts = 0;
+	}
+
+	FairnessTally tally;
+	bool started;
+	uint64_t lastBit;
+	uint64_t lastValue;
+	uint64_t pending;
+	uint64_t sum;
+	uint64_t sumSquares;
+	uint64_t sumProducts;
+};
+
+// Upper tail of the chi-square distribution with aFreedom degrees of freedom,
+// Q(d/2, x/2), built up from Q(1/2) or Q(1) one step at a time
+inline double chiSquareTail(double aChiSquare, unsigned int aFreedom)
+{
+	const double x = aChiSquare / 2.0;
+	double a = (aFreedom % 2) ? 0.5 : 1.0;
+	double q = (aFreedom % 2) ? std::erfc(std::sqrt(x)) : std::exp(-x);
+	double term = (aFreedom % 2) ? std::sqrt(x) * std::exp(-x) / (std::sqrt(3.141592653589793) / 2.0) : x * std::exp(-x);
+	for (; a < aFreedom / 2.0; a += 1.0)
+	{
+		q += term;
+		term *= x / (a + 1.0);
+	}
+	return std::min(1.0, q);
+}
+
+inline double normalTail(double aZ)
+{
+	return std::erfc(std::fabs(aZ) / std::sqrt(2.0));
+}
+
+inline double chiSquare(const uint64_t *aCounts, unsigned int aCells)
+{
+	uint64_t total = 0;
+	for (unsigned int k = 0; k < aCells; ++k)
+	{
+		total += aCounts[k];
+	}
+	double expected = static_cast<double>(total) / aCells;
+	double x = 0.0;
+	for (unsigned int k = 0; k < aCells; ++k)
+	{
+		double d = static_cast<double>(aCounts[k]) - expected;
+		x += d * d / expected;
+	}
+	return x;
+}
+
+struct FairnessResult
+{
+	FairnessTally tally;
+	double seconds;
+	double frequency;			// p-values
+	double runs;
+	double serial;
+	double pairs;
+	double triples;
+
+	bool passed() const
+	{
+		return std::min(std::min(std::min(frequency, runs), std::min(serial, pairs)), triples) >= FAIRNESS_ALPHA;
+	}
+};
+
+inline void fairnessPValues(FairnessResult &aResult)
+{
+	const FairnessTally &t = aResult.tally;
+	const double n = static_cast<double>(t.bits);
+
+	aResult.frequency = normalTail((static_cast<double>(t.ones) - n / 2.0) / std::sqrt(n / 4.0));
+
+	double pi = static_cast<double>(t.ones) / n;
+	double spread = 2.0 * std::sqrt(2.0 * n) * pi * (1.0 - pi);
+	double runs = static_cast<double>(t.transitions) + 1.0;
+	aResult.runs = std::erfc(std::fabs(runs - 2.0 * n * pi * (1.0 - pi)) / spread);
+
+	double m = static_cast<double>(t.values);
+	double correlation = (m * t.sumProducts - t.sum * t.sum) / (m * t.sumSquares - t.sum * t.sum);
+	aResult.serial = normalTail(correlation * std::sqrt(m));
+
+	aResult.pairs = chiSquareTail(chiSquare(t.pairs, 4), 3);
+	aResult.triples = chiSquareTail(chiSquare(t.triples, 8), 7);
+}
+
+// Run the battery on aBits bits (rounded up to whole blocks) from aThreads
+// streams of the named source: "coin" or a RandomKind name
+inline FairnessResult testFairness(const char *aSource, uint64_t aBits, unsigned int aThreads, uint64_t aSeed)
+{
+	static const size_t BLOCK = 4096;		// 64-bit words
+	const unsigned int threads = std::max(1u, aThreads);
+	const uint64_t blocks = (aBits + 64 * BLOCK - 1) / (64 * BLOCK);
+	const bool coin = (strcmp(aSource, "coin") == 0);
+	RandomKind kind = RandomKind::XOSHIRO;
+	parseRandomKind(aSource, kind);
+
+	std::vector<FairnessTally> tallies(threads);
+	auto work = [&](unsigned int aThread)
+	{
+		std::vector<uint64_t> words(BLOCK);
+		FairnessCounter counter;
+		std::default_random_engine engine(static_cast<std::default_random_engine::result_type>(aSeed + aThread));
+		std::uniform_int_distribution<int> flip(0, 1);
+		RandomStream stream(kind, aSeed, aThread);
+
+		for (uint64_t b = aThread; b < blocks; b += threads)
+		{
+			if (coin)
+			{
+				for (size_t i = 0; i < BLOCK; ++i)
+				{
+					uint64_t w = 0;
+					for (int k = 0; k < 64; ++k)
+					{
+						w |= static_cast<uint64_t>(flip(engine)) << k;
+					}
+					words[i] = w;
+				}
+			}
+			else
+			{
+				stream.source().fill(reinterpret_cast<uint32_t *>(words.data()), 2 * BLOCK);
+			}
+			counter.add(words.data(), BLOCK);
+		}
+		tallies[aThread] = counter.result();
+	};
+
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<std::thread> helpers;
+	for (unsigned int t = 1; t < threads; ++t)
+	{
+		helpers.emplace_back(work, t);
+	}
+	work(0);
+	for (auto &h : helpers)
+	{
+		h.join();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+
+	FairnessResult result = {};
+	for (const FairnessTally &t : tallies)
+	{
+		result.tally.merge(t);
+	}
+	result.seconds = elapsed.count();
+	fairnessPValues(result);
+	return result;
+}
+
+// The battery over every source, one line each; returns true if all pass
+inline bool fairnessBattery(uint64_t aBits, unsigned int aThreads, uint64_t aSeed)
+{
+	static const char *const SOURCES[] = { "coin", "std", "philox", "xoshiro" };
+
+	printf("Coin fairness: %llu bits per generator on %u thread(s), failing below p = %g\n", aBits, aThreads, FAIRNESS_ALPHA);
+	printf("%-8s %14s %9s %10s %10s %10s %10s %10s  %s\n", "source", "bits", "Gbit/s", "frequency", "runs", "serial", "pairs", "triples", "result");
+	bool all = true;
+	for (const char *source : SOURCES)
+	{
+		FairnessResult r = testFairness(source, aBits, aThreads, aSeed);
+		printf("%-8s %14llu %9.3f %10.4f %10.4f %10.4f %10.4f %10.4f  %s\n", source, r.tally.bits,
+			static_cast<double>(r.tally.bits) / r.seconds / 1.0e9, r.frequency, r.runs, r.serial, r.pairs, r.triples,
+			r.passed() ? "pass" : "FAIL");
+		all = all && r.passed();
+	}
+	return all;
+}
+
+#endif	/* _FAIRNESS_TEST_H */
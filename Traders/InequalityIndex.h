@@ -0,0 +1,275 @@
+// InequalityIndex.h : Streaming inequality metrics over the trader balances.
+//
+// A Fenwick tree indexed by balance holds the number of traders at or below
+// a balance and the money they hold between them. Moving one trader from one
+// balance to another is O(log W) for a largest balance W, and so is every
+// query: quantiles and top shares walk down the tree instead of sorting the
+// population.
+//
+// The Gini coefficient is kept as the sum of |x_i - x_j| over all pairs of
+// traders. Adding a trader at v changes it by the sum of |v - x_j| over
+// everyone else, which the tree gives in O(log W), so the coefficient
+// itself is an O(1) read. A trade moves a balance by one, which only
+// changes the pair sum by the number of traders on either side of it, so the
+// per-trade update needs one prefix count rather than four prefix sums. The
+// pair sum is at most n^2 * W / 4 and exact while that fits in 64 bits.
+//
+// The tree is a power of two long and doubles in place when a balance
+// outgrows it: the new upper half is empty apart from its root, which
+// covers everything.
+//
+// Bulk changes made outside the per-trade path (tax, the shards of the
+// parallel engine) are folded in by marking the balances beforehand and
+// updating from whatever changed.
+
+#ifndef _INEQUALITY_INDEX_H
+#define _INEQUALITY_INDEX_H
+
+#include <cstdint>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+class InequalityIndex
+{
+public:
+	explicit InequalityIndex(uint64_t aLargest = 1)
+		: size(1)
+		, traders(0)
+		, money(0)
+		, spread(0)
+	{
+		while (size <= aLargest)
+		{
+			size *= 2;
+		}
+		tree.assign(size + 1, Node());
+	}
+
+	void clear()
+	{
+		std::fill(tree.begin(), tree.end(), Node());
+		traders = 0;
+		money = 0;
+		spread = 0;
+	}
+
+	// Count a trader with this balance
+	void add(uint64_t aBalance)
+	{
+		while (aBalance >= size)
+		{
+			grow();
+		}
+		spread += distance(aBalance);
+		adjust(aBalance, 1);
+	}
+
+	void remove(uint64_t aBalance)
+	{
+		adjust(aBalance, -1);
+		spread -= distance(aBalance);
+	}
+
+	// A trader's balance has changed
+	void move(uint64_t aFrom, uint64_t aTo)
+	{
+		if (aTo == aFrom + 1)
+		{
+			// Further from everyone at or below aFrom but self, closer to the rest
+			if (aTo >= size)
+			{
+				grow();
+			}
+			spread += 2 * prefix(aFrom) - 1 - traders;
+			step(aFrom, aTo);
+		}
+		else if (aTo + 1 == aFrom)
+		{
+			spread += traders - 1 - 2 * prefix(aTo);
+			step(aFrom, aTo);
+		}
+		else if (aFrom != aTo)
+		{
+			remove(aFrom);
+			add(aTo);
+		}
+	}
+
+	// Bulk changes: remember the balances, make the changes, then fold in
+	// the differences
+	template <typename Balance>
+	void mark(const Balance *aBalances, uint64_t aCount)
+	{
+		before.assign(aBalances, aBalances + aCount);
+	}
+
+	template <typename Balance>
+	void update(const Balance *aBalances, uint64_t aCount)
+	{
+		for (uint64_t i = 0; i < aCount; ++i)
+		{
+			move(before[i], aBalances[i]);
+		}
+	}
+
+	uint64_t count() const { return traders; }
+	uint64_t wealth() const { return money; }
+
+	// Mean absolute difference over twice the mean
+	double gini() const
+	{
+		return (money == 0) ? 0.0 : static_cast<double>(spread) / (static_cast<double>(traders) * static_cast<double>(money));
+	}
+
+	// The balance of the trader at rank aRank (1 = poorest)
+	uint64_t ranked(uint64_t aRank) const
+	{
+		uint64_t node = 0;
+		for (uint64_t step = size; step > 0; step /= 2)
+		{
+			if ((node + step <= size) && (tree[node + step].count < aRank))
+			{
+				node += step;
+				aRank -= tree[node].count;
+			}
+		}
+		return node;		// Node node+1 holds balance node
+	}
+
+	// The balance at or below which a share aQuantile of the traders lie
+	uint64_t quantile(double aQuantile) const
+	{
+		uint64_t rank = static_cast<uint64_t>(std::ceil(aQuantile * static_cast<double>(traders)));
+		return ranked(std::min(std::max<uint64_t>(rank, 1), traders));
+	}
+
+	// Share of all money held by the richest aFraction of the traders
+	double topShare(double aFraction) const
+	{
+		uint64_t top = static_cast<uint64_t>(std::llround(aFraction * static_cast<double>(traders)));
+		if ((top == 0) || (money == 0))
+		{
+			return 0.0;
+		}
+		uint64_t rest = traders - std::min(top, traders);
+		if (rest == 0)
+		{
+			return 1.0;
+		}
+
+		// Everyone above the richest of the rest, and part of those level with them
+		uint64_t edge = ranked(rest);
+		uint64_t atOrBelow = prefix(edge);
+		uint64_t held = (money - prefixSum(edge)) + (atOrBelow - rest) * edge;
+		return static_cast<double>(held) / static_cast<double>(money);
+	}
+
+private:
+	struct Node
+	{
+		Node() : count(0), sum(0) {}
+		uint64_t count;
+		uint64_t sum;
+	};
+
+	// Traders at or below aBalance, and the money they hold
+	uint64_t prefix(uint64_t aBalance) const
+	{
+		uint64_t total = 0;
+		for (uint64_t node = aBalance + 1; node > 0; node &= node - 1)
+		{
+			total += tree[node].count;
+		}
+		return total;
+	}
+
+	uint64_t prefixSum(uint64_t aBalance) const
+	{
+		uint64_t total = 0;
+		for (uint64_t node = aBalance + 1; node > 0; node &= node - 1)
+		{
+			total += tree[node].sum;
+		}
+		return total;
+	}
+
+	void adjust(uint64_t aBalance, int64_t aDelta)
+	{
+		for (uint64_t node = aBalance + 1; node <= size; node += node & (0 - node))
+		{
+			tree[node].count += static_cast<uint64_t>(aDelta);
+			tree[node].sum += static_cast<uint64_t>(aDelta) * aBalance;
+		}
+		traders += static_cast<uint64_t>(aDelta);
+		money += static_cast<uint64_t>(aDelta) * aBalance;
+	}
+
+	// Move one trader between neighbouring balances. The two update paths
+	// meet after a few nodes; above that the count is unchanged and only the
+	// money moves by one.
+	void step(uint64_t aFrom, uint64_t aTo)
+	{
+		uint64_t from = aFrom + 1;
+		uint64_t to = aTo + 1;
+		while ((from != to) && (from <= size) && (to <= size))
+		{
+			if (from < to)
+			{
+				tree[from].count--;
+				tree[from].sum -= aFrom;
+				from += from & (0 - from);
+			}
+			else
+			{
+				tree[to].count++;
+				tree[to].sum += aTo;
+				to += to & (0 - to);
+			}
+		}
+		if (from == to)
+		{
+			for (; from <= size; from += from & (0 - from))
+			{
+				tree[from].sum += aTo - aFrom;
+			}
+			to = from;
+		}
+		for (; from <= size; from += from & (0 - from))
+		{
+			tree[from].count--;
+			tree[from].sum -= aFrom;
+		}
+		for (; to <= size; to += to & (0 - to))
+		{
+			tree[to].count++;
+			tree[to].sum += aTo;
+		}
+		money += aTo - aFrom;
+	}
+
+	// Sum of |aBalance - x| over everyone counted
+	uint64_t distance(uint64_t aBalance) const
+	{
+		uint64_t below = prefix(aBalance);
+		uint64_t held = prefixSum(aBalance);
+		return (aBalance * below - held) + ((money - held) - aBalance * (traders - below));
+	}
+
+	void grow()
+	{
+		tree.resize(2 * size + 1);
+		size *= 2;
+		tree[size].count = traders;
+		tree[size].sum = money;
+	}
+
+	uint64_t size;							// Balances 0..size-1 are held at nodes 1..size
+	std::vector<Node> tree;
+	uint64_t traders;
+	uint64_t money;
+	uint64_t spread;						// Sum of |x_i - x_j| over pairs
+	std::vector<uint64_t> before;			// Balances marked for a bulk update
+};
+
+#endif	/* _INEQUALITY_INDEX_H */
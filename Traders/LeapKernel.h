@@ -0,0 +1,147 @@
+// LeapKernel.h : Approximate trading in large steps ("leap" mode).
+//
+// A trade moves one unit between two random solvent traders on a fair coin,
+// so over a stretch of trades a trader's net gain is a sum of +1/-1 steps. A
+// leap pairs the solvent traders off at random and lets each pair play
+// aPerTrader trades with each other at once. The first trader's net gain is
+// sampled as 2 * Binomial(aPerTrader, 1/2) - aPerTrader, and the second trader
+// loses exactly what the first gains, so money is conserved by construction.
+// A trader takes part in as many trades per step, with the same variance of
+// gain, as in the exact model; what is lost is the mixing of partners within
+// a step, which the fresh pairing of the next step restores.
+//
+// The exact model stops a trader at zero. A leap could carry a loser past it,
+// so a flow is clipped at what the loser holds (and at the winner's ceiling
+// for narrow balance columns). Clipped flows are counted, with the units that
+// were not moved, as the measure of how far a run strays from the exact path;
+// if they are not rare the step is too long.
+//
+// The binomial is sampled exactly from coin bits up to LEAP_EXACT_TRADES
+// trades per step and from its normal approximation beyond.
+
+#ifndef _LEAP_KERNEL_H
+#define _LEAP_KERNEL_H
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "ActiveSet.h"
+#include "RandomStream.h"
+#include "WealthHistogram.h"
+
+const uint64_t LEAP_EXACT_TRADES = 256;
+
+struct LeapStats
+{
+	uint64_t steps;
+	uint64_t flows;			// Pair flows applied
+	uint64_t clipped;		// Flows cut short at zero or the ceiling
+	uint64_t unmoved;		// Units the clipped flows did not move
+};
+
+inline uint64_t popCount(uint64_t aBits)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	return __popcnt64(aBits);
+#elif defined(_MSC_VER)
+	return __popcnt(static_cast<uint32_t>(aBits)) + __popcnt(static_cast<uint32_t>(aBits >> 32));
+#else
+	return __builtin_popcountll(aBits);
+#endif
+}
+
+// Net gain of one side over aTrades fair coin tosses
+inline int64_t sampleNetGain(RandomStream &aRng, uint64_t aTrades)
+{
+	if (aTrades <= LEAP_EXACT_TRADES)
+	{
+		uint64_t words[LEAP_EXACT_TRADES / 64];
+		uint64_t count = (aTrades + 63) / 64;
+		aRng.fillBits(words, count);
+		uint64_t spare = count * 64 - aTrades;
+		words[count - 1] &= ~0ull >> spare;
+		uint64_t wins = 0;
+		for (uint64_t k = 0; k < count; ++k)
+		{
+			wins += popCount(words[k]);
+		}
+		return 2 * static_cast<int64_t>(wins) - static_cast<int64_t>(aTrades);
+	}
+
+	// Box-Muller; the gain has the parity of aTrades
+	const double twoPi = 6.283185307179586;
+	double z = std::sqrt(-2.0 * std::log(1.0 - aRng.uniform())) * std::cos(twoPi * aRng.uniform());
+	double wins = std::floor(0.5 * static_cast<double>(aTrades) + 0.5 * z * std::sqrt(static_cast<double>(aTrades)) + 0.5);
+	int64_t w = static_cast<int64_t>(std::min(std::max(wins, 0.0), static_cast<double>(aTrades)));
+	return 2 * w - static_cast<int64_t>(aTrades);
+}
+
+// One leap: every pair of solvent traders plays aPerTrader trades. Returns
+// the trades stood for; an odd trader out sits the step out.
+template <typename Store>
+uint64_t leap(Store &aStore, ActiveSet &aActive, RandomStream &aRng, WealthHistogram &aWealth, uint64_t aPerTrader, LeapStats &aStats)
+{
+	typedef typename Store::BalanceType Balance;
+
+	Balance *balance = aStore.balance();
+	uint64_t *wins = aStore.wins();
+	uint64_t *losses = aStore.losses();
+
+	aActive.shuffle(aRng);
+	const uint64_t pairs = aActive.size() / 2;
+	std::vector<uint32_t> broke;
+	for (uint64_t p = 0; p < pairs; ++p)
+	{
+		uint64_t a = aActive[2 * p];
+		uint64_t b = aActive[2 * p + 1];
+		int64_t gain = sampleNetGain(aRng, aPerTrader);
+		uint64_t winner = (gain >= 0) ? a : b;
+		uint64_t loser = (gain >= 0) ? b : a;
+		uint64_t flow = static_cast<uint64_t>((gain >= 0) ? gain : -gain);
+
+		if (wins)
+		{
+			// Wins of the winning side; clipping below does not change them
+			uint64_t w = (aPerTrader + flow) / 2;
+			wins[winner] += w;
+			losses[winner] += aPerTrader - w;
+			wins[loser] += aPerTrader - w;
+			losses[loser] += w;
+		}
+
+		uint64_t wb = balance[winner];
+		uint64_t lb = balance[loser];
+		uint64_t moved = std::min<uint64_t>(flow, std::min<uint64_t>(lb, Store::CEILING - wb));
+		if (moved < flow)
+		{
+			aStats.clipped++;
+			aStats.unmoved += flow - moved;
+		}
+		balance[winner] = static_cast<Balance>(wb + moved);
+		balance[loser] = static_cast<Balance>(lb - moved);
+		aWealth.move(wb, wb + moved);
+		aWealth.move(lb, lb - moved);
+		if (lb == moved)
+		{
+			broke.push_back(static_cast<uint32_t>(loser));
+		}
+	}
+
+	// Members were read by position above, so only leave once all are paired
+	for (uint32_t t : broke)
+	{
+		aActive.remove(t);
+	}
+
+	aStats.steps++;
+	aStats.flows += pairs;
+	return pairs * aPerTrader;
+}
+
+#endif	/* _LEAP_KERNEL_H */
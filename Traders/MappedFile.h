@@ -0,0 +1,257 @@
+// MappedFile.h : Minimal memory-mapped file for Windows and POSIX.
+//
+// Two ways in:
+//   create()       a new file of a fixed size mapped read/write and shared, so
+//                  stores land in the page cache and flush() pushes them to disk
+//   openPrivate()  an existing file mapped copy-on-write; pages are read on
+//                  first touch and writes stay private to the process, so a large
+//                  file can be used in place without reading it up front
+//   createShared() named shared memory with no file behind it, which other
+//   openShared()   processes map by name (removeShared() takes the name away
+//                  once they have; the memory lives while anyone maps it)
+
+#ifndef _MAPPED_FILE_H
+#define _MAPPED_FILE_H
+
+#include <cstdint>
+#include <cstdio>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class MappedFile
+{
+public:
+	MappedFile() : base(nullptr), length(0)
+#if defined(_WIN32)
+		, file(INVALID_HANDLE_VALUE), mapping(nullptr)
+#else
+		, fd(-1)
+#endif
+	{
+	}
+
+	~MappedFile() { close(); }
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	bool create(const char *aPath, uint64_t aSize)
+	{
+		close();
+#if defined(_WIN32)
+		file = CreateFileA(aPath, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(aSize >> 32), static_cast<DWORD>(aSize), nullptr);
+		base = mapping ? MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0) : nullptr;
+#else
+		fd = ::open(aPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if ((fd < 0) || (ftruncate(fd, static_cast<off_t>(aSize)) != 0))
+		{
+			close();
+			return false;
+		}
+		base = mmap(nullptr, aSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED)
+		{
+			base = nullptr;
+		}
+#endif
+		length = aSize;
+		if (!base)
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	bool openPrivate(const char *aPath)
+	{
+		close();
+#if defined(_WIN32)
+		file = CreateFileA(aPath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		LARGE_INTEGER size;
+		if ((file == INVALID_HANDLE_VALUE) || !GetFileSizeEx(file, &size))
+		{
+			close();
+			return false;
+		}
+		length = static_cast<uint64_t>(size.QuadPart);
+		mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+		base = mapping ? MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0) : nullptr;
+#else
+		fd = ::open(aPath, O_RDONLY);
+		struct stat st;
+		if ((fd < 0) || (fstat(fd, &st) != 0))
+		{
+			close();
+			return false;
+		}
+		length = static_cast<uint64_t>(st.st_size);
+		base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (base == MAP_FAILED)
+		{
+			base = nullptr;
+		}
+#endif
+		if (!base)
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	bool createShared(const char *aName, uint64_t aSize)
+	{
+		close();
+#if defined(_WIN32)
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(aSize >> 32), static_cast<DWORD>(aSize), aName);
+		base = mapping ? MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0) : nullptr;
+#else
+		fd = shm_open(aName, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if ((fd < 0) || (ftruncate(fd, static_cast<off_t>(aSize)) != 0))
+		{
+			close();
+			removeShared(aName);
+			return false;
+		}
+		base = mmap(nullptr, aSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED)
+		{
+			base = nullptr;
+		}
+#endif
+		length = aSize;
+		if (!base)
+		{
+			close();
+			removeShared(aName);
+			return false;
+		}
+		return true;
+	}
+
+	bool openShared(const char *aName)
+	{
+		close();
+#if defined(_WIN32)
+		mapping = OpenFileMappingA(FILE_MAP_WRITE, FALSE, aName);
+		base = mapping ? MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0) : nullptr;
+		MEMORY_BASIC_INFORMATION info;
+		if (base && VirtualQuery(base, &info, sizeof(info)))
+		{
+			length = static_cast<uint64_t>(info.RegionSize);
+		}
+#else
+		fd = shm_open(aName, O_RDWR, 0);
+		struct stat st;
+		if ((fd < 0) || (fstat(fd, &st) != 0))
+		{
+			close();
+			return false;
+		}
+		length = static_cast<uint64_t>(st.st_size);
+		base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED)
+		{
+			base = nullptr;
+		}
+#endif
+		if (!base)
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	static void removeShared(const char *aName)
+	{
+#if defined(_WIN32)
+		(void)aName;		// Goes with the last handle
+#else
+		shm_unlink(aName);
+#endif
+	}
+
+	// Write dirty pages of a shared mapping back to the file
+	bool flush()
+	{
+#if defined(_WIN32)
+		return (FlushViewOfFile(base, 0) != 0) && (FlushFileBuffers(file) != 0);
+#else
+		return msync(base, length, MS_SYNC) == 0;
+#endif
+	}
+
+	void close()
+	{
+#if defined(_WIN32)
+		if (base)
+		{
+			UnmapViewOfFile(base);
+		}
+		if (mapping)
+		{
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(file);
+		}
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (base)
+		{
+			munmap(base, length);
+		}
+		if (fd >= 0)
+		{
+			::close(fd);
+		}
+		fd = -1;
+#endif
+		base = nullptr;
+		length = 0;
+	}
+
+	void *data() const { return base; }
+	uint64_t size() const { return length; }
+
+	// Atomically replace aTo with aFrom
+	static bool replace(const char *aFrom, const char *aTo)
+	{
+#if defined(_WIN32)
+		return MoveFileExA(aFrom, aTo, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+		return rename(aFrom, aTo) == 0;
+#endif
+	}
+
+private:
+	void *base;
+	uint64_t length;
+#if defined(_WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+};
+
+#endif	/* _MAPPED_FILE_H */
@@ -0,0 +1,337 @@
+// MetricsStream.h : Time series output for Traders runs.
+//
+// The display only ever shows the latest state, so a MetricsStream records the
+// run as it goes: a sample of the counters, inequality figures and histogram
+// every so many trades, and optionally the whole balance column at a coarser
+// cadence, for analysis afterwards.
+//
+// The trading thread never touches the file. Samples are copied into slots of
+// a preallocated single producer, single consumer ring, which costs a few
+// dozen stores and no locks or system calls; a writer thread wakes a few times
+// a second, drains the rings and formats and writes the records. If the writer
+// falls a whole ring behind, records are dropped and counted rather than
+// holding up the trades.
+//
+// The binary format is a MetricsHeader followed by records, each a kind word,
+// a payload length in words and the payload, all in native byte order:
+//   SAMPLE  trades, seconds, winners, losers, disenfranchised, median, gini,
+//           top1, top10 (doubles as their bits; the last four are zero
+//           without the inequality index), then the histogram bins
+//   WEALTH  trades, then the balance column packed at the run's width and
+//           padded to a whole word
+// A CSV stream holds the samples only, one row each.
+
+#ifndef _METRICS_STREAM_H
+#define _METRICS_STREAM_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include "Renderer.h"
+
+enum class MetricsFormat
+{
+	BINARY,
+	CSV
+};
+
+struct MetricsHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t width;				// Bits per balance in WEALTH records
+	uint64_t traders;
+	uint64_t seed;
+	uint64_t bins;
+	uint64_t binSize;			// Balances per histogram bin
+	uint64_t inequality;		// 1 if samples carry the inequality figures
+	uint64_t reserved[2];
+};
+
+// Fixed size slots passed from one producer thread to one consumer thread
+class MetricsRing
+{
+public:
+	MetricsRing(uint64_t aSlots, uint64_t aSlotWords)
+		: slots(aSlots)
+		, slotWords(aSlotWords)
+		, words(aSlots * aSlotWords)
+		, head(0)
+		, tail(0)
+	{
+	}
+
+	uint64_t slotSize() const { return slotWords; }
+
+	// Producer: the next free slot, or null if the ring is full
+	uint64_t *claim()
+	{
+		uint64_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == slots)
+		{
+			return nullptr;
+		}
+		return &words[(h % slots) * slotWords];
+	}
+
+	// Producer: pass the claimed slot on
+	void push()
+	{
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// Consumer: the oldest filled slot, or null if there is none
+	const uint64_t *front() const
+	{
+		uint64_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+		{
+			return nullptr;
+		}
+		return &words[(t % slots) * slotWords];
+	}
+
+	// Consumer: hand the oldest slot back
+	void pop()
+	{
+		tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+private:
+	uint64_t slots;
+	uint64_t slotWords;
+	std::vector<uint64_t> words;
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+};
+
+class MetricsStream
+{
+public:
+	static const uint32_t VERSION = 1;
+	static const uint64_t SAMPLE = 1;
+	static const uint64_t WEALTH = 2;
+
+	static const uint64_t SAMPLE_WORDS = 9;		// Before the histogram
+	static const uint64_t SAMPLE_SLOTS = 4096;
+	static const uint64_t WEALTH_SLOTS = 2;
+	static const unsigned int WAKES_PER_SECOND = 20;
+
+	// aWealth says whether WEALTH records will be taken (binary only). Check
+	// ok() before use.
+	MetricsStream(const char *aPath, MetricsFormat aFormat, const MetricsHeader &aHeader, bool aWealth)
+		: format(aFormat)
+		, header(aHeader)
+		, file(fopen(aPath, (aFormat == MetricsFormat::CSV) ? "w" : "wb"))
+		, samples(SAMPLE_SLOTS, SAMPLE_WORDS + aHeader.bins)
+		, balances(aWealth ? WEALTH_SLOTS : 0, 1 + wealthWords(aHeader))
+		, t0(std::chrono::steady_clock::now())
+		, droppedRecords(0)
+		, errors(false)
+		, stopping(false)
+	{
+		if (!file)
+		{
+			return;
+		}
+		setvbuf(file, nullptr, _IOFBF, 1 << 20);
+		memcpy(header.magic, "TRADERSM", sizeof(header.magic));
+		header.version = VERSION;
+		writeHeader();
+		thread = std::thread(&MetricsStream::run, this);
+	}
+
+	~MetricsStream()
+	{
+		close();
+	}
+
+	MetricsStream(const MetricsStream &) = delete;
+	MetricsStream &operator=(const MetricsStream &) = delete;
+
+	bool ok() const { return file != nullptr; }
+
+	// Trading thread: record a snapshot of the run
+	void sample(const Snapshot &aSnapshot)
+	{
+		uint64_t *slot = samples.claim();
+		if (!slot)
+		{
+			droppedRecords++;
+			return;
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+		slot[0] = aSnapshot.trades;
+		slot[1] = bitsOf(elapsed.count());
+		slot[2] = aSnapshot.winners;
+		slot[3] = aSnapshot.losers;
+		slot[4] = aSnapshot.disenfranchised;
+		slot[5] = aSnapshot.median;
+		slot[6] = bitsOf(aSnapshot.gini);
+		slot[7] = bitsOf(aSnapshot.top1);
+		slot[8] = bitsOf(aSnapshot.top10);
+		memcpy(slot + SAMPLE_WORDS, aSnapshot.hist.data(), header.bins * sizeof(uint64_t));
+		samples.push();
+	}
+
+	// Trading thread: record the whole balance column
+	template <typename Balance>
+	void wealth(uint64_t aTrades, const Balance *aBalances)
+	{
+		uint64_t *slot = balances.claim();
+		if (!slot)
+		{
+			droppedRecords++;
+			return;
+		}
+		slot[0] = aTrades;
+		slot[balances.slotSize() - 1] = 0;
+		memcpy(slot + 1, aBalances, header.traders * sizeof(Balance));
+		balances.push();
+	}
+
+	// Records the rings had no room for
+	uint64_t dropped() const { return droppedRecords; }
+
+	// Write out everything still in the rings and close the file. Returns
+	// false if anything failed to reach it.
+	bool close()
+	{
+		if (thread.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_one();
+			thread.join();
+		}
+		if (file)
+		{
+			errors = (fclose(file) != 0) || errors;
+			file = nullptr;
+		}
+		return !errors;
+	}
+
+private:
+	static uint64_t wealthWords(const MetricsHeader &aHeader)
+	{
+		return (aHeader.traders * aHeader.width + 63) / 64;
+	}
+
+	static uint64_t bitsOf(double aValue)
+	{
+		uint64_t bits;
+		memcpy(&bits, &aValue, sizeof(bits));
+		return bits;
+	}
+
+	static double fromBits(uint64_t aBits)
+	{
+		double value;
+		memcpy(&value, &aBits, sizeof(value));
+		return value;
+	}
+
+	void writeHeader()
+	{
+		if (format == MetricsFormat::BINARY)
+		{
+			fwrite(&header, sizeof(header), 1, file);
+			return;
+		}
+
+		fprintf(file, "trades,seconds,winners,even,losers,disenfranchised");
+		if (header.inequality)
+		{
+			fprintf(file, ",median,gini,top1_share,top10_share");
+		}
+		for (uint64_t j = 0; j < header.bins; ++j)
+		{
+			fprintf(file, ",bin_%llu", j * header.binSize);
+		}
+		fprintf(file, "\n");
+	}
+
+	void writeRecord(uint64_t aKind, const uint64_t *aPayload, uint64_t aWords)
+	{
+		uint64_t prefix[2] = { aKind, aWords };
+		fwrite(prefix, sizeof(prefix), 1, file);
+		fwrite(aPayload, sizeof(uint64_t), aWords, file);
+	}
+
+	void writeSample(const uint64_t *aSlot)
+	{
+		if (format == MetricsFormat::BINARY)
+		{
+			writeRecord(SAMPLE, aSlot, samples.slotSize());
+			return;
+		}
+
+		fprintf(file, "%llu,%.6f,%llu,%llu,%llu,%llu", aSlot[0], fromBits(aSlot[1]),
+			aSlot[2], header.traders - aSlot[2] - aSlot[3], aSlot[3], aSlot[4]);
+		if (header.inequality)
+		{
+			fprintf(file, ",%llu,%.6f,%.6f,%.6f", aSlot[5], fromBits(aSlot[6]), fromBits(aSlot[7]), fromBits(aSlot[8]));
+		}
+		for (uint64_t j = 0; j < header.bins; ++j)
+		{
+			fprintf(file, ",%llu", aSlot[SAMPLE_WORDS + j]);
+		}
+		fprintf(file, "\n");
+	}
+
+	// Write out whatever the trading thread has passed on so far
+	void drain()
+	{
+		for (const uint64_t *slot = samples.front(); slot; slot = samples.front())
+		{
+			writeSample(slot);
+			samples.pop();
+		}
+		for (const uint64_t *slot = balances.front(); slot; slot = balances.front())
+		{
+			writeRecord(WEALTH, slot, balances.slotSize());
+			balances.pop();
+		}
+	}
+
+	void run()
+	{
+		const std::chrono::milliseconds period(1000 / WAKES_PER_SECOND);
+		bool last = false;
+		while (!last)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				last = wake.wait_for(lock, period, [this] { return stopping; });
+			}
+			drain();
+		}
+		errors = (fflush(file) != 0) || (ferror(file) != 0);
+	}
+
+	MetricsFormat format;
+	MetricsHeader header;
+	FILE *file;
+	MetricsRing samples;
+	MetricsRing balances;
+	std::chrono::steady_clock::time_point t0;
+	uint64_t droppedRecords;
+	bool errors;					// Written by the writer thread, read once it has stopped
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping;
+	std::thread thread;				// Started last, once everything above is ready
+};
+
+#endif	/* _METRICS_STREAM_H */
@@ -0,0 +1,979 @@
+// ProcessEngine.h : Trading across worker processes over shared memory.
+//
+// For populations too large for one process or one NUMA node, the balance
+// columns live in a named shared memory segment split into partitions, one
+// per worker process. A worker is this program started again with --worker;
+// it pins itself to a NUMA node, touches its own partition first so the pages
+// land on that node, and from then on is the only process that writes those
+// balances. Partitions are whole pages of every column, so no two workers
+// ever write the same cache line.
+//
+// A worker draws its traders from its own solvent set, and a partner
+// partition in proportion to the solvent traders each partition had at the
+// start of the epoch. A partner in the same partition is settled on the spot.
+// Otherwise the trade becomes a message on a lock-free single producer,
+// single consumer ring to the partner's worker, which picks one of its own
+// solvent traders:
+//   CREDIT_ANY    the initiator lost and has paid; credit one of yours
+//   DEBIT_FOR a   the initiator won; take a unit from one of yours and
+//                 send it back as CREDIT a (if nobody is solvent the trade
+//                 lapses, and is taken off the trades done)
+//   CREDIT a      a unit for trader a
+// Money is only ever debited from a solvent trader before its unit is sent,
+// so it is conserved however the messages interleave. Like the sharded
+// engine this is an approximation of the serial model: cross-partition trades
+// settle a little later, and partners are weighted by the solvent counts at
+// the start of the epoch.
+//
+// The parent runs the epochs. It publishes the epoch's trades, the workers
+// count their solvent traders, share out the trades in proportion and trade,
+// then keep serving messages until the parent sees every worker finished and
+// every message sent also received. Each worker then hands back its change to
+// the histogram. Between epochs the parent owns the whole segment and runs
+// tax, reports and metrics over it as over any store.
+//
+// Narrow 16-bit columns are not supported: a credit to a trader at the
+// ceiling goes to another trader of the partition, and only with 32 or 64
+// bits is there always one below it.
+
+#ifndef _PROCESS_ENGINE_H
+#define _PROCESS_ENGINE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <new>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <spawn.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+#include "Traders.h"
+#include "ActiveSet.h"
+#include "RandomStream.h"
+#include "WealthHistogram.h"
+#include "MappedFile.h"
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the segment needs address-free atomics");
+
+// Where everything is in the segment; offsets from its start
+struct SegmentLayout
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t width;				// Bits per balance
+	uint64_t traders;
+	uint64_t partitions;
+	uint64_t stats;				// 1 if there are win and loss columns
+	uint64_t seedMoney;
+	uint64_t par;				// Histogram shape
+	uint64_t bins;
+	uint64_t largest;
+	uint64_t random;			// RandomKind
+	uint64_t seed;
+	uint64_t parent;			// Process id, so orphaned workers can stop
+	uint64_t ringSlots;
+	uint64_t balanceOffset;
+	uint64_t winsOffset;
+	uint64_t lossesOffset;
+	uint64_t controlOffset;
+	uint64_t ringOffset;
+	uint64_t deltaOffset;
+	uint64_t deltaWords;		// Per partition, padded to a cache line
+};
+
+struct SegmentHeader
+{
+	SegmentLayout layout;
+	alignas(64) std::atomic<uint64_t> epoch;		// Parent: the epoch to run
+	std::atomic<uint64_t> trades;					// Parent: trades in it
+	std::atomic<uint64_t> rescan;					// Parent: balances changed outside the epochs
+	std::atomic<uint64_t> stopping;
+	alignas(64) std::atomic<uint64_t> closed;		// Parent: last epoch with nothing left in flight
+};
+
+// One per partition, each on cache lines of its own
+struct alignas(64) PartitionControl
+{
+	uint64_t first;				// Traders first..first+count-1
+	uint64_t count;
+	uint64_t solvent;			// Worker: solvent traders at the start, then at the end, of an epoch
+	uint64_t done;				// Worker: trades settled or sent this epoch
+	uint64_t lapsed;			// Worker: DEBIT_FORs it received this epoch with nobody to debit
+	std::atomic<uint64_t> ready;		// Worker: the epoch it has set up for (~0 until it starts)
+	std::atomic<uint64_t> counted;		// Worker: the epoch whose solvent count is published
+	std::atomic<uint64_t> finished;		// Worker: the epoch whose trades are all started
+	std::atomic<uint64_t> reported;		// Worker: the epoch whose results are written
+	alignas(64) std::atomic<uint64_t> sent;			// Messages sent, counting replies held back
+	std::atomic<uint64_t> received;					// Messages handled
+};
+
+// A single producer, single consumer ring of 64-bit messages inside the
+// segment; the slots follow the counters
+struct SharedRing
+{
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+};
+
+class RingView
+{
+public:
+	RingView() : ring(nullptr), slots(nullptr), mask(0), cachedTail(0), cachedHead(0) {}
+	RingView(SharedRing *aRing, uint64_t aSlots)
+		: ring(aRing)
+		, slots(reinterpret_cast<uint64_t *>(aRing + 1))
+		, mask(aSlots - 1)
+		, cachedTail(0)
+		, cachedHead(0)
+	{
+	}
+
+	// Producer
+	bool push(uint64_t aMessage)
+	{
+		uint64_t h = ring->head.load(std::memory_order_relaxed);
+		if (h - cachedTail > mask)
+		{
+			cachedTail = ring->tail.load(std::memory_order_acquire);
+			if (h - cachedTail > mask)
+			{
+				return false;
+			}
+		}
+		slots[h & mask] = aMessage;
+		ring->head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer
+	bool pop(uint64_t &aMessage)
+	{
+		uint64_t t = ring->tail.load(std::memory_order_relaxed);
+		if (t == cachedHead)
+		{
+			cachedHead = ring->head.load(std::memory_order_acquire);
+			if (t == cachedHead)
+			{
+				return false;
+			}
+		}
+		aMessage = slots[t & mask];
+		ring->tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	SharedRing *ring;
+	uint64_t *slots;
+	uint64_t mask;
+	uint64_t cachedTail;		// Producer's last look at the consumer
+	uint64_t cachedHead;		// And the other way round
+};
+
+// Segment layout for aTraders traders in aPartitions partitions
+inline SegmentLayout segmentLayout(uint64_t aTraders, uint64_t aPartitions, unsigned int aWidth, bool aStats, uint64_t aRingSlots, uint64_t aBins)
+{
+	const uint64_t PAGE = 4096;
+	auto pages = [PAGE](uint64_t aBytes) { return (aBytes + PAGE - 1) / PAGE * PAGE; };
+
+	SegmentLayout h = {};
+	h.width = aWidth;
+	h.traders = aTraders;
+	h.partitions = aPartitions;
+	h.stats = aStats ? 1 : 0;
+	h.bins = aBins;
+	h.ringSlots = aRingSlots;
+	h.deltaWords = (aBins + 3 + 7) / 8 * 8;
+
+	h.controlOffset = pages(sizeof(SegmentHeader));
+	h.ringOffset = h.controlOffset + pages(aPartitions * sizeof(PartitionControl));
+	h.deltaOffset = h.ringOffset + pages(aPartitions * aPartitions * (sizeof(SharedRing) + aRingSlots * sizeof(uint64_t)));
+	h.balanceOffset = h.deltaOffset + pages(aPartitions * h.deltaWords * sizeof(int64_t));
+	h.winsOffset = h.balanceOffset + pages(aTraders * aWidth / 8);
+	h.lossesOffset = h.winsOffset + (aStats ? pages(aTraders * sizeof(uint64_t)) : 0);
+	return h;
+}
+
+inline uint64_t segmentSize(const SegmentLayout &aLayout)
+{
+	return aLayout.lossesOffset + (aLayout.stats ? (aLayout.traders * sizeof(uint64_t) + 4095) / 4096 * 4096 : 0);
+}
+
+// Wait for aDone, yielding and then sleeping; gives up when aAlive says so
+template <typename Done, typename Alive>
+bool waitFor(Done aDone, Alive aAlive)
+{
+	for (uint64_t spins = 0; !aDone(); ++spins)
+	{
+		if ((spins % 1024) == 1023)
+		{
+			if (!aAlive())
+			{
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+	return true;
+}
+
+// A worker process started by the parent
+class WorkerProcess
+{
+public:
+	WorkerProcess() : started(false)
+#if defined(_WIN32)
+		, process(nullptr)
+#else
+		, pid(0)
+#endif
+	{
+	}
+
+	~WorkerProcess()
+	{
+		wait();
+	}
+
+	WorkerProcess(const WorkerProcess &) = delete;
+	WorkerProcess &operator=(const WorkerProcess &) = delete;
+
+	// Run this program again as worker aPartition of segment aName
+	bool start(const char *aProgram, const char *aName, unsigned int aPartition)
+	{
+		std::string partition = std::to_string(aPartition);
+#if defined(_WIN32)
+		char path[MAX_PATH];
+		if (!GetModuleFileNameA(nullptr, path, MAX_PATH))
+		{
+			return false;
+		}
+		(void)aProgram;
+		std::string command = std::string("\"") + path + "\" --worker " + aName + " " + partition;
+		STARTUPINFOA si = {};
+		si.cb = sizeof(si);
+		PROCESS_INFORMATION pi = {};
+		if (!CreateProcessA(path, &command[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &si, &pi))
+		{
+			return false;
+		}
+		CloseHandle(pi.hThread);
+		process = pi.hProcess;
+#else
+		const char *self = (access("/proc/self/exe", X_OK) == 0) ? "/proc/self/exe" : aProgram;
+		char *argv[] = { const_cast<char *>(aProgram), const_cast<char *>("--worker"), const_cast<char *>(aName), &partition[0], nullptr };
+		if (posix_spawn(&pid, self, nullptr, nullptr, argv, environ) != 0)
+		{
+			return false;
+		}
+#endif
+		started = true;
+		return true;
+	}
+
+	bool running()
+	{
+		if (!started)
+		{
+			return false;
+		}
+#if defined(_WIN32)
+		return WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+#else
+		int status;
+		if (waitpid(pid, &status, WNOHANG) == pid)
+		{
+			started = false;
+			return false;
+		}
+		return true;
+#endif
+	}
+
+	void wait()
+	{
+		if (!started)
+		{
+			return;
+		}
+#if defined(_WIN32)
+		WaitForSingleObject(process, INFINITE);
+		CloseHandle(process);
+		process = nullptr;
+#else
+		int status;
+		waitpid(pid, &status, 0);
+#endif
+		started = false;
+	}
+
+	static uint64_t self()
+	{
+#if defined(_WIN32)
+		return GetCurrentProcessId();
+#else
+		return static_cast<uint64_t>(getpid());
+#endif
+	}
+
+	// Whether the process that started this one is still there
+	static bool parentAlive(uint64_t aParent)
+	{
+#if defined(_WIN32)
+		HANDLE parent = OpenProcess(SYNCHRONIZE, FALSE, static_cast<DWORD>(aParent));
+		if (!parent)
+		{
+			return false;
+		}
+		bool alive = (WaitForSingleObject(parent, 0) == WAIT_TIMEOUT);
+		CloseHandle(parent);
+		return alive;
+#else
+		return static_cast<uint64_t>(getppid()) == aParent;
+#endif
+	}
+
+	// Pin the calling thread to the processors of NUMA node aNode modulo
+	// the number of nodes; does nothing where the nodes cannot be found
+	static void pinToNode(unsigned int aNode)
+	{
+#if defined(_WIN32)
+		ULONG highest = 0;
+		GROUP_AFFINITY affinity = {};
+		if (GetNumaHighestNodeNumber(&highest) &&
+			GetNumaNodeProcessorMaskEx(static_cast<USHORT>(aNode % (highest + 1)), &affinity) && affinity.Mask)
+		{
+			SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+		}
+#elif defined(__linux__)
+		unsigned int nodes = 0;
+		while (access(("/sys/devices/system/node/node" + std::to_string(nodes)).c_str(), F_OK) == 0)
+		{
+			++nodes;
+		}
+		if (nodes == 0)
+		{
+			return;
+		}
+		FILE *f = fopen(("/sys/devices/system/node/node" + std::to_string(aNode % nodes) + "/cpulist").c_str(), "r");
+		if (!f)
+		{
+			return;
+		}
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		unsigned int low;
+		unsigned int high;
+		int c;
+		while (fscanf(f, "%u", &low) == 1)
+		{
+			high = low;
+			c = fgetc(f);
+			if ((c == '-') && (fscanf(f, "%u", &high) == 1))
+			{
+				c = fgetc(f);
+			}
+			for (unsigned int cpu = low; (cpu <= high) && (cpu < CPU_SETSIZE); ++cpu)
+			{
+				CPU_SET(cpu, &cpus);
+			}
+			if (c != ',')
+			{
+				break;
+			}
+		}
+		fclose(f);
+		if (CPU_COUNT(&cpus) != 0)
+		{
+			sched_setaffinity(0, sizeof(cpus), &cpus);
+		}
+#else
+		(void)aNode;
+#endif
+	}
+
+private:
+	bool started;
+#if defined(_WIN32)
+	HANDLE process;
+#else
+	pid_t pid;
+#endif
+};
+
+// Parent side: the segment, the workers and the epochs
+class ProcessEngine
+{
+public:
+	static const uint64_t PARTITION_TRADERS = 4096;		// Whole pages of every column
+	static const uint64_t RING_SLOTS = 4096;
+
+	ProcessEngine() : control(nullptr), failure(false) {}
+
+	~ProcessEngine()
+	{
+		if (header())
+		{
+			header()->stopping.store(1, std::memory_order_release);
+		}
+		workers.clear();
+		if (!name.empty())
+		{
+			MappedFile::removeShared(name.c_str());
+		}
+	}
+
+	ProcessEngine(const ProcessEngine &) = delete;
+	ProcessEngine &operator=(const ProcessEngine &) = delete;
+
+	// Lay out the segment, start aProcesses workers from aProgram and wait
+	// until each has set up its partition with aSeedMoney per trader.
+	// aHistogram gives the shape of the workers' histograms.
+	bool start(const char *aProgram, unsigned int aProcesses, uint64_t aTraders, unsigned int aWidth, bool aStats, uint64_t aSeedMoney,
+		uint64_t aPar, uint64_t aBins, uint64_t aLargest, RandomKind aRandom, uint64_t aSeed)
+	{
+		SegmentLayout layout = segmentLayout(aTraders, aProcesses, aWidth, aStats, RING_SLOTS, aBins);
+		name = sharedName();
+		segment = std::make_shared<MappedFile>();
+		if (!segment->createShared(name.c_str(), segmentSize(layout)))
+		{
+			name.clear();
+			return false;
+		}
+
+		memcpy(layout.magic, "TRADERSP", sizeof(layout.magic));
+		layout.version = 1;
+		layout.seedMoney = aSeedMoney;
+		layout.par = aPar;
+		layout.largest = aLargest;
+		layout.random = static_cast<uint64_t>(aRandom);
+		layout.seed = aSeed;
+		layout.parent = WorkerProcess::self();
+		new (segment->data()) SegmentHeader();
+		header()->layout = layout;
+
+		// Partitions of whole PARTITION_TRADERS, as even as that allows
+		control = section<PartitionControl>(layout.controlOffset);
+		uint64_t units = (aTraders + PARTITION_TRADERS - 1) / PARTITION_TRADERS;
+		uint64_t first = 0;
+		for (unsigned int p = 0; p < aProcesses; ++p)
+		{
+			PartitionControl *c = new (control + p) PartitionControl();
+			uint64_t last = std::min(aTraders, (units * (p + 1) / aProcesses) * PARTITION_TRADERS);
+			c->first = first;
+			c->count = last - first;
+			c->ready.store(~0ull, std::memory_order_relaxed);
+			first = last;
+		}
+		for (uint64_t r = 0; r < uint64_t(aProcesses) * aProcesses; ++r)
+		{
+			new (ring(r)) SharedRing();
+		}
+
+		workers.resize(aProcesses);
+		for (unsigned int p = 0; p < aProcesses; ++p)
+		{
+			workers[p].reset(new WorkerProcess());
+			if (!workers[p]->start(aProgram, name.c_str(), p))
+			{
+				return false;
+			}
+		}
+		for (unsigned int p = 0; p < aProcesses; ++p)
+		{
+			if (!waitFor([&] { return control[p].ready.load(std::memory_order_acquire) == 0; }, [&] { return workersRunning(); }))
+			{
+				return false;
+			}
+		}
+
+		// Everyone has it mapped, so the name can go
+		MappedFile::removeShared(name.c_str());
+		name.clear();
+		return true;
+	}
+
+	std::shared_ptr<MappedFile> mapping() const { return segment; }
+
+	template <typename T>
+	T *section(uint64_t aOffset) const
+	{
+		return reinterpret_cast<T *>(static_cast<uint8_t *>(segment->data()) + aOffset);
+	}
+
+	SegmentHeader *header() const { return segment ? section<SegmentHeader>(0) : nullptr; }
+
+	unsigned int processes() const { return static_cast<unsigned int>(workers.size()); }
+
+	// A worker has died; nothing more can be run
+	bool failed() const { return failure; }
+
+	// Traders solvent at the end of the last epoch
+	uint64_t solvent() const
+	{
+		uint64_t n = 0;
+		for (unsigned int p = 0; p < processes(); ++p)
+		{
+			n += control[p].solvent;
+		}
+		return n;
+	}
+
+	// Run one epoch of up to aTrades trades and fold the workers' changes
+	// into aWealth. aRescan says balances were changed since the last epoch
+	// (tax), so the workers must rebuild their solvent sets. Returns the
+	// trades executed, fewer only when the partitions run out of partners.
+	uint64_t run(uint64_t aTrades, bool aRescan, WealthHistogram &aWealth)
+	{
+		SegmentHeader *h = header();
+		const uint64_t e = h->epoch.load(std::memory_order_relaxed) + 1;
+		h->trades.store(aTrades, std::memory_order_relaxed);
+		h->rescan.store(aRescan ? 1 : 0, std::memory_order_relaxed);
+		h->epoch.store(e, std::memory_order_release);
+
+		auto alive = [this] { return workersRunning(); };
+		for (unsigned int p = 0; p < processes(); ++p)
+		{
+			if (!waitFor([&] { return control[p].finished.load(std::memory_order_acquire) == e; }, alive))
+			{
+				return 0;
+			}
+		}
+
+		// Nothing is left in flight once everything sent has been received.
+		// Handling a message sends any reply first, and received counts are
+		// read before sent counts, so equal sums cannot miss a message.
+		if (!waitFor([this] { return quiet(); }, alive))
+		{
+			return 0;
+		}
+		h->closed.store(e, std::memory_order_release);
+
+		uint64_t done = 0;
+		WealthHistogram delta = aWealth.blank();
+		for (unsigned int p = 0; p < processes(); ++p)
+		{
+			if (!waitFor([&] { return control[p].reported.load(std::memory_order_acquire) == e; }, alive))
+			{
+				return 0;
+			}
+			done += control[p].done - control[p].lapsed;
+			delta.load(section<int64_t>(h->layout.deltaOffset) + p * h->layout.deltaWords);
+			aWealth.merge(delta);
+		}
+		return done;
+	}
+
+private:
+	static std::string sharedName()
+	{
+#if defined(_WIN32)
+		return "Local\\traders-" + std::to_string(WorkerProcess::self());
+#else
+		return "/traders-" + std::to_string(WorkerProcess::self());
+#endif
+	}
+
+	SharedRing *ring(uint64_t aIndex) const
+	{
+		return reinterpret_cast<SharedRing *>(section<uint8_t>(header()->layout.ringOffset) + aIndex * (sizeof(SharedRing) + RING_SLOTS * sizeof(uint64_t)));
+	}
+
+	bool quiet() const
+	{
+		uint64_t received = 0;
+		for (unsigned int p = 0; p < processes(); ++p)
+		{
+			received += control[p].received.load(std::memory_order_acquire);
+		}
+		uint64_t sent = 0;
+		for (unsigned int p = 0; p < processes(); ++p)
+		{
+			sent += control[p].sent.load(std::memory_order_acquire);
+		}
+		return sent == received;
+	}
+
+	bool workersRunning()
+	{
+		for (auto &w : workers)
+		{
+			if (!w->running())
+			{
+				failure = true;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::shared_ptr<MappedFile> segment;
+	std::string name;						// Until the workers have mapped it
+	PartitionControl *control;
+	std::vector<std::unique_ptr<WorkerProcess>> workers;
+	bool failure;
+};
+
+// Worker side: one partition of the traders
+template <typename Balance>
+class PartitionWorker
+{
+public:
+	static const uint64_t CREDIT = 1ull << 62;
+	static const uint64_t CREDIT_ANY = 2ull << 62;
+	static const uint64_t DEBIT_FOR = 3ull << 62;
+	static const uint64_t KIND = 3ull << 62;
+	static const uint32_t POLL = 256;			// Trades between looks at the rings
+	static const size_t BACKLOG = 1 << 16;		// Held back messages before the worker stops to deliver them
+
+	PartitionWorker(MappedFile &aSegment, unsigned int aPartition)
+		: base(static_cast<uint8_t *>(aSegment.data()))
+		, h(*reinterpret_cast<SegmentHeader *>(base))
+		, layout(h.layout)
+		, me(aPartition)
+		, control(reinterpret_cast<PartitionControl *>(base + layout.controlOffset))
+		, self(control[aPartition])
+		, balance(reinterpret_cast<Balance *>(base + layout.balanceOffset))
+		, wins(layout.stats ? reinterpret_cast<uint64_t *>(base + layout.winsOffset) : nullptr)
+		, losses(layout.stats ? reinterpret_cast<uint64_t *>(base + layout.lossesOffset) : nullptr)
+		, first(self.first)
+		, count(self.count)
+		, active(self.count)
+		, rng(static_cast<RandomKind>(layout.random), layout.seed, aPartition + 1)
+		, delta(layout.par, layout.bins, layout.largest)
+		, sentCount(0)
+		, receivedCount(0)
+		, lapsedCount(0)
+		, outgoing(layout.partitions)
+		, incoming(layout.partitions)
+		, held(layout.partitions)
+		, heldCount(0)
+		, weights(layout.partitions + 1)
+	{
+		const uint64_t stride = sizeof(SharedRing) + layout.ringSlots * sizeof(uint64_t);
+		for (uint64_t q = 0; q < layout.partitions; ++q)
+		{
+			outgoing[q] = RingView(reinterpret_cast<SharedRing *>(base + layout.ringOffset + (me * layout.partitions + q) * stride), layout.ringSlots);
+			incoming[q] = RingView(reinterpret_cast<SharedRing *>(base + layout.ringOffset + (q * layout.partitions + me) * stride), layout.ringSlots);
+		}
+	}
+
+	PartitionWorker(const PartitionWorker &) = delete;
+	PartitionWorker &operator=(const PartitionWorker &) = delete;
+
+	// Serve epochs until the parent stops or disappears
+	int run()
+	{
+		// First touch: these pages belong to this worker's node from now on
+		for (uint64_t t = first; t < first + count; ++t)
+		{
+			balance[t] = static_cast<Balance>(layout.seedMoney);
+			if (wins)
+			{
+				wins[t] = 0;
+				losses[t] = 0;
+			}
+		}
+		rescan();
+		self.ready.store(0, std::memory_order_release);
+
+		auto alive = [this] { return (h.stopping.load(std::memory_order_acquire) == 0) && WorkerProcess::parentAlive(layout.parent); };
+		for (uint64_t e = 1; ; ++e)
+		{
+			if (!waitFor([&] { return (h.epoch.load(std::memory_order_acquire) == e) || (h.stopping.load(std::memory_order_acquire) != 0); }, alive) ||
+				(h.stopping.load(std::memory_order_acquire) != 0))
+			{
+				return 0;
+			}
+			if (h.rescan.load(std::memory_order_relaxed))
+			{
+				rescan();
+			}
+			self.solvent = active.size();
+			self.counted.store(e, std::memory_order_release);
+			for (uint64_t q = 0; q < layout.partitions; ++q)
+			{
+				if (!waitFor([&] { return control[q].counted.load(std::memory_order_acquire) == e; }, alive))
+				{
+					return 0;
+				}
+			}
+
+			delta.clear();
+			lapsedCount = 0;
+			self.done = trade(quota());
+			self.finished.store(e, std::memory_order_release);
+			if (!waitFor([&] { serve(); return h.closed.load(std::memory_order_acquire) == e; }, alive))
+			{
+				return 0;
+			}
+
+			self.solvent = active.size();
+			self.lapsed = lapsedCount;
+			delta.save(reinterpret_cast<int64_t *>(base + layout.deltaOffset) + me * layout.deltaWords);
+			self.reported.store(e, std::memory_order_release);
+		}
+	}
+
+private:
+	void rescan()
+	{
+		active.clear();
+		for (uint64_t t = 0; t < count; ++t)
+		{
+			if (balance[first + t] != 0)
+			{
+				active.insert(t);
+			}
+		}
+	}
+
+	// This worker's share of the epoch's trades, by solvent traders; every
+	// worker works out the same split. Also sets up the partner weights.
+	uint64_t quota()
+	{
+		uint64_t total = 0;
+		uint64_t before = 0;
+		weights[0] = 0;
+		for (uint64_t q = 0; q < layout.partitions; ++q)
+		{
+			uint64_t s = control[q].solvent;
+			if (q == me)
+			{
+				before = total;
+			}
+			total += s;
+			weights[q + 1] = weights[q] + s - (q == me ? std::min<uint64_t>(s, 1) : 0);
+		}
+		if (total == 0)
+		{
+			return 0;
+		}
+		const uint64_t trades = h.trades.load(std::memory_order_relaxed);
+		auto share = [&](uint64_t aSolvent) { return static_cast<uint64_t>((static_cast<double>(trades) * static_cast<double>(aSolvent)) / static_cast<double>(total)); };
+		return share(before + self.solvent) - share(before);
+	}
+
+	// Up to aQuota trades; a draw of a partner in this partition when it has
+	// nobody else solvent is drawn again, unless nobody else has any weight
+	uint64_t trade(uint64_t aQuota)
+	{
+		const uint64_t partners = weights[layout.partitions];
+		const uint64_t own = weights[me + 1] - weights[me];
+		uint64_t done = 0;
+		for (uint64_t draws = 0; (done < aQuota) && (active.size() != 0) && (partners != 0); ++draws)
+		{
+			if ((draws % POLL) == 0)
+			{
+				serve();
+				while (heldCount > BACKLOG)
+				{
+					std::this_thread::yield();
+					serve();
+				}
+			}
+
+			uint32_t i = rng.below(static_cast<uint32_t>(active.size()));
+			uint64_t a = first + active[i];
+			uint64_t x = rng.below(static_cast<uint32_t>(partners));
+			uint64_t q = std::upper_bound(weights.begin(), weights.end(), x) - weights.begin() - 1;
+			bool aWins = rng.bit();
+
+			if (q == me)
+			{
+				if (active.size() < 2)
+				{
+					if (own == partners)
+					{
+						break;
+					}
+					continue;
+				}
+				uint32_t j = rng.below(static_cast<uint32_t>(active.size() - 1));
+				uint64_t b = first + active[j + (j >= i)];
+				debit(aWins ? b : a);
+				credit(aWins ? a : b);
+			}
+			else if (aWins)
+			{
+				send(q, DEBIT_FOR | a);
+			}
+			else
+			{
+				debit(a);
+				send(q, CREDIT_ANY);
+			}
+			++done;
+		}
+		return done;
+	}
+
+	// Take one unit from a solvent trader
+	void debit(uint64_t aTrader)
+	{
+		uint64_t v = balance[aTrader];
+		balance[aTrader] = static_cast<Balance>(v - 1);
+		delta.move(v, v - 1);
+		if (losses)
+		{
+			losses[aTrader]++;
+		}
+		if (v == 1)
+		{
+			active.remove(aTrader - first);
+		}
+	}
+
+	// Give one unit to a trader, or if it is at the ceiling to the next one
+	// that is not
+	void credit(uint64_t aTrader)
+	{
+		while (balance[aTrader] == TraderStore<Balance>::CEILING)
+		{
+			aTrader = (aTrader + 1 < first + count) ? aTrader + 1 : first;
+		}
+		uint64_t v = balance[aTrader];
+		balance[aTrader] = static_cast<Balance>(v + 1);
+		delta.move(v, v + 1);
+		if (wins)
+		{
+			wins[aTrader]++;
+		}
+		if (v == 0)
+		{
+			active.insert(aTrader - first);
+		}
+	}
+
+	// Any trader of this partition: a solvent one if there is one
+	uint64_t anyone()
+	{
+		return active.size() ? first + active[rng.below(static_cast<uint32_t>(active.size()))] : first + rng.below(static_cast<uint32_t>(count));
+	}
+
+	void send(uint64_t aTo, uint64_t aMessage)
+	{
+		self.sent.store(++sentCount, std::memory_order_release);
+		if (held[aTo].empty() && outgoing[aTo].push(aMessage))
+		{
+			return;
+		}
+		held[aTo].push_back(aMessage);
+		++heldCount;
+	}
+
+	// Deliver held back messages and handle everything waiting
+	void serve()
+	{
+		for (uint64_t q = 0; (q < layout.partitions) && heldCount; ++q)
+		{
+			size_t k = 0;
+			while ((k < held[q].size()) && outgoing[q].push(held[q][k]))
+			{
+				++k;
+			}
+			held[q].erase(held[q].begin(), held[q].begin() + k);
+			heldCount -= k;
+		}
+
+		uint64_t m;
+		for (uint64_t q = 0; q < layout.partitions; ++q)
+		{
+			while (incoming[q].pop(m))
+			{
+				switch (m & KIND)
+				{
+				case CREDIT:
+					credit(m & ~KIND);
+					break;
+				case CREDIT_ANY:
+					credit(anyone());
+					break;
+				default:
+					if (active.size())
+					{
+						debit(anyone());
+						send(q, CREDIT | (m & ~KIND));
+					}
+					else
+					{
+						++lapsedCount;
+					}
+					break;
+				}
+				self.received.store(++receivedCount, std::memory_order_release);
+			}
+		}
+	}
+
+	uint8_t *base;
+	SegmentHeader &h;
+	const SegmentLayout &layout;
+	uint64_t me;
+	PartitionControl *control;
+	PartitionControl &self;
+	Balance *balance;
+	uint64_t *wins;
+	uint64_t *losses;
+	uint64_t first;
+	uint64_t count;
+	ActiveSet active;						// Partition-local numbers
+	RandomStream rng;
+	WealthHistogram delta;
+	uint64_t sentCount;
+	uint64_t receivedCount;
+	uint64_t lapsedCount;					// This epoch
+	std::vector<RingView> outgoing;			// To each partition
+	std::vector<RingView> incoming;
+	std::vector<std::vector<uint64_t>> held;	// Messages a full ring had no room for
+	size_t heldCount;
+	std::vector<uint64_t> weights;			// Cumulative partner weights by partition
+};
+
+// Entry point of a worker process: serve partition aPartition of segment aName
+inline int processWorker(const char *aName, unsigned int aPartition)
+{
+	MappedFile segment;
+	if (!segment.openShared(aName))
+	{
+		fprintf(stderr, "Worker %u cannot map %s\n", aPartition, aName);
+		return 1;
+	}
+	const SegmentLayout &h = static_cast<const SegmentHeader *>(segment.data())->layout;
+	if ((memcmp(h.magic, "TRADERSP", sizeof(h.magic)) != 0) || (aPartition >= h.partitions))
+	{
+		return 1;
+	}
+	WorkerProcess::pinToNode(aPartition);
+	if (h.width == 32)
+	{
+		return PartitionWorker<uint32_t>(segment, aPartition).run();
+	}
+	return PartitionWorker<uint64_t>(segment, aPartition).run();
+}
+
+#endif	/* _PROCESS_ENGINE_H */
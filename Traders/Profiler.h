@@ -0,0 +1,375 @@
+// Profiler.h : Where the time of a run goes.
+//
+// The kernels and the main loops charge their time to phases:
+//   draw        raw random words and coin bits (the scalar and graph kernels
+//               draw and select in one step, charged here)
+//   select      mapping words onto traders, with Lemire's rejected draws
+//   resolve     pairs to winners and losers, and the bounds checks
+//   settle      moving the money
+//   leap, tax, exchange (reshuffling traders between shards), report
+//   (display and metrics) and checkpoint
+// and count how many draws each selection of a trader needed. At the end of a
+// run --profile prints the time per trade in each phase and the histogram of
+// rejected draws per selection.
+//
+// Time is read from the time stamp counter where there is one and from
+// steady_clock elsewhere, once per phase of a batch, so the cost is a few
+// cycles per batch of trades, and the cost of a read is taken off each
+// phase. The scalar kernel times one trade in PROFILE_SAMPLE and splits its
+// whole time between the phases in those proportions. Each thread keeps
+// counters of its own; in a parallel run the phases add up over the threads.
+//
+// Build with TRADERS_PROFILE defined as 0 to take every trace of it out.
+
+#ifndef _PROFILER_H
+#define _PROFILER_H
+
+#ifndef TRADERS_PROFILE
+#define TRADERS_PROFILE 1
+#endif
+
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+
+#if TRADERS_PROFILE && defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define PROFILE_TSC 1
+#elif TRADERS_PROFILE && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define PROFILE_TSC 1
+#endif
+
+enum class Phase
+{
+	DRAW,
+	SELECT,
+	RESOLVE,
+	SETTLE,
+	LEAP,
+	TAX,
+	EXCHANGE,
+	REPORT,
+	CHECKPOINT,
+	COUNT
+};
+
+inline const char *phaseName(Phase aPhase)
+{
+	static const char *const NAMES[] = { "draw", "select", "resolve", "settle", "leap", "tax", "exchange", "report", "checkpoint" };
+	return NAMES[static_cast<int>(aPhase)];
+}
+
+const uint64_t PROFILE_SAMPLE = 64;			// Scalar trades per timed trade
+const unsigned int RETRY_BINS = 8;			// Rejected draws per selection, the last bin for as many or more
+
+struct ProfileCounters
+{
+	uint64_t ticks[static_cast<int>(Phase::COUNT)];
+	uint64_t selections;
+	uint64_t retries[RETRY_BINS];			// Selections by rejected draws; 0 is what is left
+};
+
+#if TRADERS_PROFILE
+
+inline uint64_t profileTicks()
+{
+#if defined(PROFILE_TSC)
+	return __rdtsc();
+#else
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+// The counters of every thread that has run a phase
+class Profiler
+{
+public:
+	// This thread's counters. A thread hands its slot back when it exits,
+	// counts and all, and the next new thread carries on adding to it, so
+	// the slots only grow to the most threads alive at once however many
+	// engines and pools come and go.
+	static ProfileCounters &counters()
+	{
+		thread_local Owner mine;
+		if (!mine.slot)
+		{
+			State &s = state();
+			std::lock_guard<std::mutex> lock(s.mutex);
+			for (Slot &free : s.threads)
+			{
+				if (!free.taken)
+				{
+					mine.slot = &free;
+					break;
+				}
+			}
+			if (!mine.slot)
+			{
+				s.threads.push_back(Slot());
+				mine.slot = &s.threads.back();
+			}
+			mine.slot->taken = true;
+		}
+		return mine.slot->counters;
+	}
+
+	// Clear the counters and start the clock; every other thread must be idle
+	static void start()
+	{
+		State &s = state();
+		std::lock_guard<std::mutex> lock(s.mutex);
+		for (Slot &t : s.threads)
+		{
+			t.counters = ProfileCounters();
+		}
+		// The cheapest of a run of back to back reads is what one read costs
+		uint64_t cheapest = ~0ull;
+		for (int k = 0; k < 64; ++k)
+		{
+			uint64_t t = profileTicks();
+			cheapest = std::min(cheapest, profileTicks() - t);
+		}
+		s.readCost = cheapest;
+		s.ticks = profileTicks();
+		s.t0 = std::chrono::steady_clock::now();
+	}
+
+	// Ticks taken by reading the clock once
+	static uint64_t readCost()
+	{
+		return state().readCost;
+	}
+
+	// Print what the run of aTrades trades spent its time on; every other
+	// thread must be idle
+	static void report(uint64_t aTrades, unsigned int aThreads)
+	{
+		State &s = state();
+		std::lock_guard<std::mutex> lock(s.mutex);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - s.t0;
+		double nsPerTick = 1.0e9 * elapsed.count() / static_cast<double>(std::max<uint64_t>(profileTicks() - s.ticks, 1));
+
+		ProfileCounters total = ProfileCounters();
+		for (const Slot &t : s.threads)
+		{
+			const ProfileCounters &c = t.counters;
+			for (int p = 0; p < static_cast<int>(Phase::COUNT); ++p)
+			{
+				total.ticks[p] += c.ticks[p];
+			}
+			total.selections += c.selections;
+			for (unsigned int r = 0; r < RETRY_BINS; ++r)
+			{
+				total.retries[r] += c.retries[r];
+			}
+		}
+		const double trades = static_cast<double>(std::max<uint64_t>(aTrades, 1));
+		const double wall = 1.0e9 * elapsed.count() * aThreads;
+
+		printf("Profile: %llu trades in %.3f s (%.1f million trades/s), ns per trade%s:\n", aTrades, elapsed.count(),
+			static_cast<double>(aTrades) / elapsed.count() / 1.0e6, (aThreads > 1) ? " summed over the threads" : "");
+		double timed = 0.0;
+		for (int p = 0; p < static_cast<int>(Phase::COUNT); ++p)
+		{
+			double ns = static_cast<double>(total.ticks[p]) * nsPerTick;
+			timed += ns;
+			if (total.ticks[p] != 0)
+			{
+				printf("  %-10s %9.3f  %5.1f %%\n", phaseName(static_cast<Phase>(p)), ns / trades, 100.0 * ns / wall);
+			}
+		}
+		printf("  %-10s %9.3f  %5.1f %%\n", "other", std::max(wall - timed, 0.0) / trades, 100.0 * std::max(wall - timed, 0.0) / wall);
+
+		uint64_t retried = 0;
+		for (unsigned int r = 1; r < RETRY_BINS; ++r)
+		{
+			retried += total.retries[r];
+		}
+		total.retries[0] = total.selections - std::min(retried, total.selections);
+		printf("Selections: %llu, by rejected draws:", total.selections);
+		for (unsigned int r = 0; r < RETRY_BINS; ++r)
+		{
+			printf(" %u%s = %llu", r, (r + 1 == RETRY_BINS) ? "+" : "", total.retries[r]);
+		}
+		printf("\n");
+	}
+
+private:
+	struct Slot
+	{
+		ProfileCounters counters = ProfileCounters();
+		bool taken = false;
+	};
+
+	struct State
+	{
+		std::mutex mutex;
+		std::deque<Slot> threads;		// A deque, so the counters never move
+		uint64_t ticks = 0;
+		uint64_t readCost = 0;
+		std::chrono::steady_clock::time_point t0;
+	};
+
+	static State &state()
+	{
+		static State s;
+		return s;
+	}
+
+	// Frees this thread's slot when it exits
+	struct Owner
+	{
+		Slot *slot = nullptr;
+		~Owner()
+		{
+			if (slot)
+			{
+				std::lock_guard<std::mutex> lock(state().mutex);
+				slot->taken = false;
+			}
+		}
+	};
+};
+
+// Charges the time between laps to phases
+class ProfileLap
+{
+public:
+	ProfileLap()
+		: counters(Profiler::counters())
+		, readCost(Profiler::readCost())
+		, last(profileTicks())
+	{
+	}
+
+	// Charge the time since the last lap to aPhase
+	void operator()(Phase aPhase)
+	{
+		uint64_t now = profileTicks();
+		uint64_t spent = now - last;
+		counters.ticks[static_cast<int>(aPhase)] += spent - std::min(spent, readCost);
+		last = now;
+	}
+
+	void selections(uint64_t aCount)
+	{
+		counters.selections += aCount;
+	}
+
+private:
+	ProfileCounters &counters;
+	uint64_t readCost;
+	uint64_t last;
+};
+
+// Times the phases of one round in PROFILE_SAMPLE and, at the end, shares the
+// time of the whole loop out between them in proportion. A round timed on its
+// own takes longer than it does among others, whose memory accesses overlap
+// with its own, so its times are only good as proportions.
+class ProfileSampler
+{
+public:
+	ProfileSampler()
+		: counters(Profiler::counters())
+		, readCost(Profiler::readCost())
+		, timing(false)
+		, first(profileTicks())
+		, last(0)
+		, sampled()
+	{
+	}
+
+	~ProfileSampler()
+	{
+		uint64_t whole = profileTicks() - first;
+		uint64_t timed = 0;
+		for (uint64_t t : sampled)
+		{
+			timed += t;
+		}
+		for (int p = 0; timed && (p < static_cast<int>(Phase::COUNT)); ++p)
+		{
+			counters.ticks[p] += static_cast<uint64_t>(static_cast<double>(whole) * static_cast<double>(sampled[p]) / static_cast<double>(timed));
+		}
+	}
+
+	ProfileSampler(const ProfileSampler &) = delete;
+	ProfileSampler &operator=(const ProfileSampler &) = delete;
+
+	// Round aRound is about to start
+	void round(uint64_t aRound)
+	{
+		timing = ((aRound % PROFILE_SAMPLE) == 0);
+		if (timing)
+		{
+			last = profileTicks();
+		}
+	}
+
+	void operator()(Phase aPhase)
+	{
+		if (timing)
+		{
+			uint64_t now = profileTicks();
+			uint64_t spent = now - last;
+			sampled[static_cast<int>(aPhase)] += spent - std::min(spent, readCost);
+			last = now;
+		}
+	}
+
+	void selections(uint64_t aCount)
+	{
+		counters.selections += aCount;
+	}
+
+private:
+	ProfileCounters &counters;
+	uint64_t readCost;
+	bool timing;
+	uint64_t first;
+	uint64_t last;
+	uint64_t sampled[static_cast<int>(Phase::COUNT)];
+};
+
+// A selection took aRejected rejected draws before an accepted one
+inline void profileRetries(uint32_t aRejected)
+{
+	if (aRejected != 0)
+	{
+		Profiler::counters().retries[std::min(aRejected, RETRY_BINS - 1)]++;
+	}
+}
+
+#else
+
+class Profiler
+{
+public:
+	static void start() {}
+	static void report(uint64_t, unsigned int) {}
+};
+
+class ProfileLap
+{
+public:
+	void operator()(Phase) {}
+	void selections(uint64_t) {}
+};
+
+class ProfileSampler
+{
+public:
+	void round(uint64_t) {}
+	void operator()(Phase) {}
+	void selections(uint64_t) {}
+};
+
+inline void profileRetries(uint32_t) {}
+
+#endif	/* TRADERS_PROFILE */
+
+#endif	/* _PROFILER_H */
@@ -0,0 +1,393 @@
+// RandomStream.h : Random number streams for Traders.
+//
+// Binding distributions onto copies of one std::default_random_engine quietly
+// duplicates the engine state and gives no way to hand each thread its own
+// reproducible sequence. Instead every consumer owns a RandomStream, built
+// from a seed and a stream number:
+//
+//   xoshiro  xoshiro256** (Blackman & Vigna); stream n is the seeded state
+//            advanced by n jumps of 2^128, so streams never overlap
+//   philox   Philox4x32-10 (Salmon et al., Random123); counter based, the
+//            stream number is half of the counter so streams are disjoint
+//            by construction and any block can be computed directly
+//   std      std::default_random_engine, for comparison with the original
+//            program; its sequence differs between standard libraries
+//
+// xoshiro and philox are fully specified, so a given seed and stream number
+// yields the same bits on every platform.
+//
+// A stream pulls 32-bit words from its engine a block at a time through one
+// virtual call, so the engine can be chosen at run time without slowing the
+// per-draw path. Bounded integers use Lemire's nearly divisionless method and
+// are exactly uniform.
+
+#ifndef _RANDOM_STREAM_H
+#define _RANDOM_STREAM_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <random>
+#include <memory>
+#include <string>
+
+#include "Profiler.h"
+
+// Used to expand a 64-bit seed into engine state
+inline uint64_t splitMix64(uint64_t &aState)
+{
+	uint64_t z = (aState += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// Source of raw 32-bit words
+class RandomEngine
+{
+public:
+	virtual ~RandomEngine() {}
+
+	// Fill aWords words; aWords is always a multiple of 4
+	virtual void fill(uint32_t *aOut, size_t aWords) = 0;
+
+	// Engine state as plain bytes, for checkpoints
+	virtual size_t stateSize() const = 0;
+	virtual void saveState(void *aOut) const = 0;
+	virtual void loadState(const void *aIn) = 0;
+};
+
+class Xoshiro256Engine : public RandomEngine
+{
+public:
+	Xoshiro256Engine(uint64_t aSeed, uint64_t aStream)
+	{
+		uint64_t x = aSeed;
+		for (auto &word : s)
+		{
+			word = splitMix64(x);
+		}
+		for (uint64_t i = 0; i < aStream; ++i)
+		{
+			jump();
+		}
+	}
+
+	uint64_t next()
+	{
+		uint64_t result = rotl(s[1] * 5, 7) * 9;
+		uint64_t t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+		return result;
+	}
+
+	void fill(uint32_t *aOut, size_t aWords) override
+	{
+		for (size_t i = 0; i < aWords; i += 2)
+		{
+			uint64_t r = next();
+			aOut[i] = static_cast<uint32_t>(r);
+			aOut[i + 1] = static_cast<uint32_t>(r >> 32);
+		}
+	}
+
+	size_t stateSize() const override { return sizeof(s); }
+	void saveState(void *aOut) const override { memcpy(aOut, s, sizeof(s)); }
+	void loadState(const void *aIn) override { memcpy(s, aIn, sizeof(s)); }
+
+private:
+	static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+	// Equivalent to 2^128 calls to next()
+	void jump()
+	{
+		static const uint64_t JUMP[] = { 0x180EC6D33CFD0ABAull, 0xD5A61266F0C9392Cull, 0xA9582618E03FC9AAull, 0x39ABDC4529B1661Cull };
+		uint64_t t[4] = {};
+		for (uint64_t j : JUMP)
+		{
+			for (int b = 0; b < 64; ++b)
+			{
+				if (j & (1ull << b))
+				{
+					for (int k = 0; k < 4; ++k)
+					{
+						t[k] ^= s[k];
+					}
+				}
+				next();
+			}
+		}
+		memcpy(s, t, sizeof(s));
+	}
+
+	uint64_t s[4];
+};
+
+class PhiloxEngine : public RandomEngine
+{
+public:
+	PhiloxEngine(uint64_t aSeed, uint64_t aStream)
+		: block(0)
+		, stream(aStream)
+	{
+		key[0] = static_cast<uint32_t>(aSeed);
+		key[1] = static_cast<uint32_t>(aSeed >> 32);
+	}
+
+	// The four words of counter block aBlock of this stream
+	void generate(uint64_t aBlock, uint32_t aOut[4]) const
+	{
+		uint32_t c[4] = { static_cast<uint32_t>(aBlock), static_cast<uint32_t>(aBlock >> 32), static_cast<uint32_t>(stream), static_cast<uint32_t>(stream >> 32) };
+		uint32_t k[2] = { key[0], key[1] };
+		for (int round = 0; round < 10; ++round)
+		{
+			uint64_t p0 = static_cast<uint64_t>(M0) * c[0];
+			uint64_t p1 = static_cast<uint64_t>(M1) * c[2];
+			uint32_t n0 = static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k[0];
+			uint32_t n2 = static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k[1];
+			c[0] = n0;
+			c[1] = static_cast<uint32_t>(p1);
+			c[2] = n2;
+			c[3] = static_cast<uint32_t>(p0);
+			k[0] += W0;
+			k[1] += W1;
+		}
+		memcpy(aOut, c, sizeof(c));
+	}
+
+	void fill(uint32_t *aOut, size_t aWords) override
+	{
+		for (size_t i = 0; i < aWords; i += 4)
+		{
+			generate(block++, aOut + i);
+		}
+	}
+
+	size_t stateSize() const override { return sizeof(block); }
+	void saveState(void *aOut) const override { memcpy(aOut, &block, sizeof(block)); }
+	void loadState(const void *aIn) override { memcpy(&block, aIn, sizeof(block)); }
+
+private:
+	static const uint32_t M0 = 0xD2511F53;
+	static const uint32_t M1 = 0xCD9E8D57;
+	static const uint32_t W0 = 0x9E3779B9;
+	static const uint32_t W1 = 0xBB67AE85;
+
+	uint32_t key[2];
+	uint64_t block;
+	uint64_t stream;
+};
+
+class StdEngine : public RandomEngine
+{
+public:
+	StdEngine(uint64_t aSeed, uint64_t aStream)
+	{
+		std::seed_seq seq{ aSeed, aStream };
+		engine.seed(seq);
+	}
+
+	void fill(uint32_t *aOut, size_t aWords) override
+	{
+		for (size_t i = 0; i < aWords; ++i)
+		{
+			aOut[i] = engine();
+		}
+	}
+
+	// Not checkpointable: the standard engines only serialise as text
+	size_t stateSize() const override { return 0; }
+	void saveState(void *) const override {}
+	void loadState(const void *) override {}
+
+private:
+	std::independent_bits_engine<std::default_random_engine, 32, uint32_t> engine;
+};
+
+enum class RandomKind
+{
+	XOSHIRO,
+	PHILOX,
+	STD
+};
+
+inline bool parseRandomKind(const char *aName, RandomKind &aKind)
+{
+	if (strcmp(aName, "xoshiro") == 0)
+	{
+		aKind = RandomKind::XOSHIRO;
+	}
+	else if (strcmp(aName, "philox") == 0)
+	{
+		aKind = RandomKind::PHILOX;
+	}
+	else if (strcmp(aName, "std") == 0)
+	{
+		aKind = RandomKind::STD;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+inline const char *randomKindName(RandomKind aKind)
+{
+	switch (aKind)
+	{
+	case RandomKind::PHILOX:
+		return "philox";
+	case RandomKind::STD:
+		return "std";
+	default:
+		return "xoshiro";
+	}
+}
+
+class RandomStream
+{
+public:
+	typedef uint32_t result_type;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return 0xFFFFFFFFu; }
+
+	RandomStream(RandomKind aKind, uint64_t aSeed, uint64_t aStream)
+		: used(BUFFER_WORDS)
+		, bits(0)
+		, bitsLeft(0)
+	{
+		switch (aKind)
+		{
+		case RandomKind::PHILOX:
+			engine.reset(new PhiloxEngine(aSeed, aStream));
+			break;
+		case RandomKind::STD:
+			engine.reset(new StdEngine(aSeed, aStream));
+			break;
+		default:
+			engine.reset(new Xoshiro256Engine(aSeed, aStream));
+			break;
+		}
+	}
+
+	RandomStream(RandomStream &&) = default;
+	RandomStream &operator=(RandomStream &&) = default;
+
+	// Next raw word; also makes the stream a UniformRandomBitGenerator
+	uint32_t operator()()
+	{
+		if (used == BUFFER_WORDS)
+		{
+			engine->fill(buffer, BUFFER_WORDS);
+			used = 0;
+		}
+		return buffer[used++];
+	}
+
+	// Uniform in [0, aBound); aBound must be non-zero. aRejected is the number
+	// of draws already rejected for this selection, for the profile.
+	uint32_t below(uint32_t aBound, uint32_t aRejected = 0)
+	{
+		uint64_t m = static_cast<uint64_t>((*this)()) * aBound;
+		uint32_t low = static_cast<uint32_t>(m);
+		if (low < aBound)
+		{
+			uint32_t threshold = (0u - aBound) % aBound;
+			while (low < threshold)
+			{
+				m = static_cast<uint64_t>((*this)()) * aBound;
+				low = static_cast<uint32_t>(m);
+				++aRejected;
+			}
+		}
+		profileRetries(aRejected);
+		return static_cast<uint32_t>(m >> 32);
+	}
+
+	// One fair bit
+	bool bit()
+	{
+		if (bitsLeft == 0)
+		{
+			bits = (*this)();
+			bitsLeft = 32;
+		}
+		bool b = (bits & 1) != 0;
+		bits >>= 1;
+		--bitsLeft;
+		return b;
+	}
+
+	// Uniform double in [0, 1) with 53 random bits
+	double uniform()
+	{
+		uint64_t hi = (*this)() >> 6;
+		uint64_t lo = (*this)() >> 5;
+		return static_cast<double>((hi << 27) | lo) * (1.0 / 9007199254740992.0);
+	}
+
+	// Bulk forms for batched kernels
+	void fillBounded(uint32_t *aOut, size_t aCount, uint32_t aBound)
+	{
+		for (size_t i = 0; i < aCount; ++i)
+		{
+			aOut[i] = below(aBound);
+		}
+	}
+
+	void fillBits(uint64_t *aOut, size_t aWords)
+	{
+		for (size_t i = 0; i < aWords; ++i)
+		{
+			uint64_t lo = (*this)();
+			aOut[i] = lo | (static_cast<uint64_t>((*this)()) << 32);
+		}
+	}
+
+	RandomEngine &source() { return *engine; }
+
+	// Checkpoints: the engine state plus the unread part of the buffer, in a
+	// fixed STATE_BYTES slot. The std engine cannot be saved.
+	static const size_t BUFFER_WORDS = 256;
+	static const size_t ENGINE_BYTES = 32;
+	static const size_t STATE_BYTES = 16 + BUFFER_WORDS * sizeof(uint32_t) + ENGINE_BYTES;
+
+	bool checkpointable() const { return engine->stateSize() != 0; }
+
+	void saveState(void *aOut) const
+	{
+		uint8_t *out = static_cast<uint8_t *>(aOut);
+		uint32_t header[4] = { static_cast<uint32_t>(used), bits, static_cast<uint32_t>(bitsLeft), 0 };
+		memcpy(out, header, sizeof(header));
+		memcpy(out + sizeof(header), buffer, sizeof(buffer));
+		engine->saveState(out + sizeof(header) + sizeof(buffer));
+	}
+
+	void loadState(const void *aIn)
+	{
+		const uint8_t *in = static_cast<const uint8_t *>(aIn);
+		uint32_t header[4];
+		memcpy(header, in, sizeof(header));
+		used = header[0];
+		bits = header[1];
+		bitsLeft = static_cast<int>(header[2]);
+		memcpy(buffer, in + sizeof(header), sizeof(buffer));
+		engine->loadState(in + sizeof(header) + sizeof(buffer));
+	}
+
+private:
+
+	std::unique_ptr<RandomEngine> engine;
+	uint32_t buffer[BUFFER_WORDS];
+	size_t used;
+	uint32_t bits;
+	int bitsLeft;
+};
+
+#endif	/* _RANDOM_STREAM_H */
@@ -0,0 +1,211 @@
+// Renderer.h : Display thread for Traders, fed through a lock-free double buffer.
+//
+// The simulation publishes a Snapshot whenever it likes; publishing only
+// stores a few dozen words and never waits on the display. A Renderer thread
+// wakes at a fixed frame rate, takes the latest complete snapshot and draws
+// it, so terminal I/O runs at its own pace instead of stalling trades.
+//
+// SnapshotBuffer is a two slot sequence lock: the writer alternates slots and
+// bumps a slot's sequence number before and after filling it, and the reader
+// retries if the sequence changed underneath it (only possible if the writer
+// published twice during one read). Every word is a relaxed atomic so torn
+// reads are detected rather than undefined.
+
+#ifndef _RENDERER_H
+#define _RENDERER_H
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+
+// What the display needs to know about the simulation
+struct Snapshot
+{
+	uint64_t trades;
+	uint64_t winners;
+	uint64_t losers;
+	uint64_t disenfranchised;
+	uint64_t median;
+	double gini;
+	double top1;				// Share of the money held by the richest 1 %
+	double top10;
+	std::vector<uint64_t> hist;
+};
+
+class SnapshotBuffer
+{
+public:
+	explicit SnapshotBuffer(uint64_t aBins)
+		: bins(aBins)
+		, published(0)
+	{
+		for (auto &slot : slots)
+		{
+			slot.sequence.store(0);
+			slot.words = std::vector<std::atomic<uint64_t>>(HEADER_WORDS + aBins);
+		}
+	}
+
+	// Writer side; only ever called from one thread
+	void publish(const Snapshot &aSnapshot)
+	{
+		uint64_t next = published.load(std::memory_order_relaxed) + 1;
+		Slot &slot = slots[next % 2];
+
+		uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+		slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		slot.words[0].store(aSnapshot.trades, std::memory_order_relaxed);
+		slot.words[1].store(aSnapshot.winners, std::memory_order_relaxed);
+		slot.words[2].store(aSnapshot.losers, std::memory_order_relaxed);
+		slot.words[3].store(aSnapshot.disenfranchised, std::memory_order_relaxed);
+		slot.words[4].store(aSnapshot.median, std::memory_order_relaxed);
+		slot.words[5].store(bitsOf(aSnapshot.gini), std::memory_order_relaxed);
+		slot.words[6].store(bitsOf(aSnapshot.top1), std::memory_order_relaxed);
+		slot.words[7].store(bitsOf(aSnapshot.top10), std::memory_order_relaxed);
+		for (uint64_t i = 0; i < bins; ++i)
+		{
+			slot.words[HEADER_WORDS + i].store(aSnapshot.hist[i], std::memory_order_relaxed);
+		}
+
+		slot.sequence.store(sequence + 2, std::memory_order_release);
+		published.store(next, std::memory_order_release);
+	}
+
+	// Reader side; copies the latest snapshot and returns its publish count
+	// (0 if nothing has been published yet)
+	uint64_t read(Snapshot &aSnapshot) const
+	{
+		aSnapshot.hist.resize(bins);
+		for (;;)
+		{
+			uint64_t latest = published.load(std::memory_order_acquire);
+			if (latest == 0)
+			{
+				return 0;
+			}
+			const Slot &slot = slots[latest % 2];
+
+			uint64_t before = slot.sequence.load(std::memory_order_acquire);
+			if (before & 1)
+			{
+				continue;
+			}
+
+			aSnapshot.trades = slot.words[0].load(std::memory_order_relaxed);
+			aSnapshot.winners = slot.words[1].load(std::memory_order_relaxed);
+			aSnapshot.losers = slot.words[2].load(std::memory_order_relaxed);
+			aSnapshot.disenfranchised = slot.words[3].load(std::memory_order_relaxed);
+			aSnapshot.median = slot.words[4].load(std::memory_order_relaxed);
+			aSnapshot.gini = fromBits(slot.words[5].load(std::memory_order_relaxed));
+			aSnapshot.top1 = fromBits(slot.words[6].load(std::memory_order_relaxed));
+			aSnapshot.top10 = fromBits(slot.words[7].load(std::memory_order_relaxed));
+			for (uint64_t i = 0; i < bins; ++i)
+			{
+				aSnapshot.hist[i] = slot.words[HEADER_WORDS + i].load(std::memory_order_relaxed);
+			}
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.sequence.load(std::memory_order_relaxed) == before)
+			{
+				return latest;
+			}
+		}
+	}
+
+private:
+	static const uint64_t HEADER_WORDS = 8;
+
+	static uint64_t bitsOf(double aValue)
+	{
+		uint64_t bits;
+		memcpy(&bits, &aValue, sizeof(bits));
+		return bits;
+	}
+
+	static double fromBits(uint64_t aBits)
+	{
+		double value;
+		memcpy(&value, &aBits, sizeof(value));
+		return value;
+	}
+
+	struct alignas(64) Slot
+	{
+		std::atomic<uint64_t> sequence;
+		std::vector<std::atomic<uint64_t>> words;
+	};
+
+	uint64_t bins;
+	Slot slots[2];
+	alignas(64) std::atomic<uint64_t> published;
+};
+
+class Renderer
+{
+public:
+	typedef void (*DrawFunction)(const Snapshot &);
+
+	Renderer(const SnapshotBuffer &aSource, unsigned int aFramesPerSecond, DrawFunction aDraw)
+		: source(aSource)
+		, period(std::chrono::microseconds(1000000 / std::max(1u, aFramesPerSecond)))
+		, draw(aDraw)
+		, stopping(false)
+		, thread(&Renderer::run, this)
+	{
+	}
+
+	// Draws the final state before returning
+	~Renderer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_one();
+		thread.join();
+	}
+
+	Renderer(const Renderer &) = delete;
+	Renderer &operator=(const Renderer &) = delete;
+
+private:
+	void run()
+	{
+		Snapshot frame;
+		uint64_t shown = 0;
+		bool last = false;
+		while (!last)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				last = wake.wait_for(lock, period, [this] { return stopping; });
+			}
+
+			uint64_t latest = source.read(frame);
+			if (latest != shown)
+			{
+				draw(frame);
+				shown = latest;
+			}
+		}
+	}
+
+	const SnapshotBuffer &source;
+	std::chrono::microseconds period;
+	DrawFunction draw;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping;
+	std::thread thread;				// Last so everything above is ready when it starts
+};
+
+#endif	/* _RENDERER_H */
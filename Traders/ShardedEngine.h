@@ -0,0 +1,278 @@
+// ShardedEngine.h : Multithreaded trade engine for Traders.
+//
+// The population is cut into blocks of BLOCK_TRADERS neighbouring traders and
+// every epoch the blocks are dealt out to one shard per thread. Within an epoch
+// a thread only trades between traders in its own shard, so no two threads ever
+// touch the same balance (or the same cache line of balances) and each trade is
+// still exactly one unit moving between two solvent traders drawn from the
+// shard's own active set. Money is conserved per trader without any atomics.
+//
+// Between epochs the blocks are reshuffled across the shards, which is the
+// cross-shard exchange that lets wealth flow between any pair of traders over
+// the course of a run.
+//
+// The calling thread works shard 0 itself, so N threads means N-1 workers.
+// Each shard owns its own random stream derived from the engine seed and the
+// shard number, so a run is bit-reproducible for a given seed, generator and
+// thread count.
+
+#ifndef _SHARDED_ENGINE_H
+#define _SHARDED_ENGINE_H
+
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+
+#include "Traders.h"
+#include "ActiveSet.h"
+#include "RandomStream.h"
+#include "Profiler.h"
+#include "WealthHistogram.h"
+#include "TradeKernel.h"
+
+template <typename Store>
+class ShardedEngine
+{
+public:
+	// Traders per block; 64 keeps shards on separate cache lines for any
+	// balance or stats layout
+	static const uint64_t BLOCK_TRADERS = 64;
+
+	ShardedEngine(Store &aStore, WealthHistogram *aWealth, unsigned int aThreads, KernelKind aKernel, RandomKind aRandom, uint64_t aSeed)
+		: store(aStore)
+		, kernel(aKernel)
+		, wealth(aWealth)
+		, count(aStore.size())
+		, blocks((count + BLOCK_TRADERS - 1) / BLOCK_TRADERS)
+		, position(count)
+		, exchange(aRandom, aSeed, 0)
+		, epoch(0)
+		, pending(0)
+		, stopping(false)
+	{
+		for (uint64_t i = 0; i < blocks.size(); ++i)
+		{
+			blocks[i] = i;
+		}
+		unsigned int n = std::max(1u, std::min<unsigned int>(aThreads, static_cast<unsigned int>(blocks.size())));
+		shards.reserve(n);
+		for (unsigned int i = 0; i < n; ++i)
+		{
+			shards.emplace_back(aRandom, aSeed, i + 1);
+			shards[i].active.share(position.data());
+			shards[i].delta = aWealth->blank();
+		}
+		for (unsigned int i = 1; i < shards.size(); ++i)
+		{
+			workers.emplace_back(&ShardedEngine::worker, this, i);
+		}
+	}
+
+	~ShardedEngine()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		start.notify_all();
+		for (auto &w : workers)
+		{
+			w.join();
+		}
+	}
+
+	ShardedEngine(const ShardedEngine &) = delete;
+	ShardedEngine &operator=(const ShardedEngine &) = delete;
+
+	unsigned int threads() const { return static_cast<unsigned int>(shards.size()); }
+
+	// Traders still solvent at the end of the last epoch
+	uint64_t solvent() const
+	{
+		uint64_t n = 0;
+		for (auto &s : shards)
+		{
+			n += s.active.size();
+		}
+		return n;
+	}
+
+	// Checkpoints: the order the blocks are dealt in, the exchange stream and
+	// one stream per shard. Taken between epochs.
+	uint64_t stateBlocks() const { return blocks.size(); }
+	uint64_t stateStreams() const { return shards.size() + 1; }
+
+	void saveState(uint32_t *aBlocks, uint8_t *aStreams) const
+	{
+		for (uint64_t i = 0; i < blocks.size(); ++i)
+		{
+			aBlocks[i] = static_cast<uint32_t>(blocks[i]);
+		}
+		exchange.saveState(aStreams);
+		for (uint64_t i = 0; i < shards.size(); ++i)
+		{
+			shards[i].rng.saveState(aStreams + (i + 1) * RandomStream::STATE_BYTES);
+		}
+	}
+
+	void loadState(const uint32_t *aBlocks, const uint8_t *aStreams)
+	{
+		for (uint64_t i = 0; i < blocks.size(); ++i)
+		{
+			blocks[i] = aBlocks[i];
+		}
+		exchange.loadState(aStreams);
+		for (uint64_t i = 0; i < shards.size(); ++i)
+		{
+			shards[i].rng.loadState(aStreams + (i + 1) * RandomStream::STATE_BYTES);
+		}
+	}
+
+	// Execute one epoch of up to aTrades trades split evenly over the shards.
+	// Returns the number of trades actually executed, which is only less than
+	// requested when a shard runs out of solvent trading partners; the next
+	// epoch deals the survivors out again.
+	uint64_t run(uint64_t aTrades)
+	{
+		// Cross-shard exchange: deal the blocks out afresh
+		ProfileLap lap;
+		for (uint64_t i = blocks.size() - 1; i > 0; --i)
+		{
+			std::swap(blocks[i], blocks[exchange.below(static_cast<uint32_t>(i + 1))]);
+		}
+
+		const uint64_t n = shards.size();
+		uint64_t firstBlock = 0;
+		for (uint64_t s = 0; s < n; ++s)
+		{
+			uint64_t lastBlock = blocks.size() * (s + 1) / n;
+			shards[s].firstBlock = firstBlock;
+			shards[s].blockCount = lastBlock - firstBlock;
+			shards[s].quota = aTrades / n + ((s < aTrades % n) ? 1 : 0);
+			shards[s].done = 0;
+			shards[s].delta.clear();
+			firstBlock = lastBlock;
+		}
+		lap(Phase::EXCHANGE);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending = static_cast<unsigned int>(n - 1);
+			++epoch;
+		}
+		start.notify_all();
+
+		work(shards[0]);
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			finished.wait(lock, [this] { return pending == 0; });
+		}
+
+		uint64_t done = 0;
+		for (auto &s : shards)
+		{
+			done += s.done;
+			wealth->merge(s.delta);
+		}
+		return done;
+	}
+
+private:
+	// Padded so that shards written by different threads never share a cache line
+	struct alignas(64) Shard
+	{
+		Shard(RandomKind aRandom, uint64_t aSeed, uint64_t aStream)
+			: firstBlock(0)
+			, blockCount(0)
+			, quota(0)
+			, done(0)
+			, rng(aRandom, aSeed, aStream)
+		{
+		}
+
+		uint64_t firstBlock;
+		uint64_t blockCount;
+		uint64_t quota;
+		uint64_t done;
+		RandomStream rng;
+		ActiveSet active;
+		WealthHistogram delta;		// Net change to the shared histogram this epoch
+	};
+
+	void worker(unsigned int aShard)
+	{
+		uint64_t seen = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start.wait(lock, [&] { return stopping || (epoch != seen); });
+				if (stopping)
+				{
+					return;
+				}
+				seen = epoch;
+			}
+
+			work(shards[aShard]);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--pending == 0)
+				{
+					finished.notify_one();
+				}
+			}
+		}
+	}
+
+	void work(Shard &s)
+	{
+		const typename Store::BalanceType *balance = store.balance();
+		ProfileLap lap;
+
+		// Collect the solvent traders dealt to this shard
+		s.active.clear();
+		for (uint64_t k = 0; k < s.blockCount; ++k)
+		{
+			uint64_t first = blocks[s.firstBlock + k] * BLOCK_TRADERS;
+			uint64_t last = std::min(first + BLOCK_TRADERS, count);
+			for (uint64_t i = first; i < last; ++i)
+			{
+				if (balance[i] != 0)
+				{
+					s.active.insert(i);
+				}
+			}
+		}
+
+		lap(Phase::EXCHANGE);
+
+		// Once fewer than two traders in the shard are solvent there is no play
+		s.done = trade(kernel, store, s.active, s.rng, s.delta, s.quota);
+	}
+
+	Store &store;
+	KernelKind kernel;
+	WealthHistogram *wealth;
+	uint64_t count;
+
+	std::vector<uint64_t> blocks;					// Block numbers, dealt out to shards in order
+	Column<uint32_t> position;						// Position index shared by the shard active sets
+	RandomStream exchange;							// Drives the reshuffle between epochs
+	std::vector<Shard> shards;
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable start;
+	std::condition_variable finished;
+	uint64_t epoch;
+	unsigned int pending;
+	bool stopping;
+};
+
+#endif	/* _SHARDED_ENGINE_H */
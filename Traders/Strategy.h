@@ -0,0 +1,286 @@
+// Strategy.h : Traders that play differently.
+//
+// In the original model every trade is a fair coin for one unit. With
+// strategies each trader has its own
+//   bet    the share of its balance it stakes (0 stakes a single unit)
+//   bias   its edge: a trader wins against another with probability
+//          1/2 + bias - other's bias, clamped to [0, 1]
+//   floor  a balance it will not stake below
+// and a trade moves the smaller of the two stakes from loser to winner, so
+// nobody loses more than they put up and a trader at its floor sits trades
+// out. With every parameter zero this is the original model.
+//
+// The parameters are narrow columns of their own alongside the balances, in
+// fixed point (bet in 1/32768ths, bias in 1/65536ths of a probability) so the
+// kernel is all integer arithmetic. Each column costs a scattered load per
+// trader per trade, so a parameter that is the same for everyone has no column
+// and is a constant instead. Like the batch kernel, a batch of pairs and coins
+// is drawn and resolved first; the odds and the outcome of each trade depend
+// only on the parameters, so that pass has no branches and no dependence on
+// the balances, and it gathers every parameter and prefetches the balances the
+// settling pass will need. The stakes are then settled in order with min/max
+// selects, and the only branch left is the rare one for a trader going broke.
+
+#ifndef _STRATEGY_H
+#define _STRATEGY_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define STRATEGY_PREFETCH(p) _mm_prefetch(reinterpret_cast<const char *>(p), _MM_HINT_T0)
+#else
+#define STRATEGY_PREFETCH(p)
+#endif
+
+#include "Traders.h"
+#include "ActiveSet.h"
+#include "RandomStream.h"
+#include "WealthHistogram.h"
+#include "TradeKernel.h"
+
+// Each trader's parameter is drawn uniformly from [low, high]
+struct StrategyRange
+{
+	double low;
+	double high;
+};
+
+struct StrategySpec
+{
+	StrategyRange bet;			// Share of the balance, 0..1
+	StrategyRange bias;			// -0.5..0.5
+	StrategyRange floor;		// Units
+};
+
+// LOW or LOW:HIGH
+inline bool parseStrategyRange(const char *aText, StrategyRange &aRange)
+{
+	char *end;
+	aRange.low = strtod(aText, &end);
+	if (end == aText)
+	{
+		return false;
+	}
+	aRange.high = aRange.low;
+	if (*end == ':')
+	{
+		const char *high = end + 1;
+		aRange.high = strtod(high, &end);
+		if (end == high)
+		{
+			return false;
+		}
+	}
+	return (*end == '\0') && (aRange.low <= aRange.high);
+}
+
+class Strategies
+{
+public:
+	static const uint64_t WHOLE_BET = 32768;
+	static const int64_t WHOLE_BIAS = 65536;
+
+	explicit Strategies(uint64_t aCount)
+		: count(aCount)
+		, betAll(0)
+		, biasAll(0)
+		, floorAll(0)
+	{
+	}
+
+	Strategies(const Strategies &) = delete;
+	Strategies &operator=(const Strategies &) = delete;
+
+	// Draw every trader's parameters from the ranges of aSpec
+	void assign(const StrategySpec &aSpec, RandomStream &aRng)
+	{
+		betAll = betOf(aSpec.bet.low);
+		biasAll = biasOf(aSpec.bias.low);
+		floorAll = floorOf(aSpec.floor.low);
+		betColumn.assign((aSpec.bet.low < aSpec.bet.high) ? count : 0, 0);
+		biasColumn.assign((aSpec.bias.low < aSpec.bias.high) ? count : 0, 0);
+		floorColumn.assign((aSpec.floor.low < aSpec.floor.high) ? count : 0, 0);
+		for (uint64_t t = 0; t < betColumn.size(); ++t)
+		{
+			betColumn[t] = betOf(draw(aSpec.bet, aRng));
+		}
+		for (uint64_t t = 0; t < biasColumn.size(); ++t)
+		{
+			biasColumn[t] = biasOf(draw(aSpec.bias, aRng));
+		}
+		for (uint64_t t = 0; t < floorColumn.size(); ++t)
+		{
+			floorColumn[t] = floorOf(draw(aSpec.floor, aRng));
+		}
+	}
+
+	// Columns, or null if everyone has the same value
+	const uint16_t *bet() const { return betColumn.empty() ? nullptr : betColumn.data(); }
+	const int16_t *bias() const { return biasColumn.empty() ? nullptr : biasColumn.data(); }
+	const uint32_t *floor() const { return floorColumn.empty() ? nullptr : floorColumn.data(); }
+
+	uint16_t betOfAll() const { return betAll; }
+	int16_t biasOfAll() const { return biasAll; }
+	uint32_t floorOfAll() const { return floorAll; }
+
+	// What a trader with aBalance, aBet and aFloor puts up: aBet of the
+	// balance but at least one unit, and never going below the floor
+	static uint64_t stake(uint64_t aBalance, uint64_t aBet, uint64_t aFloor)
+	{
+		uint64_t share = (aBalance >> 15) * aBet + (((aBalance & 0x7FFF) * aBet) >> 15);
+		return std::min(std::max<uint64_t>(share, 1), aBalance - std::min(aBalance, aFloor));
+	}
+
+private:
+	static double draw(const StrategyRange &aRange, RandomStream &aRng)
+	{
+		return aRange.low + (aRange.high - aRange.low) * aRng.uniform();
+	}
+
+	static uint16_t betOf(double aBet)
+	{
+		return static_cast<uint16_t>(std::llround(aBet * WHOLE_BET));
+	}
+
+	static int16_t biasOf(double aBias)
+	{
+		return static_cast<int16_t>(std::max<int64_t>(-32767, std::min<int64_t>(32767, std::llround(aBias * WHOLE_BIAS))));
+	}
+
+	static uint32_t floorOf(double aFloor)
+	{
+		return static_cast<uint32_t>(std::floor(aFloor));
+	}
+
+	uint64_t count;
+	uint16_t betAll;
+	int16_t biasAll;
+	uint32_t floorAll;
+	Column<uint16_t> betColumn;
+	Column<int16_t> biasColumn;
+	Column<uint32_t> floorColumn;
+};
+
+template <typename Store>
+uint64_t tradeStrategies(Store &aStore, const Strategies &aStrategies, ActiveSet &aActive, RandomStream &aRng, WealthHistogram &aWealth, uint64_t aTrades)
+{
+	typedef typename Store::BalanceType Balance;
+	static const uint32_t BATCH = 256;
+	static const int64_t EVEN = 0x80000000ll;
+	static const int64_t CERTAIN = 0x100000000ll;
+	static const int BIAS_SHIFT = 16;		// Bias units to coin units
+
+	uint32_t raw[2][BATCH];
+	uint32_t first[BATCH];
+	uint32_t second[BATCH];
+	uint32_t coin[BATCH];
+	uint32_t winner[BATCH];
+	uint32_t loser[BATCH];
+	uint32_t winnerBet[BATCH];
+	uint32_t loserBet[BATCH];
+	uint32_t winnerFloor[BATCH];
+	uint32_t loserFloor[BATCH];
+
+	Balance *balance = aStore.balance();
+	uint64_t *wins = aStore.wins();
+	uint64_t *losses = aStore.losses();
+	const uint16_t *bet = aStrategies.bet();
+	const int16_t *bias = aStrategies.bias();
+	const uint32_t *floor = aStrategies.floor();
+	const uint32_t betAll = aStrategies.betOfAll();
+	const uint32_t floorAll = aStrategies.floorOfAll();
+
+	ProfileLap lap;
+	uint64_t done = 0;
+	while ((done < aTrades) && (aActive.size() >= 2))
+	{
+		const uint32_t m = static_cast<uint32_t>(std::min<uint64_t>(BATCH, aTrades - done));
+		const uint32_t n = static_cast<uint32_t>(aActive.size());
+
+		// Draw the pairs exactly as the batch kernel does, and a 32-bit coin each
+		for (uint32_t k = 0; k < m; ++k)
+		{
+			raw[0][k] = aRng();
+			raw[1][k] = aRng();
+			coin[k] = aRng();
+		}
+		lap(Phase::DRAW);
+		const uint32_t threshold0 = (0u - n) % n;
+		const uint32_t threshold1 = (0u - (n - 1)) % (n - 1);
+		if (boundBatch(raw[0], first, m, n, threshold0))
+		{
+			redrawRejected(raw[0], first, m, n, threshold0, aRng);
+		}
+		if (boundBatch(raw[1], second, m, n - 1, threshold1))
+		{
+			redrawRejected(raw[1], second, m, n - 1, threshold1, aRng);
+		}
+		lap.selections(2 * m);
+		lap(Phase::SELECT);
+
+		// Odds and outcomes: the first trader wins if its coin falls below
+		// its chance of winning. Both traders' parameters are gathered here,
+		// where the loads of the whole batch overlap, and selected by outcome.
+		for (uint32_t k = 0; k < m; ++k)
+		{
+			uint32_t j = second[k] + (second[k] >= first[k]);
+			uint32_t a = static_cast<uint32_t>(aActive[first[k]]);
+			uint32_t b = static_cast<uint32_t>(aActive[j]);
+			int64_t edge = bias ? (static_cast<int64_t>(bias[a]) - bias[b]) : 0;
+			int64_t odds = std::min(std::max<int64_t>(EVEN + edge * (1ll << BIAS_SHIFT), 0), CERTAIN);
+			uint32_t aWins = 0u - static_cast<uint32_t>(static_cast<int64_t>(coin[k]) < odds);
+			winner[k] = b ^ ((a ^ b) & aWins);
+			loser[k] = a ^ b ^ winner[k];
+
+			uint32_t betA = bet ? bet[a] : betAll;
+			uint32_t betB = bet ? bet[b] : betAll;
+			uint32_t floorA = floor ? floor[a] : floorAll;
+			uint32_t floorB = floor ? floor[b] : floorAll;
+			winnerBet[k] = betB ^ ((betA ^ betB) & aWins);
+			loserBet[k] = betA ^ betB ^ winnerBet[k];
+			winnerFloor[k] = floorB ^ ((floorA ^ floorB) & aWins);
+			loserFloor[k] = floorA ^ floorB ^ winnerFloor[k];
+			STRATEGY_PREFETCH(balance + a);
+			STRATEGY_PREFETCH(balance + b);
+		}
+		lap(Phase::RESOLVE);
+
+		// Stakes from the balances as they stand, in order
+		for (uint32_t k = 0; k < m; ++k)
+		{
+			uint64_t w = winner[k];
+			uint64_t l = loser[k];
+			uint64_t wb = balance[w];
+			uint64_t lb = balance[l];
+			uint64_t amount = std::min(Strategies::stake(wb, winnerBet[k], winnerFloor[k]), Strategies::stake(lb, loserBet[k], loserFloor[k]));
+			amount = std::min<uint64_t>(amount, Store::CEILING - wb);
+
+			balance[w] = static_cast<Balance>(wb + amount);
+			balance[l] = static_cast<Balance>(lb - amount);
+			aWealth.move(wb, wb + amount);
+			aWealth.move(lb, lb - amount);
+			if (wins)
+			{
+				wins[w] += (amount != 0);
+				losses[l] += (amount != 0);
+			}
+			++done;
+
+			// The set has changed, so the rest of the batch was drawn from
+			// the wrong one
+			if (lb == amount)
+			{
+				aActive.remove(l);
+				break;
+			}
+		}
+		lap(Phase::SETTLE);
+	}
+	return done;
+}
+
+#endif	/* _STRATEGY_H */
@@ -0,0 +1,220 @@
+// Sweep.h : Parameter sweeps, many independent Traders runs at once.
+//
+// A sweep is the grid of population sizes, seed money and tax years, each
+// repeated for a number of replicas. Every run has its own traders, histogram,
+// active set and tax model, and replica r draws from random stream r of the
+// sweep seed, so runs share nothing and every grid cell sees the same random
+// numbers for a given replica. Runs are handed to a work-stealing pool, largest
+// populations first, and one CSV row per run is written in grid order once
+// they are all done.
+
+#ifndef _SWEEP_H
+#define _SWEEP_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+
+#include "Traders.h"
+#include "ActiveSet.h"
+#include "WealthHistogram.h"
+#include "RandomStream.h"
+#include "TradeKernel.h"
+#include "TaxModel.h"
+#include "WorkPool.h"
+
+struct SweepSpec
+{
+	std::vector<uint64_t> traders;
+	std::vector<uint64_t> seedMoney;
+	std::vector<uint64_t> taxYears;		// Trades per trader between collections, 0 for no tax
+	uint64_t replicas;
+	uint64_t trades;					// Trades per run
+	uint64_t seed;
+	uint64_t bins;						// Histogram bins up to twice the seed money
+	KernelKind kernel;
+	RandomKind random;
+};
+
+struct SweepRun
+{
+	uint64_t traders;
+	uint64_t seedMoney;
+	uint64_t taxYear;
+	uint64_t replica;
+
+	uint64_t trades;
+	uint64_t winners;
+	uint64_t losers;
+	uint64_t disenfranchised;
+	uint64_t richest;
+	double gini;
+	double top1;
+	double top10;
+	double seconds;
+};
+
+// Gini coefficient and top shares of a run's final balances, by sorting
+// them. Done once per run, so unlike an InequalityIndex this needs memory for
+// the traders only, not for every balance up to the largest. The same
+// definitions as InequalityIndex, exact while n^2 * W / 4 fits in 64 bits.
+inline double sortedTopShare(const std::vector<uint64_t> &aSorted, uint64_t aMoney, double aFraction)
+{
+	const uint64_t n = aSorted.size();
+	uint64_t top = static_cast<uint64_t>(std::llround(aFraction * static_cast<double>(n)));
+	if ((top == 0) || (aMoney == 0))
+	{
+		return 0.0;
+	}
+	uint64_t held = 0;
+	for (uint64_t k = n - std::min(top, n); k < n; ++k)
+	{
+		held += aSorted[k];
+	}
+	return static_cast<double>(held) / static_cast<double>(aMoney);
+}
+
+inline void measureInequality(std::vector<uint64_t> &aBalances, SweepRun &aRun)
+{
+	std::sort(aBalances.begin(), aBalances.end());
+	const uint64_t n = aBalances.size();
+
+	// Sum of |x_i - x_j| over pairs: the k-th poorest is above k traders
+	// and below n - 1 - k (wrapping arithmetic, the total is positive)
+	uint64_t money = 0;
+	uint64_t spread = 0;
+	for (uint64_t k = 0; k < n; ++k)
+	{
+		money += aBalances[k];
+		spread += aBalances[k] * (2 * k) - aBalances[k] * (n - 1);
+	}
+	aRun.gini = (money == 0) ? 0.0 : static_cast<double>(spread) / (static_cast<double>(n) * static_cast<double>(money));
+	aRun.top1 = sortedTopShare(aBalances, money, 0.01);
+	aRun.top10 = sortedTopShare(aBalances, money, 0.10);
+}
+
+// One run of the sweep on the calling thread
+template <typename Balance>
+void runSweepPoint(const SweepSpec &aSpec, SweepRun &aRun)
+{
+	typedef TraderStore<Balance> Store;
+
+	auto t0 = std::chrono::steady_clock::now();
+
+	Store store(aRun.traders, static_cast<Balance>(aRun.seedMoney), false);
+	WealthHistogram wealth(aRun.seedMoney, aSpec.bins, 2 * aRun.seedMoney);
+	ActiveSet active(store.size());
+	for (uint64_t t = 0; t < store.size(); ++t)
+	{
+		wealth.add(store[t]);
+		active.insert(t);
+	}
+	RandomStream rng(aSpec.random, aSpec.seed, aRun.replica);
+	TaxModel<Store> taxman(store, wealth, 1);
+
+	const uint64_t taxYear = aRun.taxYear * store.size();
+	uint64_t i = 0;
+	while (i < aSpec.trades)
+	{
+		uint64_t chunk = aSpec.trades - i;
+		if (taxYear)
+		{
+			if ((i % taxYear) == 0)
+			{
+				taxman.collectTax(wealth);
+				for (uint32_t t : taxman.revived())
+				{
+					active.insert(t);
+				}
+			}
+			chunk = std::min(chunk, taxYear - (i % taxYear));
+		}
+
+		uint64_t done = trade(aSpec.kernel, store, active, rng, wealth, chunk);
+		i += done;
+		if (done < chunk)
+		{
+			break;
+		}
+	}
+
+	aRun.trades = i;
+	aRun.winners = wealth.winners();
+	aRun.losers = wealth.losers();
+	aRun.disenfranchised = wealth.disenfranchised();
+	aRun.richest = *std::max_element(store.balance(), store.balance() + store.size());
+
+	std::vector<uint64_t> sorted(store.balance(), store.balance() + store.size());
+	measureInequality(sorted, aRun);
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+	aRun.seconds = elapsed.count();
+}
+
+// Run the whole grid on aThreads threads and write the results to aPath
+template <typename Balance>
+bool runSweep(const SweepSpec &aSpec, unsigned int aThreads, const char *aPath)
+{
+	FILE *out = fopen(aPath, "w");
+	if (!out)
+	{
+		fprintf(stderr, "Cannot write %s\n", aPath);
+		return false;
+	}
+
+	std::vector<SweepRun> runs;
+	for (uint64_t traders : aSpec.traders)
+	{
+		for (uint64_t money : aSpec.seedMoney)
+		{
+			for (uint64_t year : aSpec.taxYears)
+			{
+				for (uint64_t r = 0; r < aSpec.replicas; ++r)
+				{
+					SweepRun run = {};
+					run.traders = traders;
+					run.seedMoney = money;
+					run.taxYear = year;
+					run.replica = r;
+					runs.push_back(run);
+				}
+			}
+		}
+	}
+
+	// Largest populations first, so the last runs to start are the quickest
+	std::vector<uint64_t> order(runs.size());
+	for (uint64_t k = 0; k < order.size(); ++k)
+	{
+		order[k] = k;
+	}
+	std::stable_sort(order.begin(), order.end(), [&runs](uint64_t a, uint64_t b) { return runs[a].traders > runs[b].traders; });
+
+	auto t0 = std::chrono::steady_clock::now();
+	WorkStealingPool pool(aThreads);
+	pool.run(order, [&](uint64_t aRun, unsigned int)
+	{
+		runSweepPoint<Balance>(aSpec, runs[aRun]);
+	});
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+
+	uint64_t trades = 0;
+	fprintf(out, "traders,seed_money,tax_year,replica,trades,winners,even,losers,disenfranchised,richest,gini,top1_share,top10_share,seconds\n");
+	for (const SweepRun &run : runs)
+	{
+		fprintf(out, "%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.6f,%.6f,%.6f,%.6f\n",
+			run.traders, run.seedMoney, run.taxYear, run.replica, run.trades,
+			run.winners, run.traders - run.winners - run.losers, run.losers, run.disenfranchised, run.richest, run.gini, run.top1, run.top10, run.seconds);
+		trades += run.trades;
+	}
+	bool ok = (fclose(out) == 0);
+
+	printf("%llu runs (%llu trades) on %u thread(s) in %.3f s (%.1f million trades/s), results in %s\n",
+		static_cast<uint64_t>(runs.size()), trades, pool.threads(), elapsed.count(), (double)trades / elapsed.count() / 1.0e6, aPath);
+	return ok;
+}
+
+#endif	/* _SWEEP_H */
@@ -0,0 +1,261 @@
+// TaxModel.h : Income and graduated tax for the Traders population.
+//
+// Once a tax year the taxman finds the median balance and the bracket
+// thresholds above it, collects a graduated tax on the part of each balance
+// above the median, and hands the takings to the traders below the median in
+// proportion to their shortfall, so the poorest get the most.
+//
+// The thresholds are order statistics, found by selection on a scratch copy of
+// the balances: one nth_element for the median and then one on each upper
+// remainder, O(n) in all with no sort. Levying and paying out are parallel
+// passes over contiguous parts of the balance column, each with its own
+// histogram delta, run on a pool of threads kept for the life of the model. Shares are apportioned by running totals in trader order,
+// so no money is created or lost to rounding and the result does not depend
+// on the number of threads.
+
+#ifndef _TAX_MODEL_H
+#define _TAX_MODEL_H
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "WealthHistogram.h"
+#include "WorkPool.h"
+
+// Marginal rates on the part of a balance above each quantile
+struct TaxBracket
+{
+	double quantile;
+	uint64_t percent;
+};
+
+const TaxBracket TAX_BRACKETS[] = { { 0.50, 10 }, { 0.75, 20 }, { 0.90, 30 }, { 0.99, 40 } };
+const uint64_t TAX_BRACKET_COUNT = sizeof(TAX_BRACKETS) / sizeof(TAX_BRACKETS[0]);
+
+template <typename Store>
+class TaxModel
+{
+public:
+	typedef typename Store::BalanceType Balance;
+
+	// Parts smaller than this are not worth a thread
+	static const uint64_t GRAIN = 65536;
+
+	TaxModel(Store &aStore, const WealthHistogram &aWealth, unsigned int aThreads)
+		: store(aStore)
+		, count(aStore.size())
+		, parts(static_cast<unsigned int>(std::max<uint64_t>(1, std::min<uint64_t>(aThreads, count / GRAIN))))
+		, deltas(parts, aWealth.blank())
+		, partRevived(parts)
+		, partLevy(parts)
+		, partNeed(parts)
+	{
+		if (parts > 1)
+		{
+			pool.reset(new WorkStealingPool(parts));
+			for (uint64_t p = 0; p < parts; ++p)
+			{
+				partOrder.push_back(p);
+			}
+		}
+	}
+
+	TaxModel(const TaxModel &) = delete;
+	TaxModel &operator=(const TaxModel &) = delete;
+
+	// Pay every trader aIncome units, up to the ceiling of a narrow column
+	void payIncome(uint64_t aIncome, WealthHistogram &aWealth)
+	{
+		forEachPart([&](unsigned int aPart, uint64_t aFirst, uint64_t aLast)
+		{
+			Balance *balance = store.balance();
+			WealthHistogram &delta = deltas[aPart];
+			for (uint64_t i = aFirst; i < aLast; ++i)
+			{
+				uint64_t from = balance[i];
+				uint64_t to = std::min<uint64_t>(from + aIncome, Store::CEILING);
+				balance[i] = static_cast<Balance>(to);
+				delta.move(from, to);
+				if (from == 0)
+				{
+					partRevived[aPart].push_back(static_cast<uint32_t>(i));
+				}
+			}
+		});
+		finish(aWealth);
+	}
+
+	// Collect graduated tax above the median and pay it out below
+	void collectTax(WealthHistogram &aWealth)
+	{
+		revivedTraders.clear();
+		findThresholds();
+
+		// First pass: what each part owes and is owed
+		forEachPart([&](unsigned int aPart, uint64_t aFirst, uint64_t aLast)
+		{
+			const Balance *balance = store.balance();
+			uint64_t levy = 0;
+			uint64_t need = 0;
+			for (uint64_t i = aFirst; i < aLast; ++i)
+			{
+				levy += owed(balance[i]);
+				need += shortfall(balance[i]);
+			}
+			partLevy[aPart] = levy;
+			partNeed[aPart] = need;
+		});
+
+		uint64_t levied = 0;
+		uint64_t needed = 0;
+		for (unsigned int p = 0; p < parts; ++p)
+		{
+			uint64_t levy = partLevy[p];
+			uint64_t need = partNeed[p];
+			partLevy[p] = levied;
+			partNeed[p] = needed;
+			levied += levy;
+			needed += need;
+		}
+
+		// Nobody is taken below the median or paid above it, so when the takings
+		// would lift everyone below to the median only that much is collected
+		const uint64_t collected = std::min(levied, needed);
+		if (collected == 0)
+		{
+			return;
+		}
+
+		// Second pass: everyone's share of the collection is apportioned from
+		// running totals, which sum to exactly what was collected
+		forEachPart([&](unsigned int aPart, uint64_t aFirst, uint64_t aLast)
+		{
+			Balance *balance = store.balance();
+			WealthHistogram &delta = deltas[aPart];
+			uint64_t levy = partLevy[aPart];
+			uint64_t need = partNeed[aPart];
+			for (uint64_t i = aFirst; i < aLast; ++i)
+			{
+				uint64_t from = balance[i];
+				uint64_t owes = owed(from);
+				uint64_t lacks = shortfall(from);
+				if ((owes | lacks) == 0)
+				{
+					continue;
+				}
+
+				uint64_t to = from
+					- (apportion(collected, levy + owes, levied) - apportion(collected, levy, levied))
+					+ (apportion(collected, need + lacks, needed) - apportion(collected, need, needed));
+				levy += owes;
+				need += lacks;
+
+				balance[i] = static_cast<Balance>(to);
+				delta.move(from, to);
+				if ((from == 0) && (to != 0))
+				{
+					partRevived[aPart].push_back(static_cast<uint32_t>(i));
+				}
+			}
+		});
+		finish(aWealth);
+	}
+
+	// Traders brought back from zero by the last pass, in trader order
+	const std::vector<uint32_t> &revived() const { return revivedTraders; }
+
+private:
+	// The order statistics at the bracket quantiles, each selected from what
+	// is left above the one before
+	void findThresholds()
+	{
+		scratch.assign(store.balance(), store.balance() + count);
+		uint64_t from = 0;
+		for (uint64_t k = 0; k < TAX_BRACKET_COUNT; ++k)
+		{
+			uint64_t at = std::max(from, std::min(count - 1, static_cast<uint64_t>(TAX_BRACKETS[k].quantile * count)));
+			std::nth_element(scratch.begin() + from, scratch.begin() + at, scratch.end());
+			thresholds[k] = scratch[at];
+			from = at;
+		}
+		thresholds[TAX_BRACKET_COUNT] = ~0ull;
+	}
+
+	uint64_t owed(uint64_t aBalance) const
+	{
+		uint64_t percent = 0;
+		for (uint64_t k = 0; k < TAX_BRACKET_COUNT; ++k)
+		{
+			if (aBalance > thresholds[k])
+			{
+				percent += TAX_BRACKETS[k].percent * (std::min(aBalance, thresholds[k + 1]) - thresholds[k]);
+			}
+		}
+		return percent / 100;
+	}
+
+	uint64_t shortfall(uint64_t aBalance) const
+	{
+		return (aBalance < thresholds[0]) ? thresholds[0] - aBalance : 0;
+	}
+
+	// aCollected * aRunning / aTotal rounded down, reaching aCollected exactly
+	// at the end; non-decreasing in aRunning, so differences are never negative
+	static uint64_t apportion(uint64_t aCollected, uint64_t aRunning, uint64_t aTotal)
+	{
+		if ((aCollected == aTotal) || (aRunning == aTotal))
+		{
+			return (aRunning == aTotal) ? aCollected : aRunning;
+		}
+		return std::min(aCollected, static_cast<uint64_t>(static_cast<double>(aCollected) / static_cast<double>(aTotal) * static_cast<double>(aRunning)));
+	}
+
+	// Run aWork(part, first, last) over contiguous parts of the population,
+	// on the pool if there is more than one
+	template <typename Work>
+	void forEachPart(Work aWork)
+	{
+		if (!pool)
+		{
+			aWork(0, 0, count);
+			return;
+		}
+		pool->run(partOrder, [&](uint64_t aPart, unsigned int)
+		{
+			aWork(static_cast<unsigned int>(aPart), count * aPart / parts, count * (aPart + 1) / parts);
+		});
+	}
+
+	// Fold the parts' changes into the shared histogram and revived list
+	void finish(WealthHistogram &aWealth)
+	{
+		revivedTraders.clear();
+		for (unsigned int p = 0; p < parts; ++p)
+		{
+			aWealth.merge(deltas[p]);
+			deltas[p].clear();
+			revivedTraders.insert(revivedTraders.end(), partRevived[p].begin(), partRevived[p].end());
+			partRevived[p].clear();
+		}
+	}
+
+	Store &store;
+	uint64_t count;
+	unsigned int parts;
+
+	std::vector<Balance> scratch;
+	uint64_t thresholds[TAX_BRACKET_COUNT + 1];
+
+	std::vector<WealthHistogram> deltas;
+	std::vector<std::vector<uint32_t>> partRevived;
+	std::vector<uint64_t> partLevy;
+	std::vector<uint64_t> partNeed;
+	std::vector<uint32_t> revivedTraders;
+
+	std::unique_ptr<WorkStealingPool> pool;		// None for a single part
+	std::vector<uint64_t> partOrder;
+};
+
+#endif	/* _TAX_MODEL_H */
@@ -0,0 +1,482 @@
+// TradeGraph.h : Trading along the edges of a social/market graph.
+//
+// By default anyone can trade with anyone. With a graph, a trade is between
+// the two ends of an edge, so who can get rich depends on who they know. The
+// graph is undirected and kept in compressed sparse row form: each edge is a
+// pair of trader numbers, and each trader's row lists the edges it is on.
+//
+// Graphs are loaded from an edge list or generated: a ring lattice, an
+// Erdos-Renyi random graph with a given mean degree, or a Barabasi-Albert
+// scale-free graph.
+//
+// A trade picks an edge uniformly from the live edges, those with both ends
+// solvent, which are held in an ActiveSet of edge numbers, so a draw is O(1)
+// however many traders have gone broke. When a trader goes broke its edges
+// leave the set, and when one is revived (tax, income) those to solvent
+// neighbours come back, both O(degree).
+//
+// Generated and loaded numberings put neighbours anywhere in the balance
+// column, so every trade would touch two unrelated cache lines on a large
+// graph. Traders are renumbered in breadth-first or reverse Cuthill-McKee
+// order, which keeps the two ends of most edges close together, and the
+// edges are then sorted by their ends.
+
+#ifndef _TRADE_GRAPH_H
+#define _TRADE_GRAPH_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "Traders.h"
+#include "ActiveSet.h"
+#include "RandomStream.h"
+#include "WealthHistogram.h"
+#include "Profiler.h"
+
+enum class GraphOrder
+{
+	NONE,
+	BFS,
+	RCM
+};
+
+inline bool parseGraphOrder(const char *aName, GraphOrder &aOrder)
+{
+	if (strcmp(aName, "none") == 0)
+	{
+		aOrder = GraphOrder::NONE;
+	}
+	else if (strcmp(aName, "bfs") == 0)
+	{
+		aOrder = GraphOrder::BFS;
+	}
+	else if (strcmp(aName, "rcm") == 0)
+	{
+		aOrder = GraphOrder::RCM;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+inline const char *graphOrderName(GraphOrder aOrder)
+{
+	switch (aOrder)
+	{
+	case GraphOrder::NONE:
+		return "none";
+	case GraphOrder::BFS:
+		return "bfs";
+	default:
+		return "rcm";
+	}
+}
+
+// Edge numbers are drawn in 32 bits
+const uint64_t EDGE_LIMIT = 0xFFFFFFFFull;
+
+class TradeGraph
+{
+public:
+	TradeGraph() : nodes(0) {}
+
+	// Build from aSpec: ring:K (each trader linked to the K nearest on either
+	// side), er:D (Erdos-Renyi with mean degree D), ba:M (Barabasi-Albert, M
+	// links per newcomer) for aTraders traders, or else the name of an edge
+	// list file, which sets the population itself. Returns false if the spec
+	// or file is no good.
+	bool generate(const char *aSpec, uint64_t aTraders, RandomStream &aRng)
+	{
+		std::vector<uint64_t> pairs;
+		uint64_t n = aTraders;
+		char *end = nullptr;
+		if (strncmp(aSpec, "ring:", 5) == 0)
+		{
+			uint64_t k = strtoull(aSpec + 5, &end, 0);
+			if ((*end != '\0') || (k == 0) || (2 * k >= n))
+			{
+				return false;
+			}
+			for (uint64_t v = 0; v < n; ++v)
+			{
+				for (uint64_t d = 1; d <= k; ++d)
+				{
+					pairs.push_back(pair(v, (v + d) % n));
+				}
+			}
+		}
+		else if (strncmp(aSpec, "er:", 3) == 0)
+		{
+			double degree = strtod(aSpec + 3, &end);
+			if ((*end != '\0') || !(degree > 0.0) || (degree >= static_cast<double>(n - 1)))
+			{
+				return false;
+			}
+
+			// G(n, m) with m = n * D / 2 drawn pairs; the odd repeat is dropped
+			uint64_t m = static_cast<uint64_t>(std::llround(degree * static_cast<double>(n) / 2.0));
+			for (uint64_t e = 0; e < m; ++e)
+			{
+				uint32_t a = aRng.below(static_cast<uint32_t>(n));
+				uint32_t b = aRng.below(static_cast<uint32_t>(n - 1));
+				pairs.push_back(pair(a, b + (b >= a)));
+			}
+		}
+		else if (strncmp(aSpec, "ba:", 3) == 0)
+		{
+			uint64_t m = strtoull(aSpec + 3, &end, 0);
+			if ((*end != '\0') || (m == 0) || (m >= n) || (2 * m * n > EDGE_LIMIT))
+			{
+				return false;
+			}
+
+			// Start from a clique of m + 1, then each newcomer links to m
+			// distinct traders drawn in proportion to their degree, by drawing
+			// from the list of every edge end so far
+			std::vector<uint32_t> stubs;
+			for (uint64_t a = 0; a <= m; ++a)
+			{
+				for (uint64_t b = a + 1; b <= m; ++b)
+				{
+					pairs.push_back(pair(a, b));
+					stubs.push_back(static_cast<uint32_t>(a));
+					stubs.push_back(static_cast<uint32_t>(b));
+				}
+			}
+			std::vector<uint32_t> chosen;
+			for (uint64_t v = m + 1; v < n; ++v)
+			{
+				chosen.clear();
+				while (chosen.size() < m)
+				{
+					uint32_t t = stubs[aRng.below(static_cast<uint32_t>(stubs.size()))];
+					if (std::find(chosen.begin(), chosen.end(), t) == chosen.end())
+					{
+						chosen.push_back(t);
+					}
+				}
+				for (uint32_t t : chosen)
+				{
+					pairs.push_back(pair(t, v));
+					stubs.push_back(t);
+					stubs.push_back(static_cast<uint32_t>(v));
+				}
+			}
+		}
+		else if (!load(aSpec, pairs, n))
+		{
+			return false;
+		}
+
+		return build(n, pairs);
+	}
+
+	// Renumber the traders for locality
+	void reorder(GraphOrder aOrder)
+	{
+		if (aOrder == GraphOrder::NONE)
+		{
+			return;
+		}
+
+		// Breadth first from each component in turn. Cuthill-McKee starts
+		// each component at a trader of least degree and takes neighbours in
+		// order of degree, and the reverse of that order keeps the profile
+		// smallest.
+		const bool rcm = (aOrder == GraphOrder::RCM);
+		std::vector<uint32_t> starts(nodes);
+		for (uint64_t v = 0; v < nodes; ++v)
+		{
+			starts[v] = static_cast<uint32_t>(v);
+		}
+		auto byDegree = [this](uint32_t a, uint32_t b) { return degree(a) < degree(b); };
+		if (rcm)
+		{
+			std::stable_sort(starts.begin(), starts.end(), byDegree);
+		}
+
+		std::vector<uint32_t> order(nodes);
+		std::vector<uint8_t> seen(nodes, 0);
+		uint64_t placed = 0;
+		for (uint32_t s : starts)
+		{
+			if (seen[s])
+			{
+				continue;
+			}
+			seen[s] = 1;
+			order[placed++] = s;
+			for (uint64_t head = placed - 1; head < placed; ++head)
+			{
+				uint32_t v = order[head];
+				uint64_t first = placed;
+				for (uint64_t k = offsets[v]; k < offsets[v + 1]; ++k)
+				{
+					uint32_t w = other(incidence[k], v);
+					if (!seen[w])
+					{
+						seen[w] = 1;
+						order[placed++] = w;
+					}
+				}
+				if (rcm)
+				{
+					std::stable_sort(order.begin() + first, order.begin() + placed, byDegree);
+				}
+			}
+		}
+		if (rcm)
+		{
+			std::reverse(order.begin(), order.end());
+		}
+
+		std::vector<uint32_t> number(nodes);
+		for (uint64_t k = 0; k < nodes; ++k)
+		{
+			number[order[k]] = static_cast<uint32_t>(k);
+		}
+		std::vector<uint64_t> pairs(edges());
+		for (uint64_t e = 0; e < edges(); ++e)
+		{
+			pairs[e] = pair(number[ends[2 * e]], number[ends[2 * e + 1]]);
+		}
+		build(nodes, pairs);
+	}
+
+	uint64_t size() const { return nodes; }
+	uint64_t edges() const { return ends.size() / 2; }
+	uint64_t degree(uint64_t aTrader) const { return offsets[aTrader + 1] - offsets[aTrader]; }
+
+	uint64_t maxDegree() const
+	{
+		uint64_t most = 0;
+		for (uint64_t v = 0; v < nodes; ++v)
+		{
+			most = std::max(most, degree(v));
+		}
+		return most;
+	}
+
+	// Mean distance between the numbers of the two ends of an edge
+	double span() const
+	{
+		double total = 0.0;
+		for (uint64_t e = 0; e < edges(); ++e)
+		{
+			total += static_cast<double>(ends[2 * e + 1] - ends[2 * e]);
+		}
+		return edges() ? total / static_cast<double>(edges()) : 0.0;
+	}
+
+	// End aSide (0 or 1) of edge aEdge, and the end that is not aTrader
+	uint32_t end(uint64_t aEdge, unsigned int aSide) const { return ends[2 * aEdge + aSide]; }
+	uint32_t other(uint64_t aEdge, uint64_t aTrader) const { return ends[2 * aEdge] ^ ends[2 * aEdge + 1] ^ static_cast<uint32_t>(aTrader); }
+
+	// The edges aTrader is on
+	const uint32_t *firstEdge(uint64_t aTrader) const { return incidence.data() + offsets[aTrader]; }
+	const uint32_t *lastEdge(uint64_t aTrader) const { return incidence.data() + offsets[aTrader + 1]; }
+
+private:
+	static uint64_t pair(uint64_t a, uint64_t b)
+	{
+		return (std::min(a, b) << 32) | std::max(a, b);
+	}
+
+	// The next whole line, however long, into aLine; false at the end
+	static bool readLine(FILE *aIn, std::string &aLine)
+	{
+		aLine.clear();
+		char chunk[256];
+		while (fgets(chunk, sizeof(chunk), aIn))
+		{
+			aLine += chunk;
+			if (aLine.back() == '\n')
+			{
+				return true;
+			}
+		}
+		return !aLine.empty();
+	}
+
+	// Edge list: two trader numbers a line; blank lines and lines starting
+	// with # or % are skipped
+	static bool load(const char *aPath, std::vector<uint64_t> &aPairs, uint64_t &aTraders)
+	{
+		FILE *in = fopen(aPath, "r");
+		if (!in)
+		{
+			return false;
+		}
+
+		bool ok = true;
+		uint64_t largest = 0;
+		std::string line;
+		while (ok && readLine(in, line))
+		{
+			const char *p = line.c_str() + strspn(line.c_str(), " \t");
+			if ((*p == '#') || (*p == '%') || (*p == '\n') || (*p == '\r') || (*p == '\0'))
+			{
+				continue;
+			}
+			char *end;
+			uint64_t a = strtoull(p, &end, 10);
+			ok = (end != p);
+			p = end;
+			uint64_t b = strtoull(p, &end, 10);
+			ok = ok && (end != p) && (a < TRADER_LIMIT) && (b < TRADER_LIMIT);
+			largest = std::max(largest, std::max(a, b));
+			aPairs.push_back(pair(a, b));
+		}
+		fclose(in);
+
+		aTraders = largest + 1;
+		return ok && !aPairs.empty();
+	}
+
+	// Make the edges from packed (lower, upper) pairs, dropping loops and
+	// repeats, and index them by trader
+	bool build(uint64_t aTraders, std::vector<uint64_t> &aPairs)
+	{
+		std::sort(aPairs.begin(), aPairs.end());
+		aPairs.erase(std::unique(aPairs.begin(), aPairs.end()), aPairs.end());
+		aPairs.erase(std::remove_if(aPairs.begin(), aPairs.end(), [](uint64_t p) { return (p >> 32) == (p & 0xFFFFFFFF); }), aPairs.end());
+		if (aPairs.size() > EDGE_LIMIT)
+		{
+			return false;
+		}
+
+		nodes = aTraders;
+		ends.resize(2 * aPairs.size());
+		offsets.assign(nodes + 1, 0);
+		for (uint64_t e = 0; e < aPairs.size(); ++e)
+		{
+			ends[2 * e] = static_cast<uint32_t>(aPairs[e] >> 32);
+			ends[2 * e + 1] = static_cast<uint32_t>(aPairs[e]);
+			offsets[ends[2 * e] + 1]++;
+			offsets[ends[2 * e + 1] + 1]++;
+		}
+		for (uint64_t v = 0; v < nodes; ++v)
+		{
+			offsets[v + 1] += offsets[v];
+		}
+
+		incidence.resize(ends.size());
+		std::vector<uint64_t> fill(offsets.begin(), offsets.end() - 1);
+		for (uint64_t e = 0; e < edges(); ++e)
+		{
+			incidence[fill[ends[2 * e]]++] = static_cast<uint32_t>(e);
+			incidence[fill[ends[2 * e + 1]]++] = static_cast<uint32_t>(e);
+		}
+		return true;
+	}
+
+	uint64_t nodes;
+	std::vector<uint32_t> ends;			// Both ends of every edge, lower first
+	std::vector<uint64_t> offsets;		// Row of each trader in incidence
+	std::vector<uint32_t> incidence;	// Edges of each trader in turn
+};
+
+// Put every edge with both ends solvent in aLive
+template <typename Store>
+void liveEdges(const TradeGraph &aGraph, const Store &aStore, ActiveSet &aLive)
+{
+	aLive.clear();
+	for (uint64_t e = 0; e < aGraph.edges(); ++e)
+	{
+		if ((aStore[aGraph.end(e, 0)] != 0) && (aStore[aGraph.end(e, 1)] != 0))
+		{
+			aLive.insert(e);
+		}
+	}
+}
+
+// aTrader has gone broke: its edges can no longer trade
+inline void retire(const TradeGraph &aGraph, ActiveSet &aLive, uint64_t aTrader)
+{
+	for (const uint32_t *e = aGraph.firstEdge(aTrader); e != aGraph.lastEdge(aTrader); ++e)
+	{
+		if (aLive.contains(*e))
+		{
+			aLive.remove(*e);
+		}
+	}
+}
+
+// aTrader is solvent again: its edges to solvent traders can trade
+template <typename Store>
+void revive(const TradeGraph &aGraph, const Store &aStore, ActiveSet &aLive, uint64_t aTrader)
+{
+	for (const uint32_t *e = aGraph.firstEdge(aTrader); e != aGraph.lastEdge(aTrader); ++e)
+	{
+		if ((aStore[aGraph.other(*e, aTrader)] != 0) && !aLive.contains(*e))
+		{
+			aLive.insert(*e);
+		}
+	}
+}
+
+// Up to aTrades trades along the live edges; fewer only when none are left.
+// Edges and coins are drawn a batch at a time and resolved to traders before
+// any are settled, so the scattered loads of a batch overlap instead of
+// following one another. The batch is settled in order, and once somebody
+// goes broke the rest of it is discarded, as in the batch trade kernel.
+template <typename Store>
+uint64_t tradeOnGraph(Store &aStore, const TradeGraph &aGraph, ActiveSet &aLive, RandomStream &aRng, WealthHistogram &aWealth, uint64_t aTrades)
+{
+	static const uint32_t BATCH = 256;
+
+	uint32_t slot[BATCH];
+	uint64_t coins[BATCH / 64];
+	uint32_t winner[BATCH];
+	uint32_t loser[BATCH];
+
+	ProfileLap lap;
+	uint64_t done = 0;
+	while ((done < aTrades) && (aLive.size() != 0))
+	{
+		const uint32_t m = static_cast<uint32_t>(std::min<uint64_t>(BATCH, aTrades - done));
+		aRng.fillBounded(slot, m, static_cast<uint32_t>(aLive.size()));
+		aRng.fillBits(coins, (m + 63) / 64);
+		lap.selections(m);
+		lap(Phase::DRAW);
+
+		for (uint32_t k = 0; k < m; ++k)
+		{
+			uint64_t e = aLive[slot[k]];
+			unsigned int side = static_cast<unsigned int>((coins[k / 64] >> (k % 64)) & 1);
+			winner[k] = aGraph.end(e, side);
+			loser[k] = aGraph.end(e, side ^ 1);
+		}
+		lap(Phase::RESOLVE);
+
+		for (uint32_t k = 0; k < m; ++k)
+		{
+			++done;
+			uint64_t winnerBalance = aStore[winner[k]];
+			uint64_t loserBalance = aStore[loser[k]];
+			if (!aStore.transfer(winner[k], loser[k]))
+			{
+				continue;
+			}
+			aWealth.move(winnerBalance, winnerBalance + 1);
+			aWealth.move(loserBalance, loserBalance - 1);
+			if (loserBalance == 1)
+			{
+				retire(aGraph, aLive, loser[k]);
+				break;
+			}
+		}
+		lap(Phase::SETTLE);
+	}
+	return done;
+}
+
+#endif	/* _TRADE_GRAPH_H */
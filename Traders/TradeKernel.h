@@ -0,0 +1,309 @@
+// TradeKernel.h : The inner trade loop, one trade at a time or in batches.
+//
+// Both kernels execute up to aTrades trades between the solvent traders of an
+// active set and return how many were executed; fewer only when the set runs
+// out of pairs. They are shared by the serial loop and the shards of the
+// parallel engine.
+//
+// The scalar kernel draws two traders and a coin and settles the trade, then
+// does it again.
+//
+// The batch kernel draws the trader positions and coin bits for BATCH trades
+// at once. Raw words are mapped onto [0, n) with a vectorised multiply-high
+// and the rare draws that Lemire's method would reject are redrawn, so
+// selection stays exactly uniform. The multiply is eight lanes wide with AVX2
+// (/arch:AVX2 or -mavx2) and four wide with SSE2 otherwise, which every x64
+// build and the default Win32 build have. The figures given when the batch
+// kernel was added were measured with AVX2 (-march=native); with SSE2 the
+// batch kernel ran at about 47 and 17 million trades/s for 1000 and 1e6
+// traders, against 53 and 19 with AVX2 and 30 and 6 for the scalar kernel.
+//
+// Then the batch kernel checks every trader in the batch. When nobody is close
+// enough to zero (or to the ceiling of a narrow balance column) to hit it
+// within the batch, the deltas are applied with no solvency or ceiling
+// branches. A trader drawn several times in one batch is settled in order, so
+// collisions are resolved exactly as the scalar kernel would. Otherwise the
+// batch is settled trade by trade with the full checks until somebody goes
+// broke. The remaining draws are then discarded, because they were uniform over
+// a set that has since shrunk.
+
+#ifndef _TRADE_KERNEL_H
+#define _TRADE_KERNEL_H
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define TRADE_KERNEL_SSE2 1
+#endif
+
+#include "ActiveSet.h"
+#include "RandomStream.h"
+#include "WealthHistogram.h"
+#include "Profiler.h"
+
+enum class KernelKind
+{
+	SCALAR,
+	BATCH
+};
+
+inline bool parseKernelKind(const char *aName, KernelKind &aKind)
+{
+	if (strcmp(aName, "scalar") == 0)
+	{
+		aKind = KernelKind::SCALAR;
+	}
+	else if (strcmp(aName, "batch") == 0)
+	{
+		aKind = KernelKind::BATCH;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+inline const char *kernelKindName(KernelKind aKind)
+{
+	return (aKind == KernelKind::BATCH) ? "batch" : "scalar";
+}
+
+// Settle one trade with every check; returns false if the loser went broke
+// and left the active set
+template <typename Store>
+inline bool settle(Store &aStore, ActiveSet &aActive, WealthHistogram &aWealth, uint64_t aWinner, uint64_t aLoser)
+{
+	// A trade the winner cannot take (balance already at the ceiling of
+	// its column) is a missed opportunity
+	uint64_t winnerBalance = aStore[aWinner];
+	uint64_t loserBalance = aStore[aLoser];
+	if (!aStore.transfer(aWinner, aLoser))
+	{
+		return true;
+	}
+
+	aWealth.move(winnerBalance, winnerBalance + 1);
+	aWealth.move(loserBalance, loserBalance - 1);
+	if (loserBalance == 1)
+	{
+		aActive.remove(aLoser);
+		return false;
+	}
+	return true;
+}
+
+template <typename Store>
+uint64_t tradeScalar(Store &aStore, ActiveSet &aActive, RandomStream &aRng, WealthHistogram &aWealth, uint64_t aTrades)
+{
+	// Once fewer than two traders are solvent there is no play
+	ProfileSampler lap;
+	uint64_t done = 0;
+	while ((done < aTrades) && (aActive.size() >= 2))
+	{
+		lap.round(done);
+		uint64_t a;
+		uint64_t b;
+		aActive.drawPair(aRng, a, b);
+
+		bool aWins = aRng.bit();
+		lap(Phase::DRAW);
+		settle(aStore, aActive, aWealth, aWins ? a : b, aWins ? b : a);
+		lap(Phase::SETTLE);
+		++done;
+	}
+	lap.selections(2 * done);
+	return done;
+}
+
+// Map raw words onto [0, aBound) by multiply-high; returns true if any draw
+// falls in Lemire's rejection zone (low half of the product below aThreshold)
+inline bool boundBatch(const uint32_t *aRaw, uint32_t *aOut, uint32_t aCount, uint32_t aBound, uint32_t aThreshold)
+{
+	uint32_t k = 0;
+	bool reject = false;
+
+#if defined(__AVX2__)
+	const __m256i bound = _mm256_set1_epi64x(aBound);
+	const __m256i sign = _mm256_set1_epi32(static_cast<int>(0x80000000u));
+	const __m256i threshold = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(aThreshold)), sign);
+	__m256i rejected = _mm256_setzero_si256();
+	for (; k + 8 <= aCount; k += 8)
+	{
+		__m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(aRaw + k));
+		__m256i even = _mm256_mul_epu32(r, bound);
+		__m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(r, 32), bound);
+		__m256i high = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+		__m256i low = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(aOut + k), high);
+		rejected = _mm256_or_si256(rejected, _mm256_cmpgt_epi32(threshold, _mm256_xor_si256(low, sign)));
+	}
+	reject = !_mm256_testz_si256(rejected, rejected);
+#elif defined(TRADE_KERNEL_SSE2)
+	// As above four lanes at a time, with masks for the missing blend
+	const __m128i bound = _mm_set1_epi64x(aBound);
+	const __m128i sign = _mm_set1_epi32(static_cast<int>(0x80000000u));
+	const __m128i threshold = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(aThreshold)), sign);
+	const __m128i lowHalves = _mm_set1_epi64x(0xFFFFFFFFll);
+	__m128i rejected = _mm_setzero_si128();
+	for (; k + 4 <= aCount; k += 4)
+	{
+		__m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aRaw + k));
+		__m128i even = _mm_mul_epu32(r, bound);
+		__m128i odd = _mm_mul_epu32(_mm_srli_epi64(r, 32), bound);
+		__m128i high = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_andnot_si128(lowHalves, odd));
+		__m128i low = _mm_or_si128(_mm_and_si128(even, lowHalves), _mm_slli_epi64(odd, 32));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(aOut + k), high);
+		rejected = _mm_or_si128(rejected, _mm_cmpgt_epi32(threshold, _mm_xor_si128(low, sign)));
+	}
+	reject = _mm_movemask_epi8(rejected) != 0;
+#endif
+
+	for (; k < aCount; ++k)
+	{
+		uint64_t m = static_cast<uint64_t>(aRaw[k]) * aBound;
+		aOut[k] = static_cast<uint32_t>(m >> 32);
+		reject |= (static_cast<uint32_t>(m) < aThreshold);
+	}
+	return reject;
+}
+
+// Redraw the positions that Lemire's method rejects
+inline void redrawRejected(const uint32_t *aRaw, uint32_t *aOut, uint32_t aCount, uint32_t aBound, uint32_t aThreshold, RandomStream &aRng)
+{
+	for (uint32_t k = 0; k < aCount; ++k)
+	{
+		if (static_cast<uint32_t>(static_cast<uint64_t>(aRaw[k]) * aBound) < aThreshold)
+		{
+			aOut[k] = aRng.below(aBound, 1);
+		}
+	}
+}
+
+template <typename Store>
+uint64_t tradeBatch(Store &aStore, ActiveSet &aActive, RandomStream &aRng, WealthHistogram &aWealth, uint64_t aTrades)
+{
+	typedef typename Store::BalanceType Balance;
+	static const uint32_t BATCH = 256;
+
+	// Balances strictly inside (floor, ceiling) cannot reach zero or the
+	// column ceiling within one batch
+	const uint64_t floor = BATCH;
+	const uint64_t ceiling = (sizeof(Balance) < sizeof(uint64_t)) ? (Store::CEILING - BATCH) : ~0ull;
+
+	uint32_t raw[2][BATCH];
+	uint32_t first[BATCH];
+	uint32_t second[BATCH];
+	uint64_t coins[BATCH / 64];
+	uint32_t winner[BATCH];
+	uint32_t loser[BATCH];
+
+	Balance *balance = aStore.balance();
+	uint64_t *wins = aStore.wins();
+	uint64_t *losses = aStore.losses();
+
+	ProfileLap lap;
+	uint64_t done = 0;
+	while ((done < aTrades) && (aActive.size() >= 2))
+	{
+		const uint32_t m = static_cast<uint32_t>(std::min<uint64_t>(BATCH, aTrades - done));
+		const uint32_t n = static_cast<uint32_t>(aActive.size());
+
+		// Draw the pairs: first uniform over n, second over the other n-1
+		for (uint32_t k = 0; k < m; ++k)
+		{
+			raw[0][k] = aRng();
+			raw[1][k] = aRng();
+		}
+		aRng.fillBits(coins, (m + 63) / 64);
+		lap(Phase::DRAW);
+
+		const uint32_t threshold0 = (0u - n) % n;
+		const uint32_t threshold1 = (0u - (n - 1)) % (n - 1);
+		if (boundBatch(raw[0], first, m, n, threshold0))
+		{
+			redrawRejected(raw[0], first, m, n, threshold0, aRng);
+		}
+		if (boundBatch(raw[1], second, m, n - 1, threshold1))
+		{
+			redrawRejected(raw[1], second, m, n - 1, threshold1, aRng);
+		}
+		lap.selections(2 * m);
+		lap(Phase::SELECT);
+
+		// Resolve positions to winners and losers, and check nobody can hit a bound
+		uint64_t lowest = ~0ull;
+		uint64_t highest = 0;
+		for (uint32_t k = 0; k < m; ++k)
+		{
+			uint32_t j = second[k] + (second[k] >= first[k]);
+			uint32_t a = static_cast<uint32_t>(aActive[first[k]]);
+			uint32_t b = static_cast<uint32_t>(aActive[j]);
+			uint32_t aWins = 0u - static_cast<uint32_t>((coins[k / 64] >> (k % 64)) & 1);
+			winner[k] = b ^ ((a ^ b) & aWins);
+			loser[k] = a ^ b ^ winner[k];
+
+			uint64_t la = balance[a];
+			uint64_t lb = balance[b];
+			lowest = std::min(lowest, std::min(la, lb));
+			highest = std::max(highest, std::max(la, lb));
+		}
+		lap(Phase::RESOLVE);
+
+		if ((lowest > floor) && (highest < ceiling))
+		{
+			// Fast path: nobody can go broke or overflow within this batch
+			for (uint32_t k = 0; k < m; ++k)
+			{
+				uint64_t w = winner[k];
+				uint64_t l = loser[k];
+				uint64_t wb = balance[w];
+				uint64_t lb = balance[l];
+				balance[w] = static_cast<Balance>(wb + 1);
+				balance[l] = static_cast<Balance>(lb - 1);
+				aWealth.move(wb, wb + 1);
+				aWealth.move(lb, lb - 1);
+			}
+			if (wins)
+			{
+				for (uint32_t k = 0; k < m; ++k)
+				{
+					wins[winner[k]]++;
+					losses[loser[k]]++;
+				}
+			}
+			done += m;
+		}
+		else
+		{
+			// Somebody is near a bound: settle in order until the set changes
+			for (uint32_t k = 0; k < m; ++k)
+			{
+				++done;
+				if (!settle(aStore, aActive, aWealth, winner[k], loser[k]))
+				{
+					break;
+				}
+			}
+		}
+		lap(Phase::SETTLE);
+	}
+	return done;
+}
+
+template <typename Store>
+uint64_t trade(KernelKind aKind, Store &aStore, ActiveSet &aActive, RandomStream &aRng, WealthHistogram &aWealth, uint64_t aTrades)
+{
+	if (aKind == KernelKind::BATCH)
+	{
+		return tradeBatch(aStore, aActive, aRng, aWealth, aTrades);
+	}
+	return tradeScalar(aStore, aActive, aRng, aWealth, aTrades);
+}
+
+#endif	/* _TRADE_KERNEL_H */
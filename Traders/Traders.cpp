@@ -9,6 +9,32 @@
 #include <cstdint>
 #include <random>
 #include <functional>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <memory>
+
+#include "Traders.h"
+#include "ActiveSet.h"
+#include "WealthHistogram.h"
+#include "RandomStream.h"
+#include "TradeKernel.h"
+#include "LeapKernel.h"
+#include "TaxModel.h"
+#include "ShardedEngine.h"
+#include "Renderer.h"
+#include "Checkpoint.h"
+#include "Sweep.h"
+#include "Benchmark.h"
+#include "InequalityIndex.h"
+#include "MetricsStream.h"
+#include "TradeGraph.h"
+#include "Strategy.h"
+#include "FairnessTest.h"
+#include "Profiler.h"
+#include "ProcessEngine.h"
 
 //CSI n A	CUU	Cursor Up	Moves the cursor n(default 1) cells in the given direction.If the cursor is already at the edge of the screen, this has no effect.
 //CSI n B	CUD	Cursor Down
@@ -51,41 +77,102 @@
 
 
 
-std::default_random_engine generator;		// Change as needed (e.g., can connect to hardware engine with is true random)
-
-std::uniform_int_distribution<int> coinDistribution(0, 1);
-auto coin = std::bind(coinDistribution, generator);
-
+// Bits per generator for demoCoinFairness; trades draw from RandomStream (see --rng)
 const uint64_t MAX_FLIPS = 10000000;
-uint64_t count[2] = {}; // To demonstrate  random number generator for fairness
 
-const uint64_t MAX_TRADERS = 1000;
-const uint64_t MAX_TRADES  = 1000000000;
-std::uniform_int_distribution<uint64_t> tradeDistribution((uint64_t)0, MAX_TRADERS);
-auto selectTrader = std::bind<uint64_t>(tradeDistribution, generator);
+const uint64_t DEFAULT_TRADERS = 1000;
+const uint64_t MAX_TRADES  = 1000000000;		// Default horizon, see --trades
 
 const uint64_t SEED_MONEY = 5000;
-uint64_t trader[MAX_TRADERS] = {};
-struct Stats
-{
-	uint64_t wins;
-	uint64_t losses;
-};
-Stats stats[MAX_TRADERS] = {};
 
 const uint64_t MAX_BINS = 35;
 const uint64_t LARGEST_BIN = static_cast<uint64_t>(2.0 * SEED_MONEY);
 const uint64_t BIN_SIZE = LARGEST_BIN / MAX_BINS;
-uint64_t hist[MAX_BINS] = {};
-
-uint64_t winners = 0;
-uint64_t losers = 0;
-uint64_t disenfranchised = 0;
+WealthHistogram wealth(SEED_MONEY, MAX_BINS, LARGEST_BIN);	// Kept current by every trade
 
 uint64_t scale = 8;
 
-const bool TAX_ENABLED = false;
-const uint64_t TAX_BOUNDARY = 10000;
+// The taxman comes round every tax year of TAX_YEAR trades per trader, so
+// the O(n) collection stays a fixed share of the work at any population
+// (10000 trades for the default population)
+const uint64_t TAX_YEAR = 10;
+
+const uint64_t REPORT_BOUNDARY = MAX_TRADES / 100000;
+
+// Runtime options
+struct Options
+{
+	unsigned int threads;		// 1 runs the original serial loop, 0 means one per core
+	KernelKind kernel;			// Inner trade loop
+	RandomKind random;			// Generator behind every trade
+	uint64_t seed;				// Seed for all streams; stream n goes to thread n
+	uint64_t epoch;				// Trades between cross-shard exchanges in the parallel engine
+	bool display;				// Draw the histogram; off for headless throughput runs
+	unsigned int fps;			// Display frames per second, independent of the trade rate
+	uint64_t traders;			// Population size
+	unsigned int width;			// Bits per balance: 16, 32 or 64
+	bool stats;					// Keep per-trader win/loss counts
+	const char *checkpoint;		// File to checkpoint to, if any
+	uint64_t checkpointEvery;	// Trades between checkpoints, a whole number of report intervals
+	const char *resume;			// Checkpoint to carry on from, if any
+	bool tax;					// Run the income and tax models every tax year
+	uint64_t income;			// Units paid to every trader each tax year
+	const char *sweep;			// Run a parameter sweep and write the results here
+	uint64_t trades;			// Horizon: trades in the whole run
+	uint64_t leap;				// Trades per trader per leap, 0 to trade exactly
+	bool inequality;			// Keep the inequality index up to date with every trade
+	const char *metrics;		// File to record the run's time series to, if any
+	uint64_t metricsEvery;		// Trades between samples, a whole number of report intervals
+	uint64_t metricsWealthEvery;	// Trades between balance column records, 0 for none
+	const char *graph;			// Trade only along the edges of this graph, if any
+	GraphOrder graphOrder;		// Renumbering of the graph's traders for locality
+	bool strategies;			// Traders play by their own bet, bias and floor (see strategy)
+	bool profile;				// Print where the time went at the end of the run
+	uint64_t fairness;			// Bits per generator for the coin fairness battery, 0 to trade
+	unsigned int processes;		// Worker processes sharing the population, 0 to trade in this one
+	const char *bench;			// Run the benchmark workloads and write the results here
+};
+Options options = { 1, KernelKind::BATCH, RandomKind::XOSHIRO, std::default_random_engine::default_seed, 1000000, true, 10, DEFAULT_TRADERS, 64, true, nullptr, 100000000, nullptr, false, 0, nullptr, MAX_TRADES, 0, false, nullptr, 1000000, 0, nullptr, GraphOrder::RCM, false, false, 0, 0, nullptr };
+
+// The grid for --sweep; kernel, generator and seed are filled in from the options
+const uint64_t SWEEP_TRADES = 100000000;
+SweepSpec sweep = { { DEFAULT_TRADERS }, { SEED_MONEY }, { 0 }, 1, SWEEP_TRADES, 0, MAX_BINS, KernelKind::BATCH, RandomKind::XOSHIRO };
+
+// The workloads for --bench; the rest is filled in from the options
+const uint64_t BENCH_TRADES = 20000000;
+BenchSpec bench = { { 1000, 100000, 10000000 }, { 0, 50, 90 }, BENCH_TRADES, 3, SEED_MONEY, TAX_YEAR, 0, MAX_BINS, 0, true, RandomKind::XOSHIRO, 0 };
+
+// Gini, top shares and quantiles, live with --inequality
+InequalityIndex inequality(LARGEST_BIN);
+
+// Who can trade with whom, with --graph, and how far apart the ends of an
+// edge were before renumbering
+TradeGraph graph;
+double graphSpan = 0.0;
+
+// Ranges the traders' strategies are drawn from, with --bet, --bias or --floor
+StrategySpec strategy = { { 0.0, 0.0 }, { 0.0, 0.0 }, { 0.0, 0.0 } };
+
+// How far leap mode strayed from exact trading
+LeapStats leapStats = {};
+
+// Checkpointing (see Checkpoint.h)
+std::unique_ptr<CheckpointWriter> checkpointer;
+Checkpoint resumed;				// The checkpoint a resumed run carries on from
+
+// Worker processes and the shared segment they trade in (see ProcessEngine.h)
+std::unique_ptr<ProcessEngine> pool;
+const char *program = nullptr;		// This program, to start them from
+
+// Time series output (see MetricsStream.h)
+std::unique_ptr<MetricsStream> metrics;
+uint64_t nextSample = 0;
+uint64_t nextWealth = 0;
+uint64_t sampled = ~0ull;		// Trades at the last sample
+
+// Hand-off from the trading thread to the display thread
+SnapshotBuffer snapshots(MAX_BINS);
+Snapshot latest = { 0, 0, 0, 0, 0, 0.0, 0.0, 0.0, std::vector<uint64_t>(MAX_BINS) };
 
 
 #define DIM(x) (sizeof(x)/sizeof(x[0]))
@@ -93,147 +180,1306 @@ const uint64_t TAX_BOUNDARY = 10000;
 void demoCoinFairness(void)
 {
 	printf("Demonstrating coin fairness...\n");
+	fairnessBattery(MAX_FLIPS, options.threads, options.seed);
+	printf("\n");
+}
 
-	for (uint64_t i = 0; i < MAX_FLIPS; ++i)
+// Traders brought back from zero rejoin the serial loop's active set; the
+// parallel engine rebuilds its sets from the balances every epoch
+void readmit(const std::vector<uint32_t> &aRevived, ActiveSet *aActive)
+{
+	if (aActive)
 	{
-		coin() ? ++count[1] : ++count[0];
-		if ((i % (MAX_FLIPS / 100)) == 0)
+		for (uint32_t t : aRevived)
 		{
-			printf("\r%3llu %% complete : n = %8llu : count[0] = %8llu : count[1] = %8llu", i*100/MAX_FLIPS, i, count[0], count[1]);
+			aActive->insert(t);
 		}
 	}
-
-	printf("\r100 %% complete : n = %8llu : count[0] = %8llu : count[1] = %8llu\n", MAX_FLIPS, count[0], count[1]);
-
-	printf("\n");
 }
 
-void executeIncomeModel(void)
+template <typename Store>
+void executeIncomeModel(TaxModel<Store> &aTaxman, ActiveSet *aActive)
 {
 	// Create an influx of wealth (i.e., a growth in GDP-like value)
-
+	if (options.income != 0)
+	{
+		aTaxman.payIncome(options.income, wealth);
+		readmit(aTaxman.revived(), aActive);
+	}
 }
 
-void executeTaxModel(void)
+template <typename Store>
+void executeTaxModel(TaxModel<Store> &aTaxman, ActiveSet *aActive)
 {
 	// Collect graduated tax for any above median
 	// Distribute inverse proportionally to any below median to bring
 	// traders to minimum standard of living
+	aTaxman.collectTax(wealth);
+	readmit(aTaxman.revived(), aActive);
 }
 
-int main()
+void usage(const char *aProgram)
 {
-	// Uncomment if needed to convince someone
-	// demoCoinFairness();
+	printf("Usage: %s [--traders N] [--width BITS] [--no-stats] [--threads N] [--kernel KIND] [--rng KIND] [--seed S] [--epoch TRADES] [--fps N] [--no-display] [--checkpoint FILE] [--checkpoint-every TRADES] [--resume FILE] [--tax] [--income UNITS] [--trades N] [--leap M] [--inequality] [--metrics FILE] [--metrics-every TRADES] [--metrics-wealth-every TRADES] [--graph SPEC] [--graph-order KIND] [--bet RANGE] [--bias RANGE] [--floor RANGE] [--profile] [--processes N]\n", aProgram);
+	printf("       %s --fairness BITS [--threads N] [--seed S]\n", aProgram);
+	printf("       %s --sweep FILE [--sweep-traders LIST] [--sweep-money LIST] [--sweep-tax LIST] [--sweep-replicas N] [--sweep-trades N] [--threads N] [--width BITS] [--kernel KIND] [--rng KIND] [--seed S]\n", aProgram);
+	printf("       %s --bench FILE [--bench-traders LIST] [--bench-broke LIST] [--bench-trades N] [--bench-repeats N] [--threads N] [--width BITS] [--no-stats] [--rng KIND] [--seed S] [--epoch TRADES]\n", aProgram);
+	printf("  --traders N      Population size (default %llu)\n", DEFAULT_TRADERS);
+	printf("  --width BITS     Bits per balance, 16, 32 or 64 (default %u)\n", options.width);
+	printf("  --no-stats       Do not keep per-trader win/loss counts\n");
+	printf("  --threads N      Trade on N threads (default 1 = serial, 0 = one per core)\n");
+	printf("  --kernel KIND    Trade loop: scalar or batch (default %s)\n", kernelKindName(options.kernel));
+	printf("  --rng KIND       Generator: xoshiro, philox or std (default %s)\n", randomKindName(options.random));
+	printf("  --seed S         Random seed (default %llu)\n", options.seed);
+	printf("  --epoch TRADES   Trades between cross-thread exchanges (default %llu)\n", options.epoch);
+	printf("  --fps N          Display frames per second (default %u)\n", options.fps);
+	printf("  --no-display     Run headless and only print a summary at the end\n");
+	printf("  --checkpoint FILE\n");
+	printf("                   Save the run to FILE every checkpoint interval\n");
+	printf("  --checkpoint-every TRADES\n");
+	printf("                   Trades between checkpoints (default %llu)\n", options.checkpointEvery);
+	printf("  --resume FILE    Carry on from a checkpoint; the population, generator, seed\n");
+	printf("                   and trade options are those of the checkpointed run\n");
+	printf("  --tax            Collect graduated tax above the median every %llu trades per trader\n", TAX_YEAR);
+	printf("                   and pay it out below the median\n");
+	printf("  --income UNITS   With --tax, also pay every trader UNITS each tax year\n");
+	printf("  --trades N       Trades in the whole run (default %llu)\n", MAX_TRADES);
+	printf("  --leap M         Approximate: pair traders off at random and advance each pair\n");
+	printf("                   M trades at a time; reports how far it strays from exact trading\n");
+	printf("  --inequality     Track the Gini coefficient, top 1 %% and 10 %% shares and median\n");
+	printf("                   live (slower trades)\n");
+	printf("  --metrics FILE   Record a sample of the counters, inequality figures and histogram\n");
+	printf("                   to FILE as the run goes; CSV if FILE ends in .csv, else binary\n");
+	printf("  --metrics-every TRADES\n");
+	printf("                   Trades between samples (default %llu)\n", options.metricsEvery);
+	printf("  --metrics-wealth-every TRADES\n");
+	printf("                   Also record every balance this often (binary files only)\n");
+	printf("  --graph SPEC     Trade only along the edges of a graph: ring:K (K neighbours either\n");
+	printf("                   side), er:D (random, mean degree D), ba:M (scale-free, M links per\n");
+	printf("                   newcomer) or an edge list file, which sets the population\n");
+	printf("  --graph-order KIND\n");
+	printf("                   Renumber the traders for locality: none, bfs or rcm (default %s)\n", graphOrderName(options.graphOrder));
+	printf("  --bet RANGE      Traders stake this share of their balance (default 0 = one unit);\n");
+	printf("                   a trade moves the smaller stake. RANGE is X or LOW:HIGH, and each\n");
+	printf("                   trader draws its own value uniformly from it\n");
+	printf("  --bias RANGE     Edge of each trader: it beats another with probability\n");
+	printf("                   1/2 + bias - other's bias (-0.5 to 0.5)\n");
+	printf("  --floor RANGE    Balance below which each trader will not stake\n");
+	printf("  --processes N    Split the traders over N worker processes sharing the balances,\n");
+	printf("                   each pinned to a NUMA node; trades across them go by message\n");
+	printf("  --profile        Print the time per trade in each phase of the run and the\n");
+	printf("                   rejected draws per selection of a trader at the end\n");
+	printf("  --fairness BITS  Test the coin of every generator for fairness on BITS bits each\n");
+	printf("                   (frequency, runs, serial correlation, pair and triple patterns)\n");
+	printf("  --sweep FILE     Run every combination of the sweep lists (comma separated) as\n");
+	printf("                   independent runs on --threads threads and write a CSV row per run\n");
+	printf("  --sweep-traders LIST   Population sizes (default %llu)\n", DEFAULT_TRADERS);
+	printf("  --sweep-money LIST     Seed money (default %llu)\n", SEED_MONEY);
+	printf("  --sweep-tax LIST       Tax years in trades per trader, 0 for no tax (default 0)\n");
+	printf("  --sweep-replicas N     Runs per combination, each on its own random stream (default 1)\n");
+	printf("  --sweep-trades N       Trades per run (default %llu)\n", SWEEP_TRADES);
+	printf("  --bench FILE     Time the scalar, batch and parallel engines on fixed workloads, every\n");
+	printf("                   combination of the lists below with and without tax, and write a\n");
+	printf("                   CSV row per case; the parallel engine runs on --threads threads,\n");
+	printf("                   or one per core when that is 1\n");
+	printf("  --bench-traders LIST   Population sizes (default 1000,100000,10000000)\n");
+	printf("  --bench-broke LIST     Percentages of traders starting broke (default 0,50,90)\n");
+	printf("  --bench-trades N       Trades per case (default %llu)\n", BENCH_TRADES);
+	printf("  --bench-repeats N      Timed runs per case, the median reported (default 3)\n");
+}
+
+// Comma separated numbers
+bool parseList(const char *aText, std::vector<uint64_t> &aList)
+{
+	aList.clear();
+	for (;;)
+	{
+		char *end;
+		aList.push_back(strtoull(aText, &end, 0));
+		if (end == aText)
+		{
+			return false;
+		}
+		if (*end == '\0')
+		{
+			return true;
+		}
+		if (*end != ',')
+		{
+			return false;
+		}
+		aText = end + 1;
+	}
+}
+
+MetricsFormat metricsFormat()
+{
+	size_t length = strlen(options.metrics);
+	return ((length >= 4) && (strcmp(options.metrics + length - 4, ".csv") == 0)) ? MetricsFormat::CSV : MetricsFormat::BINARY;
+}
+
+bool parseOptions(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+		if ((strcmp(argv[i], "--traders") == 0) && value)
+		{
+			options.traders = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if ((strcmp(argv[i], "--width") == 0) && value)
+		{
+			options.width = static_cast<unsigned int>(strtoul(value, nullptr, 0));
+			++i;
+		}
+		else if (strcmp(argv[i], "--no-stats") == 0)
+		{
+			options.stats = false;
+		}
+		else if ((strcmp(argv[i], "--threads") == 0) && value)
+		{
+			options.threads = static_cast<unsigned int>(strtoul(value, nullptr, 0));
+			++i;
+		}
+		else if ((strcmp(argv[i], "--kernel") == 0) && value)
+		{
+			if (!parseKernelKind(value, options.kernel))
+			{
+				return false;
+			}
+			++i;
+		}
+		else if ((strcmp(argv[i], "--rng") == 0) && value)
+		{
+			if (!parseRandomKind(value, options.random))
+			{
+				return false;
+			}
+			++i;
+		}
+		else if ((strcmp(argv[i], "--seed") == 0) && value)
+		{
+			options.seed = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if ((strcmp(argv[i], "--epoch") == 0) && value)
+		{
+			options.epoch = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if ((strcmp(argv[i], "--fps") == 0) && value)
+		{
+			options.fps = static_cast<unsigned int>(strtoul(value, nullptr, 0));
+			++i;
+		}
+		else if (strcmp(argv[i], "--no-display") == 0)
+		{
+			options.display = false;
+		}
+		else if ((strcmp(argv[i], "--checkpoint") == 0) && value)
+		{
+			options.checkpoint = value;
+			++i;
+		}
+		else if ((strcmp(argv[i], "--checkpoint-every") == 0) && value)
+		{
+			options.checkpointEvery = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if ((strcmp(argv[i], "--resume") == 0) && value)
+		{
+			options.resume = value;
+			++i;
+		}
+		else if (strcmp(argv[i], "--tax") == 0)
+		{
+			options.tax = true;
+		}
+		else if ((strcmp(argv[i], "--income") == 0) && value)
+		{
+			options.income = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if ((strcmp(argv[i], "--trades") == 0) && value)
+		{
+			options.trades = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if (strcmp(argv[i], "--profile") == 0)
+		{
+#if TRADERS_PROFILE
+			options.profile = true;
+#else
+			fprintf(stderr, "--profile needs a build with TRADERS_PROFILE\n");
+			return false;
+#endif
+		}
+		else if ((strcmp(argv[i], "--fairness") == 0) && value)
+		{
+			// Accepts 1e9 and the like
+			double bits = strtod(value, nullptr);
+			if ((bits < 1.0) || (bits > 1.0e18))
+			{
+				return false;
+			}
+			options.fairness = static_cast<uint64_t>(bits);
+			++i;
+		}
+		else if ((strcmp(argv[i], "--leap") == 0) && value)
+		{
+			options.leap = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if (strcmp(argv[i], "--inequality") == 0)
+		{
+			options.inequality = true;
+		}
+		else if ((strcmp(argv[i], "--metrics") == 0) && value)
+		{
+			options.metrics = value;
+			++i;
+		}
+		else if ((strcmp(argv[i], "--metrics-every") == 0) && value)
+		{
+			options.metricsEvery = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if ((strcmp(argv[i], "--metrics-wealth-every") == 0) && value)
+		{
+			options.metricsWealthEvery = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if ((strcmp(argv[i], "--processes") == 0) && value)
+		{
+			options.processes = static_cast<unsigned int>(strtoul(value, nullptr, 0));
+			++i;
+		}
+		else if ((strcmp(argv[i], "--graph") == 0) && value)
+		{
+			options.graph = value;
+			++i;
+		}
+		else if ((strcmp(argv[i], "--graph-order") == 0) && value)
+		{
+			if (!parseGraphOrder(value, options.graphOrder))
+			{
+				return false;
+			}
+			++i;
+		}
+		else if ((strcmp(argv[i], "--bet") == 0) && value)
+		{
+			if (!parseStrategyRange(value, strategy.bet) || (strategy.bet.low < 0.0) || (strategy.bet.high > 1.0))
+			{
+				return false;
+			}
+			options.strategies = true;
+			++i;
+		}
+		else if ((strcmp(argv[i], "--bias") == 0) && value)
+		{
+			if (!parseStrategyRange(value, strategy.bias) || (strategy.bias.low < -0.5) || (strategy.bias.high > 0.5))
+			{
+				return false;
+			}
+			options.strategies = true;
+			++i;
+		}
+		else if ((strcmp(argv[i], "--floor") == 0) && value)
+		{
+			if (!parseStrategyRange(value, strategy.floor) || (strategy.floor.low < 0.0) || (strategy.floor.high > 4294967295.0))
+			{
+				return false;
+			}
+			options.strategies = true;
+			++i;
+		}
+		else if ((strcmp(argv[i], "--sweep") == 0) && value)
+		{
+			options.sweep = value;
+			++i;
+		}
+		else if ((strcmp(argv[i], "--sweep-traders") == 0) && value)
+		{
+			if (!parseList(value, sweep.traders))
+			{
+				return false;
+			}
+			++i;
+		}
+		else if ((strcmp(argv[i], "--sweep-money") == 0) && value)
+		{
+			if (!parseList(value, sweep.seedMoney))
+			{
+				return false;
+			}
+			++i;
+		}
+		else if ((strcmp(argv[i], "--sweep-tax") == 0) && value)
+		{
+			if (!parseList(value, sweep.taxYears))
+			{
+				return false;
+			}
+			++i;
+		}
+		else if ((strcmp(argv[i], "--sweep-replicas") == 0) && value)
+		{
+			sweep.replicas = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if ((strcmp(argv[i], "--sweep-trades") == 0) && value)
+		{
+			sweep.trades = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if ((strcmp(argv[i], "--bench") == 0) && value)
+		{
+			options.bench = value;
+			++i;
+		}
+		else if ((strcmp(argv[i], "--bench-traders") == 0) && value)
+		{
+			if (!parseList(value, bench.traders))
+			{
+				return false;
+			}
+			++i;
+		}
+		else if ((strcmp(argv[i], "--bench-broke") == 0) && value)
+		{
+			if (!parseList(value, bench.broke))
+			{
+				return false;
+			}
+			++i;
+		}
+		else if ((strcmp(argv[i], "--bench-trades") == 0) && value)
+		{
+			bench.trades = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else if ((strcmp(argv[i], "--bench-repeats") == 0) && value)
+		{
+			bench.repeats = strtoull(value, nullptr, 0);
+			++i;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	// A resumed run is the checkpointed run carried on, so everything that
+	// shapes the trades comes from the checkpoint
+	if (options.resume)
+	{
+		if (!resumed.open(options.resume))
+		{
+			fprintf(stderr, "%s is not a Traders checkpoint\n", options.resume);
+			return false;
+		}
+		const CheckpointHeader &h = resumed.header();
+		options.threads = h.threads;
+		options.kernel = static_cast<KernelKind>(h.kernel);
+		options.random = static_cast<RandomKind>(h.random);
+		options.seed = h.seed;
+		options.epoch = h.epoch;
+		options.traders = h.traders;
+		options.width = h.width;
+		options.stats = (h.stats != 0);
+		options.tax = (h.tax != 0);
+		options.income = h.income;
+		if (h.bins != MAX_BINS)
+		{
+			fprintf(stderr, "%s was written with %llu histogram bins, not %llu\n", options.resume, h.bins, MAX_BINS);
+			return false;
+		}
+	}
+
+	if (options.strategies && ((options.threads != 1) || options.leap || options.graph || options.checkpoint || options.resume || options.sweep))
+	{
+		fprintf(stderr, "Strategies run on one thread without leaps, graphs, checkpoints or sweeps\n");
+		return false;
+	}
+
+	// The graph is made here because a graph file sets the population
+	if (options.graph)
+	{
+		if ((options.threads != 1) || options.leap || options.checkpoint || options.resume || options.sweep)
+		{
+			fprintf(stderr, "--graph runs on one thread without leaps, checkpoints or sweeps\n");
+			return false;
+		}
+		RandomStream rng(options.random, options.seed, 1);
+		if ((options.traders > TRADER_LIMIT) || !graph.generate(options.graph, options.traders, rng))
+		{
+			fprintf(stderr, "Cannot make a graph from %s\n", options.graph);
+			return false;
+		}
+		options.traders = graph.size();
+		graphSpan = graph.span();
+		graph.reorder(options.graphOrder);
+	}
+
+	if (options.processes)
+	{
+		if ((options.processes < 2) || (options.width == 16) || (options.threads != 1) || options.leap || options.graph || options.strategies ||
+			options.checkpoint || options.resume || options.sweep)
+		{
+			fprintf(stderr, "--processes runs 2 or more workers on 32 or 64-bit balances without threads, leaps, graphs, strategies, checkpoints or sweeps\n");
+			return false;
+		}
+		if (options.traders < options.processes * ProcessEngine::PARTITION_TRADERS)
+		{
+			fprintf(stderr, "--processes needs at least %llu traders per worker\n", ProcessEngine::PARTITION_TRADERS);
+			return false;
+		}
+	}
+
+	if ((options.traders < 2) || (options.traders > TRADER_LIMIT))
+	{
+		return false;
+	}
+	if ((options.width != 16) && (options.width != 32) && (options.width != 64))
+	{
+		return false;
+	}
+	if ((options.width == 16) && (SEED_MONEY > 0xFFFF))
+	{
+		return false;
+	}
+	if (options.bench)
+	{
+		// The parallel cases always run on several threads
+		bench.threads = (options.threads > 1) ? options.threads : std::max(2u, std::thread::hardware_concurrency());
+	}
+	if (options.threads == 0)
+	{
+		options.threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	if (options.epoch == 0)
+	{
+		options.epoch = REPORT_BOUNDARY;
+	}
+	if (options.leap && ((options.threads > 1) || options.tax || options.checkpoint || options.resume))
+	{
+		fprintf(stderr, "--leap runs on one thread without tax or checkpoints\n");
+		return false;
+	}
+	if (options.sweep)
+	{
+		sweep.seed = options.seed;
+		sweep.kernel = options.kernel;
+		sweep.random = options.random;
+		for (uint64_t t : sweep.traders)
+		{
+			if ((t < 2) || (t > TRADER_LIMIT))
+			{
+				return false;
+			}
+		}
+		// The histogram of each run spans twice the seed money
+		for (uint64_t m : sweep.seedMoney)
+		{
+			if ((m == 0) || (m > UINT64_MAX / 2) || ((options.width == 16) && (m > 0xFFFF)) || ((options.width == 32) && (m > 0xFFFFFFFF)))
+			{
+				return false;
+			}
+		}
+		if (sweep.replicas == 0)
+		{
+			return false;
+		}
+	}
+	if (options.bench)
+	{
+		bench.epoch = options.epoch;
+		bench.stats = options.stats;
+		bench.random = options.random;
+		bench.seed = options.seed;
+		for (uint64_t t : bench.traders)
+		{
+			if ((t < 2) || (t > TRADER_LIMIT))
+			{
+				return false;
+			}
+		}
+		for (uint64_t b : bench.broke)
+		{
+			if (b > 100)
+			{
+				return false;
+			}
+		}
+		if (bench.repeats == 0)
+		{
+			return false;
+		}
+	}
+	if (options.checkpoint)
+	{
+		if (options.random == RandomKind::STD)
+		{
+			fprintf(stderr, "The std generator cannot be checkpointed; use --rng xoshiro or philox\n");
+			return false;
+		}
+
+		// Checkpoints fall on report boundaries, where the serial loop breaks
+		// its work anyway, so checkpointing never changes the course of a run
+		uint64_t reports = (options.checkpointEvery + REPORT_BOUNDARY - 1) / REPORT_BOUNDARY;
+		options.checkpointEvery = std::max<uint64_t>(reports, 1) * REPORT_BOUNDARY;
+	}
+	if (options.metrics)
+	{
+		if (options.metricsWealthEvery && (metricsFormat() == MetricsFormat::CSV))
+		{
+			fprintf(stderr, "Balances can only be recorded to a binary metrics file\n");
+			return false;
+		}
+
+		// Samples fall on report boundaries like checkpoints, and balance
+		// records on samples
+		uint64_t reports = (options.metricsEvery + REPORT_BOUNDARY - 1) / REPORT_BOUNDARY;
+		options.metricsEvery = std::max<uint64_t>(reports, 1) * REPORT_BOUNDARY;
+		uint64_t samples = (options.metricsWealthEvery + options.metricsEvery - 1) / options.metricsEvery;
+		options.metricsWealthEvery = samples * options.metricsEvery;
+	}
+	return true;
+}
+
+// Draw a snapshot; runs on the display thread
+void display(const Snapshot &aFrame)
+{
+	// Display histogram
+	printf(ESC_POS(1,1));//Top left corner
+	printf(ESC_ERASE_LINE_TO_END);
+	printf("%.3f %% of %llu trades complete\n", (double)aFrame.trades * 100.0 / (double)options.trades, options.trades);
+
+	uint64_t maxHist = 0;
+	for (int64_t j = (MAX_BINS-1); j >= 0; j--)
+	{
+		printf(ESC_ERASE_LINE_TO_END);
+		printf("\r%9llu : %9llu : %s\n", (uint64_t)j * BIN_SIZE, aFrame.hist[j], std::string(static_cast<unsigned int>(aFrame.hist[j] / scale), '*').c_str());
+		if (aFrame.hist[j] > maxHist)
+		{
+			maxHist = aFrame.hist[j];
+		}
+	}
+	// At least one trader per star, however small the population
+	scale = std::max<uint64_t>(1, 8 * maxHist / 500);
+	printf(ESC_ERASE_LINE_TO_END);
+	printf("\r* = %llu\n", scale);
+	printf(ESC_ERASE_LINE_TO_END);
+	printf("\rWinners = %4llu Even = %4llu Losers = %4llu Disenfranchised = %4llu\n", aFrame.winners, options.traders - aFrame.winners - aFrame.losers, aFrame.losers, aFrame.disenfranchised);
+	if (options.inequality)
+	{
+		printf(ESC_ERASE_LINE_TO_END);
+		printf("\rGini = %.4f Top 1%% = %.2f %% Top 10%% = %.2f %% Median = %llu\n", aFrame.gini, aFrame.top1 * 100.0, aFrame.top10 * 100.0, aFrame.median);
+	}
+	fflush(stdout);
+}
 
-	// Start every trader with the same balance
-	for (uint64_t i = 0; i < DIM(trader); ++i)
+// Hand the state after trade i to the display thread, and to the metrics
+// stream when a sample is due (or aForce, unless it already has this one)
+template <typename Store>
+void report(uint64_t i, const Store &aStore, bool aForce = false)
+{
+	bool sample = metrics && (i != sampled) && (aForce || (i >= nextSample));
+	if (!options.display && !sample)
+	{
+		return;
+	}
+
+	ProfileLap lap;
+	latest.trades = i;
+	latest.winners = wealth.winners();
+	latest.losers = wealth.losers();
+	latest.disenfranchised = wealth.disenfranchised();
+	if (options.inequality)
+	{
+		latest.median = inequality.quantile(0.5);
+		latest.gini = inequality.gini();
+		latest.top1 = inequality.topShare(0.01);
+		latest.top10 = inequality.topShare(0.10);
+	}
+	for (uint64_t j = 0; j < MAX_BINS; ++j)
+	{
+		latest.hist[j] = wealth[j];
+	}
+	if (options.display)
 	{
-		trader[i] = SEED_MONEY;
+		snapshots.publish(latest);
 	}
 
-	// Run billions of trading opportunities
-	for (uint64_t i = 0; i < MAX_TRADES; ++i)
+	if (sample)
+	{
+		metrics->sample(latest);
+		sampled = i;
+		if (options.metricsWealthEvery && (aForce || (i >= nextWealth)))
+		{
+			metrics->wealth(i, aStore.balance());
+			nextWealth = (i / options.metricsWealthEvery + 1) * options.metricsWealthEvery;
+		}
+		nextSample = (i / options.metricsEvery + 1) * options.metricsEvery;
+	}
+	lap(Phase::REPORT);
+}
+
+// Start the metrics stream for a run that carries on from aFirst trades
+template <typename Store>
+bool startMetrics(uint64_t aFirst, const Store &aStore)
+{
+	if (!options.metrics)
+	{
+		return true;
+	}
+
+	MetricsHeader h = {};
+	h.width = options.width;
+	h.traders = aStore.size();
+	h.seed = options.seed;
+	h.bins = MAX_BINS;
+	h.binSize = BIN_SIZE;
+	h.inequality = options.inequality ? 1 : 0;
+	metrics.reset(new MetricsStream(options.metrics, metricsFormat(), h, options.metricsWealthEvery != 0));
+	if (!metrics->ok())
+	{
+		fprintf(stderr, "Cannot write %s\n", options.metrics);
+		metrics.reset();
+		return false;
+	}
+
+	// The starting state is the first sample
+	report(aFirst, aStore, true);
+	return true;
+}
+
+// Close the metrics stream, saying if anything was lost
+void finishMetrics()
+{
+	if (!metrics)
+	{
+		return;
+	}
+	uint64_t dropped = metrics->dropped();
+	if (!metrics->close())
+	{
+		fprintf(stderr, "Metrics could not all be written to %s\n", options.metrics);
+	}
+	if (dropped)
+	{
+		fprintf(stderr, "%llu metrics record(s) dropped; the writer could not keep up\n", dropped);
+	}
+	metrics.reset();
+}
+
+// Changes made in bulk (tax, the shards of the parallel engine) do not pass
+// through the shared histogram, so the inequality index catches up with them
+// by comparing the balances before and after
+template <typename Store>
+void markBulk(const Store &aStore)
+{
+	if (options.inequality)
+	{
+		inequality.mark(aStore.balance(), aStore.size());
+	}
+}
+
+template <typename Store>
+void foldBulk(const Store &aStore)
+{
+	if (options.inequality)
+	{
+		inequality.update(aStore.balance(), aStore.size());
+	}
+}
+
+// Start the checkpoint writer for a run that keeps aOrder entries of draw
+// order and aStreams random streams
+void startCheckpoints(uint64_t aOrder, uint64_t aStreams)
+{
+	if (!options.checkpoint)
+	{
+		return;
+	}
+
+	CheckpointHeader layout = {};
+	layout.width = options.width;
+	layout.traders = options.traders;
+	layout.seed = options.seed;
+	layout.epoch = options.epoch;
+	layout.threads = options.threads;
+	layout.kernel = static_cast<uint32_t>(options.kernel);
+	layout.random = static_cast<uint32_t>(options.random);
+	layout.stats = options.stats ? 1 : 0;
+	layout.tax = options.tax ? 1 : 0;
+	layout.income = options.income;
+	layout.bins = MAX_BINS;
+	layout.orderCapacity = aOrder;
+	layout.streams = aStreams;
+	Checkpoint::layOut(layout);
+	checkpointer.reset(new CheckpointWriter(options.checkpoint, layout));
+}
+
+// Copy the state after aTrades trades into the next checkpoint. aSaveOrder
+// writes the draw order and random streams and returns the order length.
+template <typename Store, typename SaveOrder>
+void saveCheckpoint(uint64_t aTrades, const Store &aStore, SaveOrder aSaveOrder)
+{
+	typedef typename Store::BalanceType Balance;
+
+	ProfileLap lap;
+	Checkpoint *c = checkpointer->begin();
+	if (!c)
+	{
+		fprintf(stderr, "Cannot create %s.tmp; no more checkpoints will be taken\n", options.checkpoint);
+		checkpointer.reset();
+		return;
+	}
+
+	CheckpointHeader &h = c->header();
+	h.trades = aTrades;
+	memcpy(c->section<Balance>(h.balanceOffset), aStore.balance(), aStore.size() * sizeof(Balance));
+	if (aStore.hasStats())
+	{
+		memcpy(c->section<uint64_t>(h.winsOffset), aStore.wins(), aStore.size() * sizeof(uint64_t));
+		memcpy(c->section<uint64_t>(h.lossesOffset), aStore.losses(), aStore.size() * sizeof(uint64_t));
+	}
+	wealth.save(c->section<int64_t>(h.wealthOffset));
+	h.orderCount = aSaveOrder(c->section<uint32_t>(h.orderOffset), c->section<uint8_t>(h.streamOffset));
+	checkpointer->commit();
+	lap(Phase::CHECKPOINT);
+}
+
+// Run the trades across several threads, exchanging traders between
+// threads every epoch
+template <typename Store>
+uint64_t runParallel(Store &aStore)
+{
+	ShardedEngine<Store> engine(aStore, &wealth, options.threads, options.kernel, options.random, options.seed);
+
+	TaxModel<Store> taxman(aStore, wealth, options.threads);
+	const uint64_t taxYear = TAX_YEAR * aStore.size();
+
+	uint64_t i = 0;
+	if (options.resume)
+	{
+		const CheckpointHeader &h = resumed.header();
+		if ((h.orderCapacity != engine.stateBlocks()) || (h.streams != engine.stateStreams()))
+		{
+			fprintf(stderr, "%s does not match this engine\n", options.resume);
+			return 0;
+		}
+		engine.loadState(resumed.section<uint32_t>(h.orderOffset), resumed.section<uint8_t>(h.streamOffset));
+		i = h.trades;
+		resumed.close();		// Still mapped if the store's columns are in it
+	}
+
+	startCheckpoints(engine.stateBlocks(), engine.stateStreams());
+	uint64_t nextCheckpoint = (i / options.checkpointEvery + 1) * options.checkpointEvery;
+	uint64_t nextTax = (i + taxYear - 1) / taxYear * taxYear;
+
+	while (i < options.trades)
+	{
+		// The taxman still comes round every tax year; epochs stop short of
+		// the year end so he comes between them
+		uint64_t epoch = std::min(options.epoch, options.trades - i);
+		markBulk(aStore);
+		if (options.tax)
+		{
+			if (i >= nextTax)
+			{
+				ProfileLap lap;
+				executeIncomeModel(taxman, nullptr);
+				executeTaxModel(taxman, nullptr);
+				nextTax = (i / taxYear + 1) * taxYear;
+				lap(Phase::TAX);
+			}
+			epoch = std::min(epoch, nextTax - i);
+		}
+
+		uint64_t done = engine.run(epoch);
+		foldBulk(aStore);
+		if ((done == 0) && (engine.solvent() < 2))
+		{
+			// Nobody is left to trade with
+			break;
+		}
+		i += done;
+
+		report(i, aStore);
+
+		if (checkpointer && (i >= nextCheckpoint))
+		{
+			saveCheckpoint(i, aStore, [&engine](uint32_t *aOrder, uint8_t *aStreams)
+			{
+				engine.saveState(aOrder, aStreams);
+				return engine.stateBlocks();
+			});
+			nextCheckpoint = (i / options.checkpointEvery + 1) * options.checkpointEvery;
+		}
+	}
+	return i;
+}
+
+// Run the trades on this thread, a report interval at a time
+template <typename Store>
+uint64_t runSerial(Store &aStore)
+{
+	RandomStream rng(options.random, options.seed, 0);
+
+	// Once a trader is disenfrachised there is no play, so they
+	// leave the active set and are never drawn again
+	ActiveSet active(aStore.size());
+	uint64_t i = 0;
+	if (options.resume)
+	{
+		// Draws index the active set, so it must come back in the same order
+		const CheckpointHeader &h = resumed.header();
+		active.assign(resumed.section<uint32_t>(h.orderOffset), h.orderCount);
+		rng.loadState(resumed.section<uint8_t>(h.streamOffset));
+		i = h.trades;
+		resumed.close();		// Still mapped if the store's columns are in it
+	}
+	else
+	{
+		for (uint64_t t = 0; t < aStore.size(); ++t)
+		{
+			if (aStore[t] != 0)
+			{
+				active.insert(t);
+			}
+		}
+	}
+
+	startCheckpoints(aStore.size(), 1);
+
+	// Each trader's strategy comes from a stream of its own, so the trades
+	// draw the same numbers whatever the strategies are
+	Strategies strategies(options.strategies ? aStore.size() : 0);
+	if (options.strategies)
+	{
+		RandomStream assigner(options.random, options.seed, 2);
+		strategies.assign(strategy, assigner);
+	}
+
+	TaxModel<Store> taxman(aStore, wealth, options.threads);
+	const uint64_t taxYear = TAX_YEAR * aStore.size();
+
+	while (i < options.trades)
 	{
 		// If taxation and redistribute model is active then
 		// run it now
-		if (TAX_ENABLED)
+		if (options.tax)
 		{
-			if ((i % TAX_BOUNDARY) == 0)
+			if ((i % taxYear) == 0)
 			{
-				executeIncomeModel();
+				ProfileLap lap;
+				markBulk(aStore);
+				executeIncomeModel(taxman, &active);
 
 				// The taxman collects and redistributes
-				executeTaxModel();
+				executeTaxModel(taxman, &active);
+				foldBulk(aStore);
+				lap(Phase::TAX);
 			}
 
 		}
-		// Randomly select two traders
-		// Once a trader is disenfrachised there is no play
-		auto a = selectTrader();
-		while (trader[a] == 0)
+
+		// Trade up to the next tax or report boundary
+		uint64_t chunk = REPORT_BOUNDARY - (i % REPORT_BOUNDARY);
+		if (options.tax)
 		{
-			a = selectTrader();
+			chunk = std::min(chunk, taxYear - (i % taxYear));
 		}
-		auto b = selectTrader();
-		while ((a == b) || (trader[b] == 0))
+		chunk = std::min(chunk, options.trades - i);
+
+		uint64_t done = options.strategies ? tradeStrategies(aStore, strategies, active, rng, wealth, chunk) : trade(options.kernel, aStore, active, rng, wealth, chunk);
+		i += done;
+		if (done < chunk)
 		{
-			b = selectTrader();
+			break;
 		}
 
-		if (coin())
+		if ((i % REPORT_BOUNDARY) == 0)
 		{
-			++trader[a];
-			--trader[b];
-			stats[a].wins++;
-			stats[b].losses++;
+			report(i, aStore);
 		}
-		else
+
+		if (checkpointer && ((i % options.checkpointEvery) == 0))
 		{
-			--trader[a];
-			++trader[b];
-			stats[b].wins++;
-			stats[a].losses++;
+			saveCheckpoint(i, aStore, [&active, &rng](uint32_t *aOrder, uint8_t *aStreams)
+			{
+				memcpy(aOrder, active.data(), active.size() * sizeof(uint32_t));
+				rng.saveState(aStreams);
+				return active.size();
+			});
 		}
+	}
+	return i;
+}
+
+// Run the trades a leap at a time (approximate, see LeapKernel.h)
+template <typename Store>
+uint64_t runLeap(Store &aStore)
+{
+	RandomStream rng(options.random, options.seed, 0);
 
-		if ((i % (MAX_TRADES / 100000)) == 0)
+	ActiveSet active(aStore.size());
+	for (uint64_t t = 0; t < aStore.size(); ++t)
+	{
+		if (aStore[t] != 0)
 		{
-			// Bin up the results so far
-			std::memset(hist, 0, sizeof(hist));
-			winners = 0;
-			losers = 0;
-			disenfranchised = 0;
+			active.insert(t);
+		}
+	}
 
-			for (uint64_t j = 0; j < DIM(trader); ++j)
+	uint64_t i = 0;
+	while ((i < options.trades) && (active.size() >= 2))
+	{
+		// Whole leaps while they fit, then exact trades for the rest
+		uint64_t step = (active.size() / 2) * options.leap;
+		if (step <= options.trades - i)
+		{
+			ProfileLap lap;
+			lap.selections(active.size() - 1);
+			i += leap(aStore, active, rng, wealth, options.leap, leapStats);
+			lap(Phase::LEAP);
+		}
+		else
+		{
+			uint64_t rest = options.trades - i;
+			uint64_t done = trade(options.kernel, aStore, active, rng, wealth, rest);
+			i += done;
+			if (done < rest)
 			{
-				uint64_t bin = static_cast<uint64_t>((double)trader[j] / (double)LARGEST_BIN * MAX_BINS);
-				if (trader[j] > SEED_MONEY)
-				{
-					++winners;
-				}
-				else if (trader[j] < SEED_MONEY)
-				{
-					++losers;
-				}
-				if (trader[j] == 0)
-				{
-					++disenfranchised;
-				}
-				if (bin < MAX_BINS)
-				{
-					hist[bin]++;
-				}
-				else
-				{
-					hist[DIM(hist) - 1]++;
-				}
+				break;
 			}
+		}
+		report(i, aStore);
+	}
 
-			// Display histogram
-			printf(ESC_POS(1,1));//Top left corner
-			printf(ESC_ERASE_LINE_TO_END);
-			printf("%.3f %% of %llu trades complete\n", (double)(i * 100) / (double)MAX_TRADES, MAX_TRADES);
+	return i;
+}
 
-			uint64_t maxHist = 0;
-			for (int64_t j = (MAX_BINS-1); j >= 0; j--)
+// Run the trades along the edges of the graph, a report interval at a time
+template <typename Store>
+uint64_t runGraph(Store &aStore)
+{
+	RandomStream rng(options.random, options.seed, 0);
+
+	// Edges leave the live set when either end goes broke
+	ActiveSet live(graph.edges());
+	liveEdges(graph, aStore, live);
+
+	TaxModel<Store> taxman(aStore, wealth, 1);
+	const uint64_t taxYear = TAX_YEAR * aStore.size();
+
+	uint64_t i = 0;
+	while (i < options.trades)
+	{
+		if (options.tax && ((i % taxYear) == 0))
+		{
+			ProfileLap lap;
+			markBulk(aStore);
+			if (options.income != 0)
 			{
-				printf(ESC_ERASE_LINE_TO_END);
-				printf("\r%9llu : %9llu : %s\n", (uint64_t)j * BIN_SIZE, hist[j], std::string(static_cast<unsigned int>(hist[j] / scale), '*').c_str());
-				if (hist[j] > maxHist)
+				executeIncomeModel(taxman, nullptr);
+				for (uint32_t t : taxman.revived())
 				{
-					maxHist = hist[j];
+					revive(graph, aStore, live, t);
 				}
 			}
-			scale = 8 * maxHist / 500;
-			printf(ESC_ERASE_LINE_TO_END);
-			printf("\r* = %llu\n", scale);
-			printf(ESC_ERASE_LINE_TO_END);
-			printf("\rWinners = %4llu Even = %4llu Losers = %4llu Disenfranchised = %4llu\n", winners, MAX_TRADERS - winners - losers, losers, disenfranchised);
+			executeTaxModel(taxman, nullptr);
+			for (uint32_t t : taxman.revived())
+			{
+				revive(graph, aStore, live, t);
+			}
+			foldBulk(aStore);
+			lap(Phase::TAX);
+		}
+
+		uint64_t chunk = REPORT_BOUNDARY - (i % REPORT_BOUNDARY);
+		if (options.tax)
+		{
+			chunk = std::min(chunk, taxYear - (i % taxYear));
+		}
+		chunk = std::min(chunk, options.trades - i);
+
+		uint64_t done = tradeOnGraph(aStore, graph, live, rng, wealth, chunk);
+		i += done;
+		if (done < chunk)
+		{
+			break;
+		}
+
+		if ((i % REPORT_BOUNDARY) == 0)
+		{
+			report(i, aStore);
+		}
+	}
+	return i;
+}
+
+// Run the trades in the worker processes an epoch at a time; tax, reports
+// and metrics run here between epochs, when the workers leave the balances be
+template <typename Store>
+uint64_t runProcesses(Store &aStore)
+{
+	TaxModel<Store> taxman(aStore, wealth, 1);
+	const uint64_t taxYear = TAX_YEAR * aStore.size();
+	uint64_t nextTax = 0;
+
+	uint64_t i = 0;
+	while (i < options.trades)
+	{
+		uint64_t epoch = std::min(options.epoch, options.trades - i);
+		bool taxed = false;
+		markBulk(aStore);
+		if (options.tax)
+		{
+			if (i >= nextTax)
+			{
+				ProfileLap lap;
+				executeIncomeModel(taxman, nullptr);
+				executeTaxModel(taxman, nullptr);
+				nextTax = (i / taxYear + 1) * taxYear;
+				taxed = true;
+				lap(Phase::TAX);
+			}
+			epoch = std::min(epoch, nextTax - i);
+		}
+
+		uint64_t done = pool->run(epoch, taxed, wealth);
+		foldBulk(aStore);
+		if (pool->failed())
+		{
+			fprintf(stderr, "A worker process has stopped\n");
+			break;
+		}
+		if ((done == 0) && (pool->solvent() < 2))
+		{
+			// Nobody is left to trade with
+			break;
+		}
+		i += done;
+
+		report(i, aStore);
+	}
+	return i;
+}
+
+// Run the whole simulation with balances of the given width
+template <typename Balance>
+int simulate(void)
+{
+	// Start every trader with the same balance, or carry on from a checkpoint
+	// with the columns used where they lie in the mapped file
+	std::unique_ptr<TraderStore<Balance>> traders;
+	uint64_t first = 0;
+	if (options.resume)
+	{
+		const CheckpointHeader &h = resumed.header();
+		if (options.checkpoint && (strcmp(options.checkpoint, options.resume) == 0))
+		{
+			// Checkpoints replace the file, which Windows refuses while it is
+			// mapped, so the columns are copied out and the file let go
+			traders.reset(new TraderStore<Balance>(h.traders, 0, h.stats != 0));
+			const Balance *balances = resumed.section<Balance>(h.balanceOffset);
+			std::copy(balances, balances + h.traders, traders->balance());
+			if (h.stats)
+			{
+				const uint64_t *wins = resumed.section<uint64_t>(h.winsOffset);
+				const uint64_t *losses = resumed.section<uint64_t>(h.lossesOffset);
+				std::copy(wins, wins + h.traders, traders->wins());
+				std::copy(losses, losses + h.traders, traders->losses());
+			}
+		}
+		else
+		{
+			traders.reset(new TraderStore<Balance>(resumed.mapping(), h.traders, resumed.section<Balance>(h.balanceOffset),
+				h.stats ? resumed.section<uint64_t>(h.winsOffset) : nullptr, h.stats ? resumed.section<uint64_t>(h.lossesOffset) : nullptr));
+		}
+		wealth.load(resumed.section<int64_t>(h.wealthOffset));
+		first = h.trades;
+	}
+	else if (options.processes)
+	{
+		// The columns are in the workers' segment, and they set them up
+		pool.reset(new ProcessEngine());
+		if (!pool->start(program, options.processes, options.traders, options.width, options.stats, SEED_MONEY,
+			SEED_MONEY, MAX_BINS, LARGEST_BIN, options.random, options.seed))
+		{
+			fprintf(stderr, "Cannot start %u worker processes\n", options.processes);
+			return 1;
+		}
+		const SegmentLayout &l = pool->header()->layout;
+		traders.reset(new TraderStore<Balance>(pool->mapping(), l.traders, pool->section<Balance>(l.balanceOffset),
+			l.stats ? pool->section<uint64_t>(l.winsOffset) : nullptr, l.stats ? pool->section<uint64_t>(l.lossesOffset) : nullptr));
+		wealth.clear();
+		for (uint64_t i = 0; i < traders->size(); ++i)
+		{
+			wealth.add((*traders)[i]);
+		}
+	}
+	else
+	{
+		traders.reset(new TraderStore<Balance>(options.traders, static_cast<Balance>(SEED_MONEY), options.stats));
+		wealth.clear();
+		for (uint64_t i = 0; i < traders->size(); ++i)
+		{
+			wealth.add((*traders)[i]);
+		}
+	}
+	TraderStore<Balance> &store = *traders;
+
+	if (options.inequality)
+	{
+		for (uint64_t i = 0; i < store.size(); ++i)
+		{
+			inequality.add(store[i]);
+		}
+		wealth.attach(&inequality);
+	}
+
+	if (!startMetrics(first, store))
+	{
+		return 1;
+	}
+
+	std::unique_ptr<Renderer> renderer;
+	if (options.display)
+	{
+		renderer.reset(new Renderer(snapshots, options.fps, display));
+	}
+
+	Profiler::start();
+	auto t0 = std::chrono::steady_clock::now();
+	uint64_t trades = options.processes ? runProcesses(store) : options.graph ? runGraph(store) : options.leap ? runLeap(store) : (options.threads > 1) ? runParallel(store) : runSerial(store);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+
+	// Show and record the final state, then get out of the way
+	report(trades, store, true);
+	renderer.reset();
+	finishMetrics();
+	if (options.profile)
+	{
+		Profiler::report(trades - first, options.threads);
+	}
+
+	if (options.leap)
+	{
+		printf("Leap: %llu steps of %llu trades per trader, %llu of %llu flows (%.4f %%) clipped at a bound, %llu units not moved\n",
+			leapStats.steps, options.leap, leapStats.clipped, leapStats.flows,
+			leapStats.flows ? 100.0 * (double)leapStats.clipped / (double)leapStats.flows : 0.0, leapStats.unmoved);
+	}
+
+	if (pool)
+	{
+		printf("Processes: %u workers over partitions of %llu traders or more, pinned to their NUMA nodes%s\n",
+			pool->processes(), ProcessEngine::PARTITION_TRADERS, pool->failed() ? ", one of them stopped" : "");
+		pool.reset();
+	}
+
+	if (options.graph)
+	{
+		printf("Graph: %llu edges, mean degree %.2f, largest %llu, %s order (mean edge span %.1f, was %.1f)\n",
+			graph.edges(), 2.0 * (double)graph.edges() / (double)graph.size(), graph.maxDegree(),
+			graphOrderName(options.graphOrder), graph.span(), graphSpan);
+	}
+
+	// Let the last checkpoint reach the disk
+	uint64_t failures = checkpointer ? checkpointer->failures() : 0;
+	checkpointer.reset();
+	if (failures)
+	{
+		fprintf(stderr, "%llu checkpoint(s) could not be written to %s\n", failures, options.checkpoint);
+	}
+
+	if (!options.display)
+	{
+		printf("%llu trades between %llu traders (%u-bit balances, %.1f MB) on %u thread(s) with the %s kernel in %.3f s (%.1f million trades/s)\n",
+			trades, store.size(), options.width, (double)store.bytes() / 1.0e6, options.threads, kernelKindName(options.kernel), elapsed.count(), (double)(trades - first) / elapsed.count() / 1.0e6);
+		printf("Winners = %4llu Even = %4llu Losers = %4llu Disenfranchised = %4llu\n", wealth.winners(), store.size() - wealth.winners() - wealth.losers(), wealth.losers(), wealth.disenfranchised());
+		if (options.inequality)
+		{
+			printf("Gini = %.4f Top 1%% = %.2f %% Top 10%% = %.2f %% Median = %llu\n", inequality.gini(), inequality.topShare(0.01) * 100.0, inequality.topShare(0.10) * 100.0, inequality.quantile(0.5));
 		}
 	}
 
 	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	// A worker of a --processes run (see ProcessEngine.h)
+	if ((argc == 4) && (strcmp(argv[1], "--worker") == 0))
+	{
+		return processWorker(argv[2], static_cast<unsigned int>(strtoul(argv[3], nullptr, 0)));
+	}
+	program = argv[0];
+
+	if (!parseOptions(argc, argv))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Uncomment if needed to convince someone
+	// demoCoinFairness();
 
+	if (options.fairness)
+	{
+		return fairnessBattery(options.fairness, options.threads, options.seed) ? 0 : 1;
+	}
+
+	if (options.sweep)
+	{
+		bool ok;
+		switch (options.width)
+		{
+		case 16:
+			ok = runSweep<uint16_t>(sweep, options.threads, options.sweep);
+			break;
+		case 32:
+			ok = runSweep<uint32_t>(sweep, options.threads, options.sweep);
+			break;
+		default:
+			ok = runSweep<uint64_t>(sweep, options.threads, options.sweep);
+			break;
+		}
+		return ok ? 0 : 1;
+	}
+
+	if (options.bench)
+	{
+		bool ok;
+		switch (options.width)
+		{
+		case 16:
+			ok = runBenchmarks<uint16_t>(bench, options.bench);
+			break;
+		case 32:
+			ok = runBenchmarks<uint32_t>(bench, options.bench);
+			break;
+		default:
+			ok = runBenchmarks<uint64_t>(bench, options.bench);
+			break;
+		}
+		return ok ? 0 : 1;
+	}
+
+	switch (options.width)
+	{
+	case 16:
+		return simulate<uint16_t>();
+	case 32:
+		return simulate<uint32_t>();
+	default:
+		return simulate<uint64_t>();
+	}
 }
 
 // Run program: Ctrl + F5 or Debug > Start Without Debugging menu
@@ -0,0 +1,139 @@
+// Traders.h : Trader state shared between the Traders main program and its trade engines.
+//
+// Traders are stored as a structure of arrays: the balance column is the only
+// one touched to pick and settle a trade, so it is kept separate and as narrow
+// as the run allows (16, 32 or 64 bits). The wins and losses columns are only
+// allocated when statistics are wanted.
+//
+// Columns are 64-byte aligned so that blocks of traders owned by different
+// threads never share a cache line. A store either owns its columns or uses
+// columns that live in a mapped checkpoint file, which is how a resumed run
+// starts without copying the population.
+
+#ifndef _TRADERS_H
+#define _TRADERS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <limits>
+#include <vector>
+#include <memory>
+
+#include "MappedFile.h"
+
+// Largest population; trader numbers are held in 32 bits
+const uint64_t TRADER_LIMIT = 0xFFFFFFFFull;
+
+// Allocator for cache line aligned columns
+template <typename T>
+struct AlignedAllocator
+{
+	typedef T value_type;
+	static const size_t ALIGNMENT = 64;
+
+	AlignedAllocator() {}
+	template <typename U> AlignedAllocator(const AlignedAllocator<U> &) {}
+
+	T *allocate(size_t n)
+	{
+		return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(ALIGNMENT)));
+	}
+	void deallocate(T *p, size_t)
+	{
+		::operator delete(p, std::align_val_t(ALIGNMENT));
+	}
+
+	template <typename U> bool operator==(const AlignedAllocator<U> &) const { return true; }
+	template <typename U> bool operator!=(const AlignedAllocator<U> &) const { return false; }
+};
+
+template <typename T>
+using Column = std::vector<T, AlignedAllocator<T>>;
+
+template <typename Balance>
+class TraderStore
+{
+public:
+	typedef Balance BalanceType;
+
+	// A balance that has reached the ceiling of its column cannot win; the
+	// trade is declined rather than wrapping round. Only reachable with narrow
+	// columns, where it acts as a wealth cap.
+	static constexpr Balance CEILING = std::numeric_limits<Balance>::max();
+
+	TraderStore(uint64_t aCount, Balance aSeedMoney, bool aStats)
+		: ownBalances(aCount, aSeedMoney)
+		, ownWins(aStats ? aCount : 0)
+		, ownLosses(aStats ? aCount : 0)
+		, count(aCount)
+		, balances(ownBalances.data())
+		, winCounts(aStats ? ownWins.data() : nullptr)
+		, lossCounts(aStats ? ownLosses.data() : nullptr)
+	{
+	}
+
+	// Use columns inside a mapping, which is kept alive by the store;
+	// aWins and aLosses are null when there are no statistics
+	TraderStore(std::shared_ptr<MappedFile> aMapping, uint64_t aCount, Balance *aBalances, uint64_t *aWins, uint64_t *aLosses)
+		: count(aCount)
+		, balances(aBalances)
+		, winCounts(aWins)
+		, lossCounts(aLosses)
+		, mapping(aMapping)
+	{
+	}
+
+	TraderStore(const TraderStore &) = delete;
+	TraderStore &operator=(const TraderStore &) = delete;
+
+	uint64_t size() const { return count; }
+	bool hasStats() const { return winCounts != nullptr; }
+
+	Balance *balance() { return balances; }
+	const Balance *balance() const { return balances; }
+	uint64_t *wins() { return winCounts; }
+	uint64_t *losses() { return lossCounts; }
+	const uint64_t *wins() const { return winCounts; }
+	const uint64_t *losses() const { return lossCounts; }
+
+	Balance &operator[](uint64_t aTrader) { return balances[aTrader]; }
+	Balance operator[](uint64_t aTrader) const { return balances[aTrader]; }
+
+	// Move one unit from loser to winner; returns false and changes nothing
+	// if the winner is already at the ceiling
+	bool transfer(uint64_t aWinner, uint64_t aLoser)
+	{
+		if ((sizeof(Balance) < sizeof(uint64_t)) && (balances[aWinner] == CEILING))
+		{
+			return false;
+		}
+		++balances[aWinner];
+		--balances[aLoser];
+		if (hasStats())
+		{
+			winCounts[aWinner]++;
+			lossCounts[aLoser]++;
+		}
+		return true;
+	}
+
+	// Memory held by the columns
+	uint64_t bytes() const
+	{
+		return count * (sizeof(Balance) + (hasStats() ? 2 * sizeof(uint64_t) : 0));
+	}
+
+private:
+	Column<Balance> ownBalances;
+	Column<uint64_t> ownWins;
+	Column<uint64_t> ownLosses;
+
+	uint64_t count;
+	Balance *balances;
+	uint64_t *winCounts;
+	uint64_t *lossCounts;
+	std::shared_ptr<MappedFile> mapping;
+};
+
+#endif	/* _TRADERS_H */
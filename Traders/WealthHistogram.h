@@ -0,0 +1,155 @@
+// WealthHistogram.h : Wealth histogram and winner/loser counters kept up to date per trade.
+//
+// A trade only moves two balances by one unit each, so rather than rescanning
+// every trader to report, the histogram is told about each balance change and
+// adjusts the bins and threshold counters in O(1). Bins come from a lookup
+// table covering 0..largest so the hot path never divides. The table has at
+// most LOOKUP_LIMIT entries: for a larger range each entry covers a power of
+// two of balances, so bin edges are rounded down to a multiple of that.
+//
+// Counts are signed so that a histogram can also hold the net change made by
+// one thread, to be merged into the shared totals later.
+//
+// An InequalityIndex may be attached to the shared histogram to be told about
+// every change as well. Histograms holding changes (blank()) never have one.
+
+#ifndef _WEALTH_HISTOGRAM_H
+#define _WEALTH_HISTOGRAM_H
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "InequalityIndex.h"
+
+class WealthHistogram
+{
+public:
+	WealthHistogram() : par(0), shift(0), winnerCount(0), loserCount(0), brokeCount(0), index(nullptr) {}
+
+	// Balances above par are winners, below par losers. Bins are equal width
+	// up to largest; anything beyond lands in the last bin.
+	WealthHistogram(uint64_t aPar, uint64_t aBins, uint64_t aLargest)
+		: par(aPar)
+		, shift(0)
+		, hist(aBins)
+		, winnerCount(0)
+		, loserCount(0)
+		, brokeCount(0)
+		, index(nullptr)
+	{
+		while ((aLargest >> shift) >= LOOKUP_LIMIT)
+		{
+			++shift;
+		}
+		binOf.resize((aLargest >> shift) + 1);
+		for (uint64_t e = 0; e < binOf.size(); ++e)
+		{
+			// The lowest balance of the entry, without overflowing v * aBins
+			uint64_t v = e << shift;
+			uint64_t b = (v <= UINT64_MAX / aBins) ? v * aBins / aLargest : static_cast<uint64_t>(static_cast<long double>(v) * aBins / aLargest);
+			binOf[e] = static_cast<uint16_t>(std::min(b, aBins - 1));
+		}
+	}
+
+	// Same bins, no counts and no index; for holding changes
+	WealthHistogram blank() const
+	{
+		WealthHistogram h(*this);
+		h.index = nullptr;
+		h.clear();
+		return h;
+	}
+
+	void attach(InequalityIndex *aIndex) { index = aIndex; }
+
+	void clear()
+	{
+		std::fill(hist.begin(), hist.end(), 0);
+		winnerCount = 0;
+		loserCount = 0;
+		brokeCount = 0;
+	}
+
+	uint64_t bin(uint64_t aBalance) const
+	{
+		uint64_t e = aBalance >> shift;
+		return (e < binOf.size()) ? binOf[e] : hist.size() - 1;
+	}
+
+	// Count a trader with this balance
+	void add(uint64_t aBalance)
+	{
+		hist[bin(aBalance)]++;
+		winnerCount += (aBalance > par);
+		loserCount += (aBalance < par);
+		brokeCount += (aBalance == 0);
+		if (index)
+		{
+			index->add(aBalance);
+		}
+	}
+
+	// A trader's balance has changed
+	void move(uint64_t aFrom, uint64_t aTo)
+	{
+		hist[bin(aFrom)]--;
+		hist[bin(aTo)]++;
+		winnerCount += static_cast<int64_t>(aTo > par) - static_cast<int64_t>(aFrom > par);
+		loserCount += static_cast<int64_t>(aTo < par) - static_cast<int64_t>(aFrom < par);
+		brokeCount += static_cast<int64_t>(aTo == 0) - static_cast<int64_t>(aFrom == 0);
+		if (index)
+		{
+			index->move(aFrom, aTo);
+		}
+	}
+
+	// Fold in the changes counted by another histogram with the same bins
+	void merge(const WealthHistogram &aDelta)
+	{
+		for (uint64_t i = 0; i < hist.size(); ++i)
+		{
+			hist[i] += aDelta.hist[i];
+		}
+		winnerCount += aDelta.winnerCount;
+		loserCount += aDelta.loserCount;
+		brokeCount += aDelta.brokeCount;
+	}
+
+	// Counts as bins() + 3 words, for checkpoints
+	void save(int64_t *aOut) const
+	{
+		std::copy(hist.begin(), hist.end(), aOut);
+		aOut[hist.size()] = winnerCount;
+		aOut[hist.size() + 1] = loserCount;
+		aOut[hist.size() + 2] = brokeCount;
+	}
+
+	void load(const int64_t *aIn)
+	{
+		std::copy(aIn, aIn + hist.size(), hist.begin());
+		winnerCount = aIn[hist.size()];
+		loserCount = aIn[hist.size() + 1];
+		brokeCount = aIn[hist.size() + 2];
+	}
+
+	uint64_t bins() const { return hist.size(); }
+	uint64_t operator[](uint64_t aBin) const { return static_cast<uint64_t>(hist[aBin]); }
+	uint64_t winners() const { return static_cast<uint64_t>(winnerCount); }
+	uint64_t losers() const { return static_cast<uint64_t>(loserCount); }
+	uint64_t disenfranchised() const { return static_cast<uint64_t>(brokeCount); }
+
+private:
+	static const uint64_t LOOKUP_LIMIT = 1 << 20;
+
+	uint64_t par;
+	unsigned int shift;				// Balances per lookup entry, as a power of two
+	std::vector<uint16_t> binOf;
+	std::vector<int64_t> hist;
+	int64_t winnerCount;
+	int64_t loserCount;
+	int64_t brokeCount;
+	InequalityIndex *index;
+};
+
+#endif	/* _WEALTH_HISTOGRAM_H */
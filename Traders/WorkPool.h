@@ -0,0 +1,166 @@
+// WorkPool.h : Work-stealing thread pool for independent tasks.
+//
+// Tasks are numbers handed to a callback. A run deals them out round robin to
+// one queue per thread, in the order given, so putting the longest first
+// spreads them evenly. Each thread works through its own queue from the front
+// and, once that is empty, steals from the back of the others, so a thread that
+// drew short tasks keeps busy until the whole run is done.
+//
+// The calling thread works queue 0 itself, so N threads means N-1 workers,
+// which sleep between runs.
+
+#ifndef _WORK_POOL_H
+#define _WORK_POOL_H
+
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <algorithm>
+
+class WorkStealingPool
+{
+public:
+	// aTask(task, thread)
+	typedef std::function<void(uint64_t, unsigned int)> Task;
+
+	explicit WorkStealingPool(unsigned int aThreads)
+		: queues(std::max(1u, aThreads))
+		, generation(0)
+		, pending(0)
+		, stopping(false)
+	{
+		for (unsigned int i = 1; i < queues.size(); ++i)
+		{
+			workers.emplace_back(&WorkStealingPool::worker, this, i);
+		}
+	}
+
+	~WorkStealingPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		start.notify_all();
+		for (auto &w : workers)
+		{
+			w.join();
+		}
+	}
+
+	WorkStealingPool(const WorkStealingPool &) = delete;
+	WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+	unsigned int threads() const { return static_cast<unsigned int>(queues.size()); }
+
+	// Run every task in aOrder and return when they are all done
+	void run(const std::vector<uint64_t> &aOrder, Task aTask)
+	{
+		for (uint64_t k = 0; k < aOrder.size(); ++k)
+		{
+			queues[k % queues.size()].tasks.push_back(aOrder[k]);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			task = aTask;
+			pending = static_cast<unsigned int>(queues.size() - 1);
+			++generation;
+		}
+		start.notify_all();
+
+		work(0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [this] { return pending == 0; });
+		task = nullptr;
+	}
+
+private:
+	// Padded so that queues used by different threads never share a cache line
+	struct alignas(64) Queue
+	{
+		std::mutex mutex;
+		std::deque<uint64_t> tasks;
+	};
+
+	// The next task for thread aThread: its own first, then stolen
+	bool next(unsigned int aThread, uint64_t &aTask)
+	{
+		{
+			Queue &own = queues[aThread];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.tasks.empty())
+			{
+				aTask = own.tasks.front();
+				own.tasks.pop_front();
+				return true;
+			}
+		}
+		for (unsigned int k = 1; k < queues.size(); ++k)
+		{
+			Queue &victim = queues[(aThread + k) % queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tasks.empty())
+			{
+				aTask = victim.tasks.back();
+				victim.tasks.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void work(unsigned int aThread)
+	{
+		uint64_t t;
+		while (next(aThread, t))
+		{
+			task(t, aThread);
+		}
+	}
+
+	void worker(unsigned int aThread)
+	{
+		uint64_t seen = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start.wait(lock, [&] { return stopping || (generation != seen); });
+				if (stopping)
+				{
+					return;
+				}
+				seen = generation;
+			}
+
+			work(aThread);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--pending == 0)
+				{
+					finished.notify_one();
+				}
+			}
+		}
+	}
+
+	std::vector<Queue> queues;
+	std::vector<std::thread> workers;
+	Task task;
+
+	std::mutex mutex;
+	std::condition_variable start;
+	std::condition_variable finished;
+	uint64_t generation;
+	unsigned int pending;
+	bool stopping;
+};
+
+#endif	/* _WORK_POOL_H */